@@ -5,6 +5,17 @@ layout (location = 0) out vec4 pixel_color;
 
 layout (set = 0, binding = 0) uniform sampler2D albedo;
 
+// Follows the model-view-projection matrix of the vertex stage.
+layout (push_constant) uniform Material {
+  layout (offset = 64) uint is_srgb_in_shader;
+} material;
+
 void main () {
   pixel_color = texture (albedo, uv);
+
+  // Formats without an sRGB variant sample the encoded values as they are.
+  if (material.is_srgb_in_shader != 0) {
+    const vec3 color = pixel_color.rgb;
+    pixel_color.rgb = mix (color / 12.92, pow ((color + 0.055) / 1.055, vec3 (2.4)), step (0.04045, color));
+  }
 }
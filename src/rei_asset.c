@@ -1,108 +1,825 @@
+// clock_gettime and stat's nanosecond timestamps aren't part of C99.
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <time.h>
 #include <stdio.h>
 #include <memory.h>
 #include <string.h>
+#include <stdlib.h>
 
 #ifdef __linux__
 #  include <dirent.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
 #else
 #  error "Unhandled platform..."
 #endif
 
+#include "rei_bc.h"
+#include "rei_hash.h"
 #include "rei_asset.h"
 #include "rei_debug.h"
 #include "rei_parse.h"
+#include "rei_pixel.h"
 #include "rei_asset_loaders.h"
 
 #include <lz4/lib/lz4.h>
 
 #define _S_RTEXTURE_JSON_MAX_SIZE 128u
+// Entries of the linear to sRGB table, enough for neighbouring entries to never be more than one 8-bit step apart.
+#define _S_LINEAR_TO_SRGB_SIZE 8192u
+// Blocks a single encoding task takes on at least, smaller levels aren't worth splitting up.
+#define _S_ENCODE_GRAIN_BLOCKS 256u
+// Chunks a single decompression task takes on at least.
+#define _S_UNPACK_GRAIN_CHUNKS 2u
+
+// 8-bit values to linear ones, sRGB decoded for the first 256 entries (color channels), scaled for the rest (alpha and
+// linear data).
+static f32 _s_decode_table[512];
+static u8 _s_linear_to_srgb[_S_LINEAR_TO_SRGB_SIZE];
+static pthread_once_t _s_tables_once = PTHREAD_ONCE_INIT;
+
+static void _s_init_tables (void) {
+  for (u32 i = 0; i < 256; ++i) {
+    const f32 value = (f32) i / 255.f;
+
+    _s_decode_table[i] = value <= 0.04045f ? value / 12.92f : powf ((value + 0.055f) / 1.055f, 2.4f);
+    _s_decode_table[256 + i] = value;
+  }
+
+  for (u32 i = 0; i < _S_LINEAR_TO_SRGB_SIZE; ++i) {
+    const f32 value = (f32) i / (f32) (_S_LINEAR_TO_SRGB_SIZE - 1u);
+    const f32 srgb = value <= 0.0031308f ? value * 12.92f : 1.055f * powf (value, 1.f / 2.4f) - 0.055f;
+
+    _s_linear_to_srgb[i] = (u8) (srgb * 255.f + 0.5f);
+  }
+}
+
+// RGBA8 pixels to linear floats. Color channels look up the table at color_offset, 0 for sRGB and 256 for linear data.
+static void _s_decode_row (const u8* src, u32 width, u32 color_offset, f32* dst) {
+  u32 i = 0;
+
+#ifdef __AVX2__
+  // Two pixels at a time, alpha lanes always look up the second half of the table.
+  const s32 offset = (s32) color_offset;
+  const __m256i table_offset = _mm256_setr_epi32 (offset, offset, offset, 256, offset, offset, offset, 256);
+
+  for (; i + 2 <= width; i += 2) {
+    const __m256i pixels = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i*) (src + i * 4)));
+    _mm256_storeu_ps (dst + i * 4, _mm256_i32gather_ps (_s_decode_table, _mm256_add_epi32 (pixels, table_offset), 4));
+  }
+#endif
+
+  for (; i < width; ++i) {
+    dst[i * 4 + 0] = _s_decode_table[color_offset + src[i * 4 + 0]];
+    dst[i * 4 + 1] = _s_decode_table[color_offset + src[i * 4 + 1]];
+    dst[i * 4 + 2] = _s_decode_table[color_offset + src[i * 4 + 2]];
+    dst[i * 4 + 3] = _s_decode_table[256 + src[i * 4 + 3]];
+  }
+}
+
+// 2x2 box filter of two linear rows, each holding twice as many pixels as dst. A pixel fits an SSE register, an AVX
+// version pairing even and odd pixels with cross lane permutes measured slower.
+static void _s_filter_rows (const f32* restrict row0, const f32* restrict row1, u32 dst_width, f32* restrict dst) {
+  u32 i = 0;
+
+  const __m128 quarter = _mm_set1_ps (0.25f);
+
+  for (; i < dst_width; ++i) {
+    const __m128 top = _mm_add_ps (_mm_loadu_ps (row0 + i * 8), _mm_loadu_ps (row0 + i * 8 + 4));
+    const __m128 bottom = _mm_add_ps (_mm_loadu_ps (row1 + i * 8), _mm_loadu_ps (row1 + i * 8 + 4));
+
+    _mm_storeu_ps (dst + i * 4, _mm_mul_ps (_mm_add_ps (top, bottom), quarter));
+  }
+}
+
+// Linear floats back to RGBA8 pixels, sRGB encoded unless the texture holds linear data.
+static void _s_encode_row (const f32* src, u32 width, b32 is_srgb, u8* dst) {
+  const f32 color_scale = is_srgb ? (f32) (_S_LINEAR_TO_SRGB_SIZE - 1u) : 255.f;
+  const __m128 scale = _mm_setr_ps (color_scale, color_scale, color_scale, 255.f);
+  const __m128 half = _mm_set1_ps (0.5f);
+
+  for (u32 i = 0; i < width; ++i) {
+    u32 indices[4] REI_ALIGN_AS (16);
+    _mm_store_si128 ((__m128i*) indices, _mm_cvttps_epi32 (_mm_add_ps (_mm_mul_ps (_mm_loadu_ps (src + i * 4), scale), half)));
+
+    if (is_srgb) {
+      dst[i * 4 + 0] = _s_linear_to_srgb[indices[0]];
+      dst[i * 4 + 1] = _s_linear_to_srgb[indices[1]];
+      dst[i * 4 + 2] = _s_linear_to_srgb[indices[2]];
+    } else {
+      dst[i * 4 + 0] = (u8) indices[0];
+      dst[i * 4 + 1] = (u8) indices[1];
+      dst[i * 4 + 2] = (u8) indices[2];
+    }
+
+    dst[i * 4 + 3] = (u8) indices[3];
+  }
+}
+
+// Halve an RGBA8 level, filtering in linear space. Odd trailing rows and columns are dropped.
+static void _s_downsample (
+  const u8* src,
+  u32 src_width,
+  u32 src_height,
+  u8* dst,
+  u32 dst_width,
+  u32 dst_height,
+  b32 is_srgb,
+  f32* rows) {
+
+  f32* row0 = rows;
+  f32* row1 = rows + dst_width * 8u;
+  f32* filtered = rows + dst_width * 16u;
+
+  // A single source column is read twice.
+  const u32 read_width = REI_MIN (src_width, dst_width * 2u);
+  const u32 color_offset = is_srgb ? 0u : 256u;
+
+  for (u32 y = 0; y < dst_height; ++y) {
+    const u8* src_row0 = src + (u64) src_width * 4u * REI_MIN (y * 2u, src_height - 1u);
+    const u8* src_row1 = src + (u64) src_width * 4u * REI_MIN (y * 2u + 1u, src_height - 1u);
+
+    _s_decode_row (src_row0, read_width, color_offset, row0);
+    _s_decode_row (src_row1, read_width, color_offset, row1);
+
+    if (read_width < dst_width * 2u) {
+      memcpy (row0 + 4, row0, sizeof *row0 * 4u);
+      memcpy (row1 + 4, row1, sizeof *row1 * 4u);
+    }
+
+    _s_filter_rows (row0, row1, dst_width, filtered);
+    _s_encode_row (filtered, dst_width, is_srgb, dst + (u64) dst_width * 4u * y);
+  }
+}
+
+// Tangent space normal maps are opaque and every pixel is a unit vector pointing away from the surface. Sources are
+// often JPEG, so a few pixels are allowed to be off.
+static b32 _s_is_normal_map (const u8* pixels, u64 pixel_count) {
+  const u64 max_outlier_count = pixel_count / 100u;
+  u64 outlier_count = 0;
+
+  for (u64 i = 0; i < pixel_count; ++i) {
+    const u8* pixel = pixels + i * 4u;
+
+    const f32 x = (f32) pixel[0] / 127.5f - 1.f;
+    const f32 y = (f32) pixel[1] / 127.5f - 1.f;
+    const f32 z = (f32) pixel[2] / 127.5f - 1.f;
+    const f32 length = x * x + y * y + z * z;
+
+    if ((pixel[3] != 255 || z < 0.f || length < 0.8f || length > 1.2f) && ++outlier_count > max_outlier_count) return REI_FALSE;
+  }
+
+  return REI_TRUE;
+}
+
+static u32 _s_and_lanes (__m128i value) {
+  value = _mm_and_si128 (value, _mm_shuffle_epi32 (value, 0x4e));
+  value = _mm_and_si128 (value, _mm_shuffle_epi32 (value, 0xb1));
+
+  return (u32) _mm_cvtsi128_si32 (value);
+}
+
+static u32 _s_or_lanes (__m128i value) {
+  value = _mm_or_si128 (value, _mm_shuffle_epi32 (value, 0x4e));
+  value = _mm_or_si128 (value, _mm_shuffle_epi32 (value, 0xb1));
+
+  return (u32) _mm_cvtsi128_si32 (value);
+}
+
+// Work out which channels of RGBA pixels are worth storing: channels that are 0 or 255 throughout aren't, and neither
+// are channels repeating an earlier one (e.g. green and blue of grayscale images). Returns how many are, with the
+// channels they come from in stored and where every channel is sampled from in swizzle (rei_texture_swizzle_e).
+static u32 _s_reduce_channels (const u8* pixels, u64 pixel_count, u8* swizzle, u8* stored) {
+  // Bitwise and and or of every channel, and bytes of equal[i] set where a channel matches the one i + 1 before it.
+  __m128i all_and = _mm_set1_epi8 (-1);
+  __m128i all_or = _mm_setzero_si128 ();
+  __m128i equal[3] = {all_and, all_and, all_and};
+
+  u64 i = 0;
+  for (; i + 4u <= pixel_count; i += 4u) {
+    const __m128i value = _mm_loadu_si128 ((const __m128i*) (pixels + i * 4u));
+
+    all_and = _mm_and_si128 (all_and, value);
+    all_or = _mm_or_si128 (all_or, value);
+    equal[0] = _mm_and_si128 (equal[0], _mm_cmpeq_epi8 (value, _mm_slli_epi32 (value, 8)));
+    equal[1] = _mm_and_si128 (equal[1], _mm_cmpeq_epi8 (value, _mm_slli_epi32 (value, 16)));
+    equal[2] = _mm_and_si128 (equal[2], _mm_cmpeq_epi8 (value, _mm_slli_epi32 (value, 24)));
+  }
+
+  u32 channels_and = _s_and_lanes (all_and);
+  u32 channels_or = _s_or_lanes (all_or);
+  u32 channels_equal[3] = {_s_and_lanes (equal[0]), _s_and_lanes (equal[1]), _s_and_lanes (equal[2])};
+
+  for (; i < pixel_count; ++i) {
+    const u8* pixel = pixels + i * 4u;
+
+    for (u32 c = 0; c < 4u; ++c) {
+      channels_and &= ~(0xffu << c * 8u) | (u32) pixel[c] << c * 8u;
+      channels_or |= (u32) pixel[c] << c * 8u;
+
+      for (u32 d = 1; d <= c; ++d) {
+        if (pixel[c] != pixel[c - d]) channels_equal[d - 1u] &= ~(0xffu << c * 8u);
+      }
+    }
+  }
+
+  u32 stored_count = 0;
+
+  for (u32 c = 0; c < 4u; ++c) {
+    const u32 shift = c * 8u;
+
+    if (!((channels_or >> shift) & 0xffu)) {
+      swizzle[c] = REI_TEXTURE_SWIZZLE_ZERO;
+    } else if (((channels_and >> shift) & 0xffu) == 0xffu) {
+      swizzle[c] = REI_TEXTURE_SWIZZLE_ONE;
+    } else {
+      u32 source = REI_U32_MAX;
+      for (u32 d = 1; d <= c; ++d) {
+        if (((channels_equal[d - 1u] >> shift) & 0xffu) == 0xffu) source = swizzle[c - d];
+      }
+
+      if (source == REI_U32_MAX) {
+        source = REI_TEXTURE_SWIZZLE_R + stored_count;
+        stored[stored_count++] = (u8) c;
+      }
+
+      swizzle[c] = (u8) source;
+    }
+  }
+
+  return stored_count;
+}
+
+// Copy the stored channels (see _s_reduce_channels) to the front of every pixel, where the BC4 and BC5 encoders read
+// them. Takes ownership of pixels.
+static u8* _s_move_channels (u8* pixels, u64 pixel_count, const u8* stored, u32 stored_count) {
+  u8 channels[4];
+  b32 is_in_place = REI_TRUE;
+
+  for (u32 i = 0; i < 4u; ++i) {
+    channels[i] = stored_count ? stored[i % stored_count] : 0;
+    is_in_place &= i >= stored_count || stored[i] == i;
+  }
+
+  if (is_in_place) return pixels;
+
+  u8* moved = malloc (pixel_count * 4u);
+  rei_pixel_pack (pixels, pixel_count, channels, 4u, moved);
+  free (pixels);
+
+  return moved;
+}
+
+typedef u32 (* _s_encode_block_f) (const u8* restrict pixels, u8* restrict out);
+
+static _s_encode_block_f _s_get_block_encoder (rei_texture_format_e format, u32* block_size) {
+  switch (format) {
+    case REI_TEXTURE_FORMAT_BC1: *block_size = REI_BC1_BLOCK_SIZE; return rei_bc1_encode_block;
+    case REI_TEXTURE_FORMAT_BC3: *block_size = REI_BC3_BLOCK_SIZE; return rei_bc3_encode_block;
+    case REI_TEXTURE_FORMAT_BC4: *block_size = REI_BC4_BLOCK_SIZE; return rei_bc4_encode_block;
+    case REI_TEXTURE_FORMAT_BC5: *block_size = REI_BC5_BLOCK_SIZE; return rei_bc5_encode_block;
+    case REI_TEXTURE_FORMAT_BC7: *block_size = REI_BC7_BLOCK_SIZE; return rei_bc7_encode_block;
+    default: REI_ASSERT (!"Not a block compressed format"); return NULL;
+  }
+}
+
+static u64 _s_get_block_count (u32 width, u32 height) {
+  return (u64) ((width + REI_BC_BLOCK_DIM - 1u) / REI_BC_BLOCK_DIM) * ((height + REI_BC_BLOCK_DIM - 1u) / REI_BC_BLOCK_DIM);
+}
+
+typedef struct _s_level_encode_t {
+  const u8* pixels;
+  u8* out;
+  _s_encode_block_f encode_block;
+  u32 width;
+  u32 height;
+  u32 block_size;
+  u32 __padding;
+  // Sum of squared errors of all blocks, added to once per task.
+  u64 error;
+} _s_level_encode_t;
+
+static void _s_encode_block_rows (u64 begin, u64 end, void* ctx) {
+  _s_level_encode_t* level = (_s_level_encode_t*) ctx;
+
+  const u32 block_columns = (level->width + REI_BC_BLOCK_DIM - 1u) / REI_BC_BLOCK_DIM;
+  u64 error = 0;
+
+  for (u64 block_y = begin; block_y < end; ++block_y) {
+    for (u32 block_x = 0; block_x < block_columns; ++block_x) {
+      u8 block[REI_BC_BLOCK_DIM * REI_BC_BLOCK_DIM * 4u];
+
+      // Blocks hanging over the edge of the level repeat its last row and column.
+      for (u32 y = 0; y < REI_BC_BLOCK_DIM; ++y) {
+        const u64 src_y = REI_MIN (block_y * REI_BC_BLOCK_DIM + y, level->height - 1u);
+
+        for (u32 x = 0; x < REI_BC_BLOCK_DIM; ++x) {
+          const u32 src_x = REI_MIN (block_x * REI_BC_BLOCK_DIM + x, level->width - 1u);
+          memcpy (block + (y * REI_BC_BLOCK_DIM + x) * 4u, level->pixels + (src_y * level->width + src_x) * 4u, 4u);
+        }
+      }
+
+      error += level->encode_block (block, level->out + (block_y * block_columns + block_x) * level->block_size);
+    }
+  }
+
+  __atomic_fetch_add (&level->error, error, __ATOMIC_RELAXED);
+}
+
+// Block compress a level of RGBA8 pixels into out, returns the sum of squared errors. thread_pool is optional.
+static u64 _s_encode_level (
+  rei_thread_pool_t* thread_pool,
+  rei_texture_format_e format,
+  const u8* pixels,
+  u32 width,
+  u32 height,
+  u8* out) {
+
+  _s_level_encode_t level = {
+    .pixels = pixels,
+    .out = out,
+    .width = width,
+    .height = height,
+  };
+
+  level.encode_block = _s_get_block_encoder (format, &level.block_size);
+
+  const u32 block_columns = (width + REI_BC_BLOCK_DIM - 1u) / REI_BC_BLOCK_DIM;
+  const u32 block_rows = (height + REI_BC_BLOCK_DIM - 1u) / REI_BC_BLOCK_DIM;
+
+  if (thread_pool) {
+    const u64 grain = (_S_ENCODE_GRAIN_BLOCKS + block_columns - 1u) / block_columns;
+    rei_parallel_for (thread_pool, 0, block_rows, grain, _s_encode_block_rows, &level);
+  } else {
+    _s_encode_block_rows (0, block_rows, &level);
+  }
+
+  return level.error;
+}
+
+// PSNR of a level's encoding in dB, over the channels its format stores.
+static f64 _s_get_psnr (u64 error, u32 width, u32 height, u32 channel_count) {
+  if (!error) return HUGE_VAL;
+
+  const f64 sample_count = (f64) _s_get_block_count (width, height) * (f64) (REI_BC_BLOCK_DIM * REI_BC_BLOCK_DIM * channel_count);
+  return 10.0 * log10 (255.0 * 255.0 * sample_count / (f64) error);
+}
+
+// Split mips into chunks, compress them and write the texture out. Everything in header but mip offsets, stored sizes
+// and chunks has to be filled in, mip i is read from data + data_offsets[i].
+static rei_result_e _s_write_texture (
+  const char* const relative_path,
+  rei_texture_header_t* header,
+  const u8* data,
+  const u64* data_offsets,
+  rei_file_batch_t* batch) {
+
+  header->chunk_count = 0;
+  u64 compressed_bound = 0;
+
+  for (u32 i = 0; i < header->mip_count; ++i) {
+    rei_texture_mip_t* mip = &header->mips[i];
+    mip->first_chunk = header->chunk_count;
+
+    for (u32 chunk_offset = 0; chunk_offset < mip->size; chunk_offset += REI_TEXTURE_CHUNK_SIZE) {
+      compressed_bound += (u64) LZ4_compressBound ((s32) REI_MIN (REI_TEXTURE_CHUNK_SIZE, mip->size - chunk_offset));
+      ++header->chunk_count;
+    }
+
+    compressed_bound += REI_TEXTURE_ALIGNMENT;
+  }
+
+  const u64 table_size = sizeof (rei_texture_chunk_t) * header->chunk_count;
+  const u64 padded_table_size = (table_size + REI_TEXTURE_ALIGNMENT - 1u) & ~(u64) (REI_TEXTURE_ALIGNMENT - 1u);
+
+  rei_texture_chunk_t* chunks = malloc (padded_table_size);
+  memset (chunks, 0, padded_table_size);
+
+  char* compressed_data = malloc (compressed_bound);
+  u64 compressed_size = 0;
+
+  for (u32 i = 0; i < header->mip_count; ++i) {
+    rei_texture_mip_t* mip = &header->mips[i];
 
-rei_result_e rei_texture_compress (const char* const relative_path) {
+    mip->offset = sizeof *header + padded_table_size + compressed_size;
+    mip->stored_size = 0;
+
+    rei_texture_chunk_t* chunk = &chunks[mip->first_chunk];
+    for (u32 chunk_offset = 0; chunk_offset < mip->size; chunk_offset += REI_TEXTURE_CHUNK_SIZE, ++chunk) {
+      chunk->offset = mip->stored_size;
+      chunk->stored_size = (u32) LZ4_compress_default (
+        (const char*) data + data_offsets[i] + chunk_offset,
+        compressed_data + compressed_size + mip->stored_size,
+        (s32) REI_MIN (REI_TEXTURE_CHUNK_SIZE, mip->size - chunk_offset),
+        (s32) (compressed_bound - compressed_size - mip->stored_size)
+      );
+
+      mip->stored_size += chunk->stored_size;
+    }
+
+    // Padding between levels keeps every one of them aligned.
+    const u64 padded_size = (mip->stored_size + REI_TEXTURE_ALIGNMENT - 1u) & ~(u64) (REI_TEXTURE_ALIGNMENT - 1u);
+    memset (compressed_data + compressed_size + mip->stored_size, 0, padded_size - mip->stored_size);
+    compressed_size += padded_size;
+  }
+
+  rei_file_writer_t writer;
+  rei_result_e result = rei_open_file_writer (relative_path, &writer);
+
+  if (!result) {
+    rei_append_file (&writer, header, sizeof *header);
+    rei_append_file (&writer, chunks, padded_table_size);
+    rei_append_file (&writer, compressed_data, compressed_size);
+
+    result = rei_close_file_writer (&writer, batch);
+  }
+
+  free (compressed_data);
+  free (chunks);
+
+  return result;
+}
+
+rei_result_e rei_texture_compress (rei_thread_pool_t* thread_pool, const char* const relative_path, rei_file_batch_t* batch) {
   rei_image_t src_image;
 
   char out_path[128] = {0};
   strcpy (out_path, relative_path);
 
   char* ext = strrchr (out_path, '.');
+  if (!ext++) return REI_RESULT_UNSUPPORTED_FILE_TYPE;
 
-  if (ext++) {
-    if (!strcmp (ext, "jpg") || !strcmp (ext, "jpeg")) {
-      rei_load_jpeg (relative_path, &src_image);
-    } else if (!strcmp (ext, "png")) {
-      rei_load_png (relative_path, &src_image);
-    } else {
-      return REI_RESULT_UNSUPPORTED_FILE_TYPE;
-    }
+  rei_result_e result;
+  if (!strcmp (ext, "jpg") || !strcmp (ext, "jpeg")) {
+    result = rei_load_jpeg (relative_path, &src_image);
+  } else if (!strcmp (ext, "png")) {
+    result = rei_load_png (relative_path, &src_image);
+  } else {
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
+
+  if (result) return result;
+
+  // Loaders expand everything else to RGB(A).
+  if (src_image.component_count != 3 && src_image.component_count != 4) {
+    free (src_image.pixels);
+    return REI_RESULT_INVALID_IMAGE;
+  }
+
+  const u64 pixel_count = (u64) src_image.width * src_image.height;
+
+  rei_texture_header_t header = {
+    .magic = REI_TEXTURE_MAGIC,
+    .version = REI_TEXTURE_VERSION,
+    .flags = REI_TEXTURE_FLAG_LZ4,
+    .width = src_image.width,
+    .height = src_image.height,
+    .swizzle = {REI_TEXTURE_SWIZZLE_R, REI_TEXTURE_SWIZZLE_G, REI_TEXTURE_SWIZZLE_B, REI_TEXTURE_SWIZZLE_A},
+  };
+
+  // Full chain down to 1x1.
+  header.mip_count = 1;
+  while (header.mip_count < REI_TEXTURE_MAX_MIPS && REI_MAX (header.width, header.height) >> header.mip_count) ++header.mip_count;
+
+  u32 mip_widths[REI_TEXTURE_MAX_MIPS];
+  u32 mip_heights[REI_TEXTURE_MAX_MIPS];
+
+  // All levels live in a single allocation, each one right after the previous.
+  u64 mip_offsets[REI_TEXTURE_MAX_MIPS];
+  u64 chain_size = 0;
+  u64 block_count = 0;
+
+  for (u32 i = 0; i < header.mip_count; ++i) {
+    mip_widths[i] = REI_MAX (header.width >> i, 1u);
+    mip_heights[i] = REI_MAX (header.height >> i, 1u);
+
+    mip_offsets[i] = chain_size;
+    chain_size += (u64) mip_widths[i] * mip_heights[i] * 4u;
+    block_count += _s_get_block_count (mip_widths[i], mip_heights[i]);
   }
 
-  // Compress image.
-  const s32 image_size = (s32) (src_image.width * src_image.height * src_image.component_count);
-  const s32 compressed_bound = LZ4_compressBound (image_size);
+  // Mips are filtered with four channels, RGB images are expanded right into the first level (opaque).
+  u8* chain;
+  if (src_image.component_count == 3) {
+    chain = malloc (chain_size);
+    rei_pixel_expand_rgb (src_image.pixels, pixel_count, chain);
+    free (src_image.pixels);
+  } else {
+    chain = realloc (src_image.pixels, chain_size);
+  }
 
-  char* compressed_data = malloc ((u64) compressed_bound);
-  const char* image_data = (const char*) src_image.pixels;
-  const s32 compressed_size = LZ4_compress_default (image_data, compressed_data, image_size, compressed_bound);
+  // Normal maps aren't color, they're neither sRGB encoded nor filtered as such.
+  const b32 is_normal_map = _s_is_normal_map (chain, pixel_count);
 
-  // Shrink allocated buffer if necessary.
-  if (compressed_size < compressed_bound) {
-    char* temp = compressed_data;
-    compressed_data = malloc ((u64) compressed_size);
-    memcpy (compressed_data, temp, (u64) compressed_size);
-    free (temp);
+  // Color textures storing fewer channels than BC1 (BC3) does are sampled back through a swizzle, two channels are
+  // only worth BC5 over BC1 when alpha is one of them or BC1 can't encode them well.
+  u8 swizzle[4];
+  u8 stored[4];
+  const u32 stored_count = is_normal_map ? 2u : _s_reduce_channels (chain, pixel_count, swizzle, stored);
+  const b32 has_alpha = !is_normal_map && swizzle[3] != REI_TEXTURE_SWIZZLE_ONE;
+
+  if (is_normal_map) {
+    header.format = REI_TEXTURE_FORMAT_BC5;
+  } else if (stored_count <= 1u) {
+    header.format = REI_TEXTURE_FORMAT_BC4;
+  } else if (stored_count == 2u && has_alpha) {
+    header.format = REI_TEXTURE_FORMAT_BC5;
+  } else {
+    header.format = has_alpha ? REI_TEXTURE_FORMAT_BC3 : REI_TEXTURE_FORMAT_BC1;
   }
 
-  // Create JSON metadata.
-  char json_metadata[_S_RTEXTURE_JSON_MAX_SIZE] = {0};
-  char json_metadata_fmt[] = "{\"width\":%u,\"height\":%u,\"component_count\":%u,\"compressed_size\":%u}";
+  if (!is_normal_map) header.flags |= REI_TEXTURE_FLAG_SRGB;
+
+  // Two decoded source rows and a filtered one, see _s_downsample.
+  f32* rows = malloc (sizeof *rows * 20u * REI_MAX (header.width >> 1u, 1u));
+
+  pthread_once (&_s_tables_once, _s_init_tables);
+
+  for (u32 i = 1; i < header.mip_count; ++i) {
+    _s_downsample (
+      chain + mip_offsets[i - 1],
+      mip_widths[i - 1],
+      mip_heights[i - 1],
+      chain + mip_offsets[i],
+      mip_widths[i],
+      mip_heights[i],
+      !is_normal_map,
+      rows
+    );
+  }
+
+  free (rows);
+
+  b32 is_reduced = !is_normal_map && (header.format == REI_TEXTURE_FORMAT_BC4 || header.format == REI_TEXTURE_FORMAT_BC5);
+  if (is_reduced) chain = _s_move_channels (chain, chain_size / 4u, stored, stored_count);
+
+  // Big enough for any of the formats, whose blocks are at most 16 bytes.
+  u8* encoded = malloc (block_count * 16u);
+  u64 error = _s_encode_level (thread_pool, header.format, chain, header.width, header.height, encoded);
+
+  // The first level decides whether the texture is worth twice the memory. Two channels are better off in BC5, BC7
+  // carries alpha either way (exactly so for opaque textures), so its error compares as is.
+  const u32 channel_count = header.format == REI_TEXTURE_FORMAT_BC1 ? 3u : 4u;
+  const b32 is_bc1_or_bc3 = header.format == REI_TEXTURE_FORMAT_BC1 || header.format == REI_TEXTURE_FORMAT_BC3;
+  const b32 is_poor = is_bc1_or_bc3 && _s_get_psnr (error, header.width, header.height, channel_count) < REI_ASSET_COOK_MIN_PSNR;
+
+  if (is_poor && stored_count == 2u) {
+    header.format = REI_TEXTURE_FORMAT_BC5;
+    is_reduced = REI_TRUE;
+
+    chain = _s_move_channels (chain, chain_size / 4u, stored, stored_count);
+    _s_encode_level (thread_pool, header.format, chain, header.width, header.height, encoded);
+  } else if (is_poor) {
+    u8* candidate = malloc (_s_get_block_count (header.width, header.height) * REI_BC7_BLOCK_SIZE);
+    const u64 candidate_error = _s_encode_level (thread_pool, REI_TEXTURE_FORMAT_BC7, chain, header.width, header.height, candidate);
+
+    if (candidate_error < error) {
+      header.format = REI_TEXTURE_FORMAT_BC7;
+      memcpy (encoded, candidate, _s_get_block_count (header.width, header.height) * REI_BC7_BLOCK_SIZE);
+    }
+
+    free (candidate);
+  }
+
+  if (is_reduced) memcpy (header.swizzle, swizzle, sizeof swizzle);
+
+  u32 block_size;
+  _s_get_block_encoder (header.format, &block_size);
+
+  u64 encoded_offsets[REI_TEXTURE_MAX_MIPS];
+  u64 encoded_size = 0;
+
+  for (u32 i = 0; i < header.mip_count; ++i) {
+    const u32 mip_size = (u32) (_s_get_block_count (mip_widths[i], mip_heights[i]) * block_size);
+
+    header.mips[i].size = mip_size;
+    encoded_offsets[i] = encoded_size;
+    encoded_size += mip_size;
+
+    // The first level is already encoded.
+    if (i) _s_encode_level (thread_pool, header.format, chain + mip_offsets[i], mip_widths[i], mip_heights[i], encoded + encoded_offsets[i]);
+  }
 
-  sprintf (json_metadata, json_metadata_fmt, src_image.width, src_image.height, src_image.component_count, compressed_size);
-  const u32 json_metadata_size = (u32) strlen (json_metadata);
+  free (chain);
 
   strcpy (ext, "rtex");
+  result = _s_write_texture (out_path, &header, encoded, encoded_offsets, batch);
 
-  FILE* out_file = fopen (out_path, "wb");
-  fwrite (&json_metadata_size, sizeof (u32), 1, out_file);
-  fwrite (json_metadata, 1, json_metadata_size, out_file);
-  fwrite (compressed_data, 1, (u64) compressed_size, out_file);
+  free (encoded);
 
-  free (compressed_data);
-  fclose (out_file);
+  return result;
+}
 
-  return REI_RESULT_SUCCESS;
+// Version 2 headers ended right before the swizzle, the rest of the layout is the same.
+#define _S_TEXTURE_V2_HEADER_SIZE offsetof (rei_texture_header_t, swizzle)
+#define _S_TEXTURE_MAX_DIM (1u << 16u)
+
+// Size of a level of the given format, zero for formats rtex files can't hold.
+static u64 _s_get_mip_size (u32 format, u32 width, u32 height) {
+  const u64 pixel_count = (u64) width * height;
+
+  switch (format) {
+    case REI_TEXTURE_FORMAT_RGB8: return pixel_count * 3u;
+    case REI_TEXTURE_FORMAT_RGBA8: return pixel_count * 4u;
+    case REI_TEXTURE_FORMAT_R8: return pixel_count;
+    case REI_TEXTURE_FORMAT_RG8: return pixel_count * 2u;
+    case REI_TEXTURE_FORMAT_BC1: return _s_get_block_count (width, height) * REI_BC1_BLOCK_SIZE;
+    case REI_TEXTURE_FORMAT_BC3: return _s_get_block_count (width, height) * REI_BC3_BLOCK_SIZE;
+    case REI_TEXTURE_FORMAT_BC4: return _s_get_block_count (width, height) * REI_BC4_BLOCK_SIZE;
+    case REI_TEXTURE_FORMAT_BC5: return _s_get_block_count (width, height) * REI_BC5_BLOCK_SIZE;
+    case REI_TEXTURE_FORMAT_BC7: return _s_get_block_count (width, height) * REI_BC7_BLOCK_SIZE;
+    default: return 0;
+  }
 }
 
-rei_result_e rei_compress_texture_dir (const char* const relative_path) {
-  DIR* dir = opendir (relative_path);
+// Payloads are read straight from the mapping, make sure none of them points past its end. Mips have to be as big as
+// their format and dimensions say, with their chunks following each other in order (rei_texture_unpack relies on
+// both). header_size tells where the chunk table starts.
+static b8 _s_is_valid_texture (const rei_file_t* file, u64 header_size, u32 version) {
+  const rei_texture_header_t* header = file->data;
+  const rei_texture_chunk_t* chunks = (const rei_texture_chunk_t*) ((const u8*) file->data + header_size);
 
-  struct dirent* current;
-  while ((current = readdir (dir))) {
-    if (current->d_type != 4) {
-      char full_path[128] = {0};
-      strcpy (full_path, relative_path);
-
-      // Make sure that it's not compressed already.
-      const char* ext = strrchr (current->d_name, '.');
-      if (ext++) {
-        if (strcmp (ext, "rtex") && strcmp (ext, "gltf") && strcmp (ext, "bin")) {
-          strcpy (full_path + strlen (relative_path), current->d_name);
-          REI_CHECK (rei_texture_compress (full_path));
-        }
-      }
+  // Levels have 32-bit sizes, which bounds the dimensions well before their products could overflow.
+  b8 is_valid = file->size >= header_size &&
+    header->magic == REI_TEXTURE_MAGIC &&
+    header->version == version &&
+    header->width && header->width <= _S_TEXTURE_MAX_DIM &&
+    header->height && header->height <= _S_TEXTURE_MAX_DIM &&
+    header->mip_count && header->mip_count <= REI_TEXTURE_MAX_MIPS &&
+    header_size + sizeof *chunks * (u64) header->chunk_count <= file->size;
+
+  // First chunk of the next mip.
+  u64 chunk_end = 0;
+
+  for (u32 i = 0; is_valid && i < header->mip_count; ++i) {
+    const rei_texture_mip_t* mip = &header->mips[i];
+    const u64 chunk_count = ((u64) mip->size + REI_TEXTURE_CHUNK_SIZE - 1u) / REI_TEXTURE_CHUNK_SIZE;
+    const u64 expected_size = _s_get_mip_size (header->format, REI_MAX (header->width >> i, 1u), REI_MAX (header->height >> i, 1u));
+
+    is_valid = expected_size && mip->size == expected_size &&
+      mip->first_chunk == chunk_end &&
+      !(mip->offset & (REI_TEXTURE_ALIGNMENT - 1u)) &&
+      mip->offset + mip->stored_size <= file->size &&
+      mip->first_chunk + chunk_count <= header->chunk_count;
+
+    for (u64 j = 0; is_valid && j < chunk_count; ++j) {
+      const rei_texture_chunk_t* chunk = &chunks[mip->first_chunk + j];
+      const u64 chunk_size = REI_MIN (REI_TEXTURE_CHUNK_SIZE, mip->size - j * REI_TEXTURE_CHUNK_SIZE);
+
+      // Uncompressed chunks are copied as they are.
+      is_valid = (u64) chunk->offset + chunk->stored_size <= mip->stored_size &&
+        ((header->flags & REI_TEXTURE_FLAG_LZ4) || chunk->stored_size >= chunk_size);
     }
+
+    chunk_end += chunk_count;
   }
 
-  return REI_RESULT_SUCCESS;
+  return is_valid && chunk_end == header->chunk_count;
 }
 
-rei_result_e rei_texture_load (const char* const relative_path, rei_texture_t* out) {
-  // Make sure that we are dealing with an RTEX file.
-  REI_ASSERT (!strcmp (strrchr (relative_path, '.'), ".rtex"));
+// Write a single level image converted from an older rtex, taking ownership of pixels. RGB8 can't be sampled on many
+// GPUs, RGB images are expanded to RGBA first. Grayscale and two channel images are stored as R8 and RG8.
+static rei_result_e _s_write_converted_texture (
+  const char* const relative_path,
+  u32 width,
+  u32 height,
+  u32 component_count,
+  u8* pixels,
+  rei_file_batch_t* batch) {
+
+  const u64 pixel_count = (u64) width * height;
+
+  if (component_count == 3) {
+    u8* expanded = malloc (pixel_count * 4u);
+    rei_pixel_expand_rgb (pixels, pixel_count, expanded);
+
+    free (pixels);
+    pixels = expanded;
+  }
+
+  u8 swizzle[4];
+  u8 stored[4];
+  u32 stored_count = _s_reduce_channels (pixels, pixel_count, swizzle, stored);
+
+  rei_texture_header_t header = {
+    .magic = REI_TEXTURE_MAGIC,
+    .version = REI_TEXTURE_VERSION,
+    .format = REI_TEXTURE_FORMAT_RGBA8,
+    .flags = REI_TEXTURE_FLAG_LZ4 | REI_TEXTURE_FLAG_SRGB,
+    .width = width,
+    .height = height,
+    .mip_count = 1,
+    .swizzle = {REI_TEXTURE_SWIZZLE_R, REI_TEXTURE_SWIZZLE_G, REI_TEXTURE_SWIZZLE_B, REI_TEXTURE_SWIZZLE_A},
+  };
+
+  if (stored_count <= 2u) {
+    // A constant image still needs a channel to sample.
+    if (!stored_count) {
+      stored_count = 1u;
+      stored[0] = 0;
+    }
+
+    header.format = stored_count == 1u ? REI_TEXTURE_FORMAT_R8 : REI_TEXTURE_FORMAT_RG8;
+    memcpy (header.swizzle, swizzle, sizeof swizzle);
+
+    u8* packed = malloc (pixel_count * stored_count);
+    rei_pixel_pack (pixels, pixel_count, stored, stored_count, packed);
+
+    free (pixels);
+    pixels = packed;
+  }
+
+  header.mips[0].size = (u32) (pixel_count * (header.format == REI_TEXTURE_FORMAT_RGBA8 ? 4u : stored_count));
+
+  const rei_result_e result = _s_write_texture (relative_path, &header, pixels, (const u64[]) {0}, batch);
+  free (pixels);
+
+  return result;
+}
+
+// Rewrite a version 2 rtex in the current layout. The levels are unpacked and compressed again, chunk offsets depend
+// on the header size.
+static rei_result_e _s_upgrade_texture (const char* const relative_path, rei_file_t* file, rei_file_batch_t* batch) {
+  rei_texture_header_t header;
+  memcpy (&header, file->data, _S_TEXTURE_V2_HEADER_SIZE);
+
+  const rei_texture_t texture = {
+    .header = file->data,
+    .chunks = (const rei_texture_chunk_t*) ((const u8*) file->data + _S_TEXTURE_V2_HEADER_SIZE),
+    .mapped_file = *file,
+  };
+
+  u64 offsets[REI_TEXTURE_MAX_MIPS];
+  u64 pixels_size = 0;
+
+  for (u32 i = 0; i < header.mip_count; ++i) {
+    offsets[i] = pixels_size;
+    pixels_size += header.mips[i].size;
+  }
+
+  u8* pixels = malloc (pixels_size);
+  const rei_result_e unpack_result = rei_texture_unpack (NULL, &texture, 0, header.mip_count, offsets, pixels);
+  rei_free_file (file);
+
+  if (unpack_result) {
+    free (pixels);
+    return unpack_result;
+  }
+
+  // Earlier conversions kept RGB images as they were, those are expanded now.
+  if (header.format == REI_TEXTURE_FORMAT_RGB8) {
+    if (header.mip_count != 1 || header.mips[0].size != header.width * header.height * 3u) {
+      free (pixels);
+      return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+    }
+
+    return _s_write_converted_texture (relative_path, header.width, header.height, 3u, pixels, batch);
+  }
+
+  // Version 2 only had BC5 for normal maps, everything else was color.
+  header.version = REI_TEXTURE_VERSION;
+  if (header.format != REI_TEXTURE_FORMAT_BC5) header.flags |= REI_TEXTURE_FLAG_SRGB;
 
-  REI_CHECK (rei_read_file (relative_path, &out->mapped_file));
-  const char* file_data = out->mapped_file.data;
+  header.swizzle[0] = REI_TEXTURE_SWIZZLE_R;
+  header.swizzle[1] = REI_TEXTURE_SWIZZLE_G;
+  header.swizzle[2] = REI_TEXTURE_SWIZZLE_B;
+  header.swizzle[3] = REI_TEXTURE_SWIZZLE_A;
+  memset (header.__padding, 0, sizeof header.__padding);
+
+  const rei_result_e result = _s_write_texture (relative_path, &header, pixels, offsets, batch);
+  free (pixels);
+
+  return result;
+}
+
+rei_result_e rei_texture_convert (const char* const relative_path, rei_file_batch_t* batch) {
+  rei_file_t file;
+  rei_result_e result = rei_read_file (relative_path, REI_FILE_HINT_SEQUENTIAL, &file);
+  if (result) return result;
+
+  const rei_texture_header_t* current_header = file.data;
+  if (file.size >= _S_TEXTURE_V2_HEADER_SIZE && current_header->magic == REI_TEXTURE_MAGIC) {
+    if (current_header->version == 2u && _s_is_valid_texture (&file, _S_TEXTURE_V2_HEADER_SIZE, 2u)) {
+      return _s_upgrade_texture (relative_path, &file, batch);
+    }
+
+    result = current_header->version == REI_TEXTURE_VERSION ? REI_RESULT_SUCCESS : REI_RESULT_UNSUPPORTED_FILE_TYPE;
+    rei_free_file (&file);
+
+    return result;
+  }
+
+  // Old layout: JSON size, JSON metadata, then the whole image as a single LZ4 block.
+  const u8* file_data = file.data;
+  const u32 json_size = file.size >= sizeof (u32) ? *((const u32*) file_data) : 0;
+
+  if (!json_size || json_size >= _S_RTEXTURE_JSON_MAX_SIZE || sizeof (u32) + json_size > file.size) {
+    rei_free_file (&file);
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
 
-  // Parse JSON metadata.
-  const u32 json_size = *((const u32*) file_data);
   file_data += sizeof (u32);
 
   char json[_S_RTEXTURE_JSON_MAX_SIZE];
@@ -110,27 +827,463 @@ rei_result_e rei_texture_load (const char* const relative_path, rei_texture_t* o
   json[json_size] = '\0';
 
   rei_json_state_t json_state;
-  REI_CHECK (rei_json_tokenize (json, json_size, &json_state));
+  result = rei_json_tokenize (json, json_size, &json_state);
+
+  if (result) {
+    rei_free_file (&file);
+    return result;
+  }
+
+  u32 width = 0;
+  u32 height = 0;
+  u32 component_count = 0;
+  u32 compressed_size = 0;
 
   const jsmntok_t* root_token = json_state.current_token++;
-  REI_ASSERT (root_token->type == JSMN_OBJECT);
 
-  for (s32 i = 0; i < root_token->size; ++i) {
+  for (s32 i = 0; root_token->type == JSMN_OBJECT && i < root_token->size; ++i) {
     if (rei_json_string_eq (&json_state, "width", 5)) {
-      rei_json_parse_u32 (&json_state, &out->width);
+      rei_json_parse_u32 (&json_state, &width);
     } else if (rei_json_string_eq (&json_state, "height", 6)) {
-      rei_json_parse_u32 (&json_state, &out->height);
+      rei_json_parse_u32 (&json_state, &height);
     } else if (rei_json_string_eq (&json_state, "component_count", 15)) {
-      rei_json_parse_u32 (&json_state, &out->component_count);
+      rei_json_parse_u32 (&json_state, &component_count);
     } else if (rei_json_string_eq (&json_state, "compressed_size", 15)) {
-      rei_json_parse_u32 (&json_state, &out->compressed_size);
+      rei_json_parse_u32 (&json_state, &compressed_size);
     }
   }
 
   free (json_state.json_tokens);
   file_data += json_size;
 
-  out->compressed_data = file_data;
+  // The whole image was a single LZ4 block, it can't have been any bigger than that allows.
+  const u64 payload_offset = sizeof (u32) + json_size;
+  const u64 pixels_size = (u64) width * height * component_count;
+
+  const b8 is_valid = (component_count == 3 || component_count == 4) &&
+    width && width <= _S_TEXTURE_MAX_DIM &&
+    height && height <= _S_TEXTURE_MAX_DIM &&
+    pixels_size <= LZ4_MAX_INPUT_SIZE &&
+    compressed_size <= LZ4_COMPRESSBOUND (LZ4_MAX_INPUT_SIZE) &&
+    payload_offset + compressed_size <= file.size;
+
+  if (!is_valid) {
+    rei_free_file (&file);
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
+
+  // Decompressed to be split up into chunks like any other image.
+  u8* pixels = malloc (pixels_size);
+  const s32 decompressed_size = LZ4_decompress_safe ((const char*) file_data, (char*) pixels, (s32) compressed_size, (s32) pixels_size);
+
+  rei_free_file (&file);
+
+  if (decompressed_size != (s32) pixels_size) {
+    free (pixels);
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
+
+  return _s_write_converted_texture (relative_path, width, height, component_count, pixels, batch);
+}
+
+// Single texture of a directory being cooked.
+typedef struct _s_texture_cook_t {
+  char path[128];
+  // What goes into the new manifest, unless cooking fails.
+  rei_texture_manifest_entry_t entry;
+  // Estimated peak memory use of cooking it, see _s_estimate_cook_size.
+  u64 cook_size;
+  struct _s_texture_dir_t* texture_dir;
+  // Set if the manifest shows the rtex is already cooked from the current source.
+  b32 is_up_to_date;
+  b32 has_failed;
+} _s_texture_cook_t;
+
+// Textures found in a directory, each cooked by a task of its own while their memory use fits the budget.
+typedef struct _s_texture_dir_t {
+  rei_thread_pool_t* thread_pool;
+  rei_file_batch_t* batch;
+  rei_thread_counter_t counter;
+  u64 memory_budget;
+
+  // Guards everything below.
+  pthread_mutex_t* lock;
+  // Estimated memory use of the textures queued or being cooked.
+  u64 in_flight_size;
+  // Number of textures to cook, up to date ones are sorted after them.
+  u32 texture_count;
+  // Textures are queued in order, those before next_index are either done or in flight.
+  u32 next_index;
+  u32 failed_count;
+  // First error encountered, if any.
+  rei_result_e result;
+  _s_texture_cook_t* textures;
+} _s_texture_dir_t;
+
+static u32 _s_read_u16_be (const u8* data) {
+  return (u32) data[0] << 8u | data[1];
+}
+
+static u32 _s_read_u32_be (const u8* data) {
+  return (u32) data[0] << 24u | (u32) data[1] << 16u | (u32) data[2] << 8u | data[3];
+}
+
+// Rough peak memory use of cooking an image: the source file, decoded pixels, their mip chain and its compressed copy
+// (both a third bigger than the image itself). Only headers are parsed, which keeps the rest of the file out of memory.
+static u64 _s_estimate_cook_size (const rei_file_t* file) {
+  const u8* data = file->data;
+
+  u32 width = 0;
+  u32 height = 0;
+
+  if (file->size >= 24 && !memcmp (data, "\x89PNG", 4)) {
+    // IHDR always comes first.
+    width = _s_read_u32_be (data + 16);
+    height = _s_read_u32_be (data + 20);
+  } else if (file->size >= 4 && data[0] == 0xff && data[1] == 0xd8) {
+    // Walk JPEG segments up to the first start of frame, which holds the dimensions.
+    for (u64 offset = 2; offset + 9 <= file->size && data[offset] == 0xff;) {
+      const u8 marker = data[offset + 1];
+
+      if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+        height = _s_read_u16_be (data + offset + 5);
+        width = _s_read_u16_be (data + offset + 7);
+        break;
+      }
+
+      offset += 2 + _s_read_u16_be (data + offset + 2);
+    }
+  }
+
+  return file->size + 4ull * width * height * 4u;
+}
+
+// Textures to cook go first, biggest ones first among them, lest one be left running alone at the end.
+static s32 _s_compare_textures (const void* a, const void* b) {
+  const _s_texture_cook_t* a_texture = (const _s_texture_cook_t*) a;
+  const _s_texture_cook_t* b_texture = (const _s_texture_cook_t*) b;
+
+  if (a_texture->is_up_to_date != b_texture->is_up_to_date) return a_texture->is_up_to_date ? 1 : -1;
+  return (a_texture->cook_size < b_texture->cook_size) - (a_texture->cook_size > b_texture->cook_size);
+}
+
+static s32 _s_compare_manifest_entries (const void* a, const void* b) {
+  const u64 a_hash = ((const rei_texture_manifest_entry_t*) a)->name_hash;
+  const u64 b_hash = ((const rei_texture_manifest_entry_t*) b)->name_hash;
+
+  return (a_hash > b_hash) - (a_hash < b_hash);
+}
+
+// Binary search over entries sorted by name hash.
+static const rei_texture_manifest_entry_t* _s_find_manifest_entry (
+  const rei_texture_manifest_entry_t* entries,
+  u32 entry_count,
+  u64 name_hash) {
+
+  u32 low = 0;
+  u32 high = entry_count;
+
+  while (low < high) {
+    const u32 middle = low + ((high - low) >> 1u);
+
+    if (entries[middle].name_hash < name_hash) {
+      low = middle + 1;
+    } else if (entries[middle].name_hash > name_hash) {
+      high = middle;
+    } else {
+      return &entries[middle];
+    }
+  }
+
+  return NULL;
+}
+
+// Fill in the manifest entry of a texture and tell whether it has to be cooked. Sources whose size and modification
+// time match the old entry aren't read at all, others are hashed and only cooked if their contents changed.
+static void _s_check_texture (
+  const rei_texture_manifest_entry_t* old_entries,
+  u32 old_entry_count,
+  const char* const name,
+  _s_texture_cook_t* texture) {
+
+  rei_texture_manifest_entry_t* entry = &texture->entry;
+  memset (entry, 0, sizeof *entry);
+
+  texture->cook_size = 0;
+  texture->is_up_to_date = REI_FALSE;
+  texture->has_failed = REI_FALSE;
+
+  // Unreadable files are still cooked, for the failure to be reported along with the others.
+  struct stat source_stats;
+  if (stat (texture->path, &source_stats)) return;
+
+  entry->name_hash = rei_murmur_hash_64 ((const u8*) name, strlen (name), REI_ASSET_MANIFEST_HASH_SEED);
+  entry->source_size = (u64) source_stats.st_size;
+  entry->source_mtime_ns = (s64) source_stats.st_mtim.tv_sec * 1000000000ll + source_stats.st_mtim.tv_nsec;
+
+  char rtex_path[128];
+  strcpy (rtex_path, texture->path);
+  strcpy (strrchr (rtex_path, '.') + 1, "rtex");
+
+  const rei_texture_manifest_entry_t* old_entry = _s_find_manifest_entry (old_entries, old_entry_count, entry->name_hash);
+  const b8 may_be_up_to_date = old_entry && old_entry->source_size == entry->source_size && !access (rtex_path, F_OK);
+
+  if (may_be_up_to_date && old_entry->source_mtime_ns == entry->source_mtime_ns) {
+    entry->source_hash = old_entry->source_hash;
+    texture->is_up_to_date = REI_TRUE;
+    return;
+  }
+
+  rei_file_t file;
+  if (rei_read_file (texture->path, REI_FILE_HINT_SEQUENTIAL, &file)) return;
+
+  entry->source_hash = rei_murmur_hash_64 (file.data, file.size, REI_ASSET_MANIFEST_HASH_SEED);
+
+  // Touched but unchanged (e.g. checked out again), the new timestamp saves hashing it next time.
+  if (may_be_up_to_date && old_entry->source_hash == entry->source_hash) {
+    texture->is_up_to_date = REI_TRUE;
+  } else {
+    texture->cook_size = _s_estimate_cook_size (&file);
+  }
+
+  rei_free_file (&file);
+}
+
+// Map the manifest of a previous cook, entry_count is zero if there's none or it was written by another cook version.
+static void _s_load_manifest (
+  const char* const manifest_path,
+  rei_file_t* file,
+  const rei_texture_manifest_entry_t** entries,
+  u32* entry_count) {
+
+  *entries = NULL;
+  *entry_count = 0;
+
+  if (rei_read_file (manifest_path, REI_FILE_HINT_NONE, file)) {
+    file->data = NULL;
+    return;
+  }
+
+  const rei_texture_manifest_header_t* header = file->data;
+
+  const b8 is_valid = file->size >= sizeof *header &&
+    header->magic == REI_ASSET_MANIFEST_MAGIC &&
+    header->version == REI_ASSET_MANIFEST_VERSION &&
+    header->cook_version == REI_ASSET_COOK_VERSION &&
+    file->size == sizeof *header + sizeof **entries * header->entry_count;
+
+  if (is_valid) {
+    *entries = (const rei_texture_manifest_entry_t*) (header + 1);
+    *entry_count = header->entry_count;
+  }
+}
+
+// Record every texture that's up to date or was just cooked, failed ones are left out to be retried next time.
+static rei_result_e _s_write_manifest (const char* const manifest_path, const _s_texture_cook_t* textures, u32 texture_count) {
+  const u64 manifest_size = sizeof (rei_texture_manifest_header_t) + sizeof (rei_texture_manifest_entry_t) * texture_count;
+
+  rei_texture_manifest_header_t* header = malloc (manifest_size);
+  rei_texture_manifest_entry_t* entries = (rei_texture_manifest_entry_t*) (header + 1);
+
+  u32 entry_count = 0;
+  for (u32 i = 0; i < texture_count; ++i) {
+    if (!textures[i].has_failed) entries[entry_count++] = textures[i].entry;
+  }
+
+  qsort (entries, entry_count, sizeof *entries, _s_compare_manifest_entries);
+
+  header->magic = REI_ASSET_MANIFEST_MAGIC;
+  header->version = REI_ASSET_MANIFEST_VERSION;
+  header->cook_version = REI_ASSET_COOK_VERSION;
+  header->entry_count = entry_count;
+
+  const rei_result_e result = rei_write_file (
+    manifest_path,
+    header,
+    sizeof *header + sizeof *entries * entry_count
+  );
+
+  free (header);
+
+  return result;
+}
+
+static void _s_cook_texture (void* arg);
+
+// Queue as many textures as the memory budget allows, a texture bigger than the whole budget is cooked on its own.
+static void _s_queue_textures (_s_texture_dir_t* texture_dir) {
+  pthread_mutex_lock (texture_dir->lock);
+
+  const u32 begin = texture_dir->next_index;
+
+  for (; texture_dir->next_index < texture_dir->texture_count; ++texture_dir->next_index) {
+    const u64 cook_size = texture_dir->textures[texture_dir->next_index].cook_size;
+    if (texture_dir->in_flight_size && texture_dir->in_flight_size + cook_size > texture_dir->memory_budget) break;
+
+    texture_dir->in_flight_size += cook_size;
+  }
+
+  const u32 end = texture_dir->next_index;
+
+  pthread_mutex_unlock (texture_dir->lock);
+
+  for (u32 i = begin; i < end; ++i) {
+    rei_thread_pool_add_task (
+      texture_dir->thread_pool,
+      _s_cook_texture,
+      &texture_dir->textures[i],
+      &texture_dir->counter,
+      REI_THREAD_PRIORITY_STREAMING
+    );
+  }
+}
+
+static void _s_cook_texture (void* arg) {
+  _s_texture_cook_t* texture = (_s_texture_cook_t*) arg;
+  _s_texture_dir_t* texture_dir = texture->texture_dir;
+
+  const rei_result_e result = rei_texture_compress (texture_dir->thread_pool, texture->path, texture_dir->batch);
+  if (result) REI_LOG_WARN ("Failed to cook " REI_ANSI_YELLOW "\"%s\"" REI_ANSI_RED " (%s)", texture->path, rei_show_result (result));
+  texture->has_failed = result != REI_RESULT_SUCCESS;
+
+  pthread_mutex_lock (texture_dir->lock);
+
+  texture_dir->in_flight_size -= texture->cook_size;
+
+  if (result) {
+    ++texture_dir->failed_count;
+    if (!texture_dir->result) texture_dir->result = result;
+  }
+
+  pthread_mutex_unlock (texture_dir->lock);
+
+  // Queued before this task finishes, so the counter can't reach zero while textures are left.
+  _s_queue_textures (texture_dir);
+}
+
+rei_result_e rei_compress_texture_dir (rei_thread_pool_t* thread_pool, const char* const relative_path, u64 memory_budget) {
+  struct timespec start_time;
+  clock_gettime (CLOCK_MONOTONIC, &start_time);
+
+  DIR* dir = opendir (relative_path);
+  if (!dir) return REI_RESULT_FILE_DOES_NOT_EXIST;
+
+  char manifest_path[128];
+  if (snprintf (manifest_path, sizeof manifest_path, "%s%s", relative_path, REI_ASSET_MANIFEST_NAME) >= (s32) sizeof manifest_path) {
+    closedir (dir);
+    return REI_RESULT_INVALID_FILE_PATH;
+  }
+
+  rei_file_t manifest_file;
+  const rei_texture_manifest_entry_t* manifest_entries;
+  u32 manifest_entry_count;
+  _s_load_manifest (manifest_path, &manifest_file, &manifest_entries, &manifest_entry_count);
+
+  rei_file_batch_t batch;
+  rei_create_file_batch (&batch);
+
+  u32 texture_capacity = 16;
+  _s_texture_dir_t texture_dir = {
+    .thread_pool = thread_pool,
+    .batch = &batch,
+    .memory_budget = memory_budget ? memory_budget : REI_ASSET_COOK_MEMORY_BUDGET,
+    .lock = malloc (sizeof *texture_dir.lock),
+    .textures = malloc (sizeof *texture_dir.textures * texture_capacity)
+  };
+
+  pthread_mutex_init (texture_dir.lock, NULL);
+
+  u32 total_count = 0;
+  u64 source_size = 0;
+
+  // Gather textures first, so that they can be cooked in parallel.
+  struct dirent* current;
+  while ((current = readdir (dir))) {
+    if (current->d_type == 4) continue;
+
+    const char* ext = strrchr (current->d_name, '.');
+    if (!ext++ || (strcmp (ext, "png") && strcmp (ext, "jpg") && strcmp (ext, "jpeg"))) continue;
+
+    if (total_count == texture_capacity) {
+      texture_capacity <<= 1;
+      texture_dir.textures = realloc (texture_dir.textures, sizeof *texture_dir.textures * texture_capacity);
+    }
+
+    _s_texture_cook_t* texture = &texture_dir.textures[total_count];
+    if (snprintf (texture->path, sizeof texture->path, "%s%s", relative_path, current->d_name) >= (s32) sizeof texture->path) {
+      REI_LOG_WARN ("Skipping " REI_ANSI_YELLOW "\"%s\"" REI_ANSI_RED " (path too long)", current->d_name);
+      continue;
+    }
+
+    _s_check_texture (manifest_entries, manifest_entry_count, current->d_name, texture);
+    texture->texture_dir = &texture_dir;
+    ++total_count;
+
+    if (!texture->is_up_to_date) {
+      source_size += texture->entry.source_size;
+      ++texture_dir.texture_count;
+    }
+  }
+
+  closedir (dir);
+  if (manifest_file.data) rei_free_file (&manifest_file);
+
+  qsort (texture_dir.textures, total_count, sizeof *texture_dir.textures, _s_compare_textures);
+
+  _s_queue_textures (&texture_dir);
+  rei_thread_pool_wait_counter (thread_pool, &texture_dir.counter);
+
+  // Cooked files only replace the old ones once all of them are on disk, with a single sync for the whole directory.
+  rei_result_e commit_result = rei_commit_file_batch (&batch);
+  rei_destroy_file_batch (&batch);
+
+  // Written last, so that it never vouches for files that didn't make it to disk.
+  if (!commit_result) commit_result = _s_write_manifest (manifest_path, texture_dir.textures, total_count);
+
+  struct timespec end_time;
+  clock_gettime (CLOCK_MONOTONIC, &end_time);
+
+  const f64 seconds = (f64) (end_time.tv_sec - start_time.tv_sec) + (f64) (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+  const u32 cooked_count = texture_dir.texture_count - texture_dir.failed_count;
+
+  REI_LOG_INFO (
+    "Cooked %u/%u textures from " REI_ANSI_YELLOW "\"%s\"" REI_ANSI_RESET " in %.2f s (%u up to date, %.1f files/s, %.1f MB/s)",
+    cooked_count,
+    texture_dir.texture_count,
+    relative_path,
+    seconds,
+    total_count - texture_dir.texture_count,
+    seconds > 0.0 ? (f64) texture_dir.texture_count / seconds : 0.0,
+    seconds > 0.0 ? (f64) source_size / seconds / 1e6 : 0.0
+  );
+
+  pthread_mutex_destroy (texture_dir.lock);
+  free (texture_dir.lock);
+  free (texture_dir.textures);
+
+  return texture_dir.result ? texture_dir.result : commit_result;
+}
+
+rei_result_e rei_texture_load (const char* const relative_path, rei_texture_t* out) {
+  // Make sure that we are dealing with an RTEX file.
+  REI_ASSERT (!strcmp (strrchr (relative_path, '.'), ".rtex"));
+
+  rei_file_t file;
+  REI_CHECK (rei_read_file (relative_path, REI_FILE_HINT_SEQUENTIAL, &file));
+
+  return rei_texture_load_file (&file, out);
+}
+
+rei_result_e rei_texture_load_file (const rei_file_t* file, rei_texture_t* out) {
+  out->mapped_file = *file;
+  out->header = file->data;
+  out->chunks = (const rei_texture_chunk_t*) (out->header + 1);
+
+  // RGB8 was only left in version 2 files, rei_texture_convert expands it.
+  if (!_s_is_valid_texture (file, sizeof *out->header, REI_TEXTURE_VERSION) || out->header->format == REI_TEXTURE_FORMAT_RGB8) {
+    rei_free_file (&out->mapped_file);
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
 
   return REI_RESULT_SUCCESS;
 }
@@ -138,3 +1291,74 @@ rei_result_e rei_texture_load (const char* const relative_path, rei_texture_t* o
 void rei_texture_destroy (rei_texture_t* texture) {
   rei_free_file (&texture->mapped_file);
 }
+
+typedef struct _s_texture_unpack_t {
+  const rei_texture_t* texture;
+  u32 first_mip;
+  u32 mip_count;
+  const u64* mip_offsets;
+  u8* dst;
+  // Set by any chunk that doesn't decompress to its size.
+  b32 has_failed;
+  u32 __padding;
+} _s_texture_unpack_t;
+
+static void _s_unpack_chunks (u64 begin, u64 end, void* ctx) {
+  _s_texture_unpack_t* unpack = (_s_texture_unpack_t*) ctx;
+  const rei_texture_header_t* header = unpack->texture->header;
+  const u32 end_mip = unpack->first_mip + unpack->mip_count;
+
+  u32 mip_index = unpack->first_mip;
+
+  for (u64 i = begin; i < end; ++i) {
+    // Chunks are sorted by mip, every mip has at least one.
+    while (mip_index + 1u < end_mip && i >= header->mips[mip_index + 1u].first_chunk) ++mip_index;
+
+    const rei_texture_mip_t* mip = &header->mips[mip_index];
+    const rei_texture_chunk_t* chunk = &unpack->texture->chunks[i];
+
+    const u64 chunk_offset = (i - mip->first_chunk) * REI_TEXTURE_CHUNK_SIZE;
+    const u32 chunk_size = (u32) REI_MIN (REI_TEXTURE_CHUNK_SIZE, mip->size - chunk_offset);
+
+    const char* src = (const char*) header + mip->offset + chunk->offset;
+    char* dst = (char*) unpack->dst + unpack->mip_offsets[mip_index - unpack->first_mip] + chunk_offset;
+
+    if (header->flags & REI_TEXTURE_FLAG_LZ4) {
+      const s32 decompressed_size = LZ4_decompress_safe (src, dst, (s32) chunk->stored_size, (s32) chunk_size);
+      if (decompressed_size != (s32) chunk_size) __atomic_store_n (&unpack->has_failed, REI_TRUE, __ATOMIC_RELAXED);
+    } else {
+      memcpy (dst, src, chunk_size);
+    }
+  }
+}
+
+rei_result_e rei_texture_unpack (
+  rei_thread_pool_t* thread_pool,
+  const rei_texture_t* texture,
+  u32 first_mip,
+  u32 mip_count,
+  const u64* mip_offsets,
+  u8* dst) {
+
+  const rei_texture_header_t* header = texture->header;
+  const rei_texture_mip_t* last_mip = &header->mips[first_mip + mip_count - 1u];
+
+  _s_texture_unpack_t unpack = {
+    .texture = texture,
+    .first_mip = first_mip,
+    .mip_count = mip_count,
+    .mip_offsets = mip_offsets,
+    .dst = dst
+  };
+
+  const u64 begin = header->mips[first_mip].first_chunk;
+  const u64 end = last_mip->first_chunk + (last_mip->size + REI_TEXTURE_CHUNK_SIZE - 1u) / REI_TEXTURE_CHUNK_SIZE;
+
+  if (thread_pool) {
+    rei_parallel_for (thread_pool, begin, end, _S_UNPACK_GRAIN_CHUNKS, _s_unpack_chunks, &unpack);
+  } else {
+    _s_unpack_chunks (begin, end, &unpack);
+  }
+
+  return unpack.has_failed ? REI_RESULT_IO_ERROR : REI_RESULT_SUCCESS;
+}
@@ -2,24 +2,167 @@
 #define REI_ASSET_H
 
 #include "rei_file.h"
+#include "rei_thread.h"
 
-typedef struct rei_texture_t {
+// Default memory budget of rei_compress_texture_dir.
+#define REI_ASSET_COOK_MEMORY_BUDGET (512ull << 20u)
+// Bumped whenever rei_texture_compress output changes, so that manifests written by older cooks are ignored.
+#define REI_ASSET_COOK_VERSION 6u
+// Color textures whose first level BC1 (or BC3 with alpha) can't encode at least this well are tried with BC7,
+// in dB of PSNR over the channels the format stores.
+#define REI_ASSET_COOK_MIN_PSNR 36.0
+
+// Written by rei_compress_texture_dir into the directory it cooks, next to the rtex files.
+#define REI_ASSET_MANIFEST_NAME "rtex.manifest"
+// "RMAN" read as a little endian u32.
+#define REI_ASSET_MANIFEST_MAGIC 0x4e414d52u
+#define REI_ASSET_MANIFEST_VERSION 1u
+#define REI_ASSET_MANIFEST_HASH_SEED 0u
+
+// Manifest layout: header, then entries sorted by name hash.
+typedef struct rei_texture_manifest_header_t {
+  u32 magic;
+  u32 version;
+  u32 cook_version;
+  u32 entry_count;
+} rei_texture_manifest_header_t;
+
+typedef struct rei_texture_manifest_entry_t {
+  // rei_murmur_hash_64 of the source file name (without its directory), with REI_ASSET_MANIFEST_HASH_SEED.
+  u64 name_hash;
+  // Source stats the last time it was hashed, its contents are only hashed again if these change.
+  u64 source_size;
+  s64 source_mtime_ns;
+  // rei_murmur_hash_64 of the source contents the rtex was cooked from.
+  u64 source_hash;
+} rei_texture_manifest_entry_t;
+
+// "RTEX" read as a little endian u32.
+#define REI_TEXTURE_MAGIC 0x58455452u
+#define REI_TEXTURE_VERSION 3u
+#define REI_TEXTURE_MAX_MIPS 16u
+// Header, chunk table and mip payloads start on multiples of this, relative to the start of the file.
+#define REI_TEXTURE_ALIGNMENT 16u
+// Mips are split into chunks of this many bytes (the last one of every mip may be shorter), compressed independently
+// of each other so that they can be decompressed in parallel.
+#define REI_TEXTURE_CHUNK_SIZE (64u << 10u)
+
+typedef enum rei_texture_format_e {
+  // Not loaded anymore, see rei_texture_convert.
+  REI_TEXTURE_FORMAT_RGB8,
+  REI_TEXTURE_FORMAT_RGBA8,
+  // Block compressed, see rei_bc.h.
+  REI_TEXTURE_FORMAT_BC1,
+  REI_TEXTURE_FORMAT_BC3,
+  REI_TEXTURE_FORMAT_BC5,
+  REI_TEXTURE_FORMAT_BC7,
+  REI_TEXTURE_FORMAT_BC4,
+  // Textures with one or two channels worth storing, see rei_texture_header_t::swizzle.
+  REI_TEXTURE_FORMAT_R8,
+  REI_TEXTURE_FORMAT_RG8,
+} rei_texture_format_e;
+
+typedef enum rei_texture_flags_e {
+  // Every chunk is a single LZ4 block.
+  REI_TEXTURE_FLAG_LZ4 = 1u << 0u,
+  // Color channels hold sRGB encoded values, otherwise linear data (e.g. tangent space normals). Formats without an
+  // sRGB variant in Vulkan (BC4, BC5, R8, RG8) are decoded by the shader then.
+  REI_TEXTURE_FLAG_SRGB = 1u << 1u,
+} rei_texture_flags_e;
+
+// Where a channel of the sampled texture comes from.
+typedef enum rei_texture_swizzle_e {
+  REI_TEXTURE_SWIZZLE_R,
+  REI_TEXTURE_SWIZZLE_G,
+  REI_TEXTURE_SWIZZLE_B,
+  REI_TEXTURE_SWIZZLE_A,
+  REI_TEXTURE_SWIZZLE_ZERO,
+  REI_TEXTURE_SWIZZLE_ONE,
+} rei_texture_swizzle_e;
+
+typedef struct rei_texture_mip_t {
+  // Relative to the start of the file.
+  u64 offset;
+  // Size of the pixels and size of what's stored in the file (smaller if compressed).
+  u32 size;
+  u32 stored_size;
+  // Index of the mip's first entry in the chunk table, the count follows from size.
+  u32 first_chunk;
+  u32 __padding;
+} rei_texture_mip_t;
+
+typedef struct rei_texture_chunk_t {
+  // Relative to the offset of the chunk's mip.
+  u32 offset;
+  u32 stored_size;
+} rei_texture_chunk_t;
+
+// Rtex layout: header, chunk table (padded to REI_TEXTURE_ALIGNMENT), then mip payloads from the biggest mip down,
+// each made of its chunks back to back. Read in place from the file mapping, so it's never worth changing without
+// bumping REI_TEXTURE_VERSION.
+typedef struct REI_ALIGN_AS (REI_TEXTURE_ALIGNMENT) rei_texture_header_t {
+  u32 magic;
+  u32 version;
+  // rei_texture_format_e
+  u32 format;
+  // rei_texture_flags_e
+  u32 flags;
   u32 width;
   u32 height;
-  u32 component_count;
-  u32 compressed_size;
-  char* compressed_data;
+  u32 mip_count;
+  // Chunks of all mips together.
+  u32 chunk_count;
+  rei_texture_mip_t mips[REI_TEXTURE_MAX_MIPS];
+  // rei_texture_swizzle_e of the red, green, blue and alpha channels, for textures that store fewer channels than
+  // they're sampled with (e.g. RRR1 for grayscale in BC4).
+  u8 swizzle[4];
+  u32 __padding[3];
+} rei_texture_header_t;
+
+typedef struct rei_texture_t {
+  // Both point into mapped_file.
+  const rei_texture_header_t* header;
+  const rei_texture_chunk_t* chunks;
   rei_file_t mapped_file;
 } rei_texture_t;
 
-// Load and compress image file (png, jpeg) into a rei texture.
-rei_result_e rei_texture_compress (const char* const relative_path);
+// Load and compress image file (png, jpeg) into a rei texture along with its whole mip chain, filtered in linear space.
+// Levels are block compressed, the format is picked per texture: BC5 for normal maps, BC4 for color textures with a
+// single channel worth storing (e.g. grayscale) and BC5 for two with alpha, otherwise BC1 (BC3 with alpha) unless BC5
+// or BC7 does better on a texture they can't encode well (see REI_ASSET_COOK_MIN_PSNR).
+// thread_pool is optional, blocks are encoded across it. batch is optional, see rei_close_file_writer.
+rei_result_e rei_texture_compress (rei_thread_pool_t* thread_pool, const char* const relative_path, rei_file_batch_t* batch);
+
+// Compress all textures (png, jpeg) in a directory across thread_pool. relative_path is assumed to have a trailing slash.
+// Textures are only started while their estimated memory use fits memory_budget, zero means REI_ASSET_COOK_MEMORY_BUDGET.
+// Failures are logged per file and don't stop the others, the first one is returned. Textures whose source didn't
+// change since the last cook (see rei_texture_manifest_entry_t) are skipped.
+rei_result_e rei_compress_texture_dir (rei_thread_pool_t* thread_pool, const char* const relative_path, u64 memory_budget);
 
-// Compress all textures in a directory. relative_path is assumed to have a trailing slash.
-rei_result_e rei_compress_texture_dir (const char* const relative_path);
+// Rewrite an rtex file written before REI_TEXTURE_VERSION 1 (with JSON metadata) in the current format, the image is
+// recompressed in chunks. RGB images are expanded to RGBA8, images with one or two channels worth storing become R8 or
+// RG8. Version 2 files are rewritten with the current header, RGB8 ones converted as above. Other files already in the
+// current format are left alone. batch is optional, see rei_close_file_writer.
+rei_result_e rei_texture_convert (const char* const relative_path, rei_file_batch_t* batch);
 
-// Load compressed texture.
+// Load compressed texture. Files that aren't rtex of the current version are reported as
+// REI_RESULT_UNSUPPORTED_FILE_TYPE.
 rei_result_e rei_texture_load (const char* const relative_path, rei_texture_t* out);
+// Same as above, but for file contents already in memory (e.g. read by rei_io). The texture takes ownership of file,
+// which is released if it fails to load.
+rei_result_e rei_texture_load_file (const rei_file_t* file, rei_texture_t* out);
 void rei_texture_destroy (rei_texture_t* texture);
 
+// Decompress mips [first_mip, first_mip + mip_count) of a texture into dst, mip first_mip + i at dst + mip_offsets[i].
+// Only the chunks of those mips are touched. They are spread across thread_pool, which is optional. Chunks that don't
+// decompress to their size (e.g. truncated payloads) are reported as REI_RESULT_IO_ERROR, dst is left partly written.
+rei_result_e rei_texture_unpack (
+  rei_thread_pool_t* thread_pool,
+  const rei_texture_t* texture,
+  u32 first_mip,
+  u32 mip_count,
+  const u64* mip_offsets,
+  u8* dst
+);
+
 #endif /* REI_ASSET_H */
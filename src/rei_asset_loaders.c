@@ -1,3 +1,4 @@
+#include <setjmp.h>
 #include <memory.h>
 
 #include "rei_parse.h"
@@ -8,11 +9,17 @@
 #include <yxml/yxml.h>
 #include <jpeglib.h>
 
+// Compressed image contents, read from front to back by decoders.
+typedef struct _s_image_cursor_t {
+  rei_file_t file;
+  u64 offset;
+} _s_image_cursor_t;
+
 void rei_load_wav (const char* relative_path, rei_wav_t * out) {
   REI_LOG_INFO ("Loading a sound from " REI_ANSI_YELLOW "\"%s\"", relative_path);
 
   rei_file_t file;
-  REI_CHECK (rei_read_file (relative_path, &file));
+  REI_CHECK (rei_read_file (relative_path, REI_FILE_HINT_NONE, &file));
 
   u8* data = file.data;
   // Skip all the stuff that I don't care about at the moment.
@@ -36,67 +43,117 @@ void rei_load_wav (const char* relative_path, rei_wav_t * out) {
   rei_free_file (&file);
 }
 
-// Custom png read function.
+// Custom png read function, reads from an _s_image_cursor_t.
 static void _s_read_png (png_structp png_reader, png_bytep out, size_t count) {
-  rei_file_t* png_file = (rei_file_t*) png_get_io_ptr (png_reader);
-  memcpy (out, png_file->data, count);
-  png_file->data += count;
+  _s_image_cursor_t* cursor = (_s_image_cursor_t*) png_get_io_ptr (png_reader);
+  if (cursor->offset + count > cursor->file.size) png_error (png_reader, "Unexpected end of file");
+
+  memcpy (out, (const u8*) cursor->file.data + cursor->offset, count);
+  cursor->offset += count;
 }
 
-void rei_load_png (const char* relative_path, rei_image_t* out) {
+rei_result_e rei_load_png (const char* relative_path, rei_image_t* out) {
   REI_LOG_INFO ("Loading an image from " REI_ANSI_YELLOW "\"%s\"", relative_path);
 
-  rei_file_t png_file;
-  REI_CHECK (rei_read_file (relative_path, &png_file));
+  _s_image_cursor_t cursor = {.offset = 8};
+  rei_result_e result = rei_read_file (relative_path, REI_FILE_HINT_SEQUENTIAL, &cursor.file);
+  if (result) return result;
 
   // Make sure that provided image is a valid PNG.
-  REI_ASSERT (!png_sig_cmp (png_file.data, 0, 8));
-  png_file.data += 8;
+  if (cursor.file.size < 8 || png_sig_cmp (cursor.file.data, 0, 8)) {
+    rei_free_file (&cursor.file);
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
 
   png_structp png_reader = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   png_infop png_info = png_create_info_struct (png_reader);
+  out->pixels = NULL;
+  // Set after setjmp and needed after longjmp, it can't live in a register.
+  png_bytepp volatile rows = NULL;
+
+  // libpng reports corrupted files by jumping back here.
+  if (setjmp (png_jmpbuf (png_reader))) {
+    free (rows);
+    free (out->pixels);
+    png_destroy_read_struct (&png_reader, &png_info, NULL);
+    rei_free_file (&cursor.file);
+
+    return REI_RESULT_INVALID_IMAGE;
+  }
 
-  png_set_read_fn (png_reader, &png_file, _s_read_png);
+  png_set_read_fn (png_reader, &cursor, _s_read_png);
   png_set_sig_bytes (png_reader, 8);
+  png_read_info (png_reader, png_info);
 
-  png_read_png (png_reader, png_info, 0, NULL);
-  rei_free_file (&png_file);
+  // Whatever the file holds comes out as 8-bit RGB or RGBA.
+  png_set_expand (png_reader);
+  png_set_strip_16 (png_reader);
+  png_set_gray_to_rgb (png_reader);
+  png_read_update_info (png_reader, png_info);
 
   png_get_IHDR (png_reader, png_info, &out->width, &out->height, NULL, NULL, NULL, NULL, NULL);
 
-  u32 bytes_per_row = (u32) png_get_rowbytes (png_reader, png_info);
-  // FIXME hardcoded.
-  out->component_count = 4;
+  const u64 bytes_per_row = png_get_rowbytes (png_reader, png_info);
+  out->component_count = png_get_channels (png_reader, png_info);
   out->pixels = malloc (bytes_per_row * out->height);
 
-  const png_bytepp rows = png_get_rows (png_reader, png_info);
+  // Rows are decoded straight into place bottom up, flipping the image costs nothing.
+  rows = malloc (sizeof *rows * out->height);
+  for (u32 i = 0; i < out->height; ++i) rows[i] = out->pixels + bytes_per_row * (out->height - 1u - i);
 
-  for (u32 i = 0; i < out->height; ++i)
-    memcpy (out->pixels + (bytes_per_row * (out->height - 1 - i)), rows[i], bytes_per_row);
+  png_read_image (png_reader, rows);
+  png_read_end (png_reader, NULL);
 
+  free (rows);
   png_destroy_read_struct (&png_reader, &png_info, NULL);
+  rei_free_file (&cursor.file);
+
+  return REI_RESULT_SUCCESS;
+}
+
+// Error manager jumping back into rei_load_jpeg instead of exiting.
+typedef struct _s_jpeg_error_mgr_t {
+  struct jpeg_error_mgr base;
+  jmp_buf jump_buffer;
+} _s_jpeg_error_mgr_t;
+
+static void _s_exit_jpeg (j_common_ptr decomp_info) {
+  _s_jpeg_error_mgr_t* error_mgr = (_s_jpeg_error_mgr_t*) decomp_info->err;
+
+  (*decomp_info->err->output_message) (decomp_info);
+  longjmp (error_mgr->jump_buffer, 1);
 }
 
-void rei_load_jpeg (const char* relative_path, rei_image_t* out) {
+rei_result_e rei_load_jpeg (const char* relative_path, rei_image_t* out) {
   REI_LOG_INFO ("Loading an image from " REI_ANSI_YELLOW "\"%s\"", relative_path);
 
+  rei_file_t jpeg_file;
+  rei_result_e result = rei_read_file (relative_path, REI_FILE_HINT_SEQUENTIAL, &jpeg_file);
+  if (result) return result;
+
   struct jpeg_decompress_struct decomp_info;
-  struct jpeg_error_mgr error_mgr;
+  _s_jpeg_error_mgr_t error_mgr;
 
-  decomp_info.err = jpeg_std_error (&error_mgr);
+  decomp_info.err = jpeg_std_error (&error_mgr.base);
+  error_mgr.base.error_exit = _s_exit_jpeg;
+  out->pixels = NULL;
 
-  jpeg_create_decompress (&decomp_info);
+  if (setjmp (error_mgr.jump_buffer)) {
+    free (out->pixels);
+    jpeg_destroy_decompress (&decomp_info);
+    rei_free_file (&jpeg_file);
 
-  // TODO find a way to use rei_read_file instead of stdio.
-  FILE* image_file = fopen (relative_path, "rb");
-  if (!image_file) {
-    fprintf (stderr, "Failed to open \"%s\". No such file.\n", relative_path);
-    exit (EXIT_FAILURE);
+    return REI_RESULT_INVALID_IMAGE;
   }
 
-  jpeg_stdio_src (&decomp_info, image_file);
+  jpeg_create_decompress (&decomp_info);
+
+  jpeg_mem_src (&decomp_info, jpeg_file.data, jpeg_file.size);
   jpeg_read_header (&decomp_info, 1);
 
+  // Callers only deal with RGB, grayscale images are expanded (CMYK ones fail to load, libjpeg has no conversion).
+  decomp_info.out_color_space = JCS_RGB;
+
   jpeg_start_decompress (&decomp_info);
 
   out->width = decomp_info.image_width;
@@ -114,12 +171,14 @@ void rei_load_jpeg (const char* relative_path, rei_image_t* out) {
   jpeg_finish_decompress (&decomp_info);
   jpeg_destroy_decompress (&decomp_info);
 
-  fclose (image_file);
+  rei_free_file (&jpeg_file);
+
+  return REI_RESULT_SUCCESS;
 }
 
 void rei_load_font (const char* const relative_path, rei_font_t* out) {
   rei_file_t xml_file;
-  REI_CHECK (rei_read_file (relative_path, &xml_file));
+  REI_CHECK (rei_read_file (relative_path, REI_FILE_HINT_NONE, &xml_file));
 
   const char* xml_data = (const char*) xml_file.data;
 
@@ -291,7 +350,7 @@ static void _s_gltf_parse_nodes (rei_json_state_t* state, rei_gltf_t* out) {
   }
 }
 
-static void _s_gltf_parse_buffers (const char* const gltf_path, rei_json_state_t* state, rei_gltf_t* out) {
+static void _s_gltf_parse_buffers (const char* const gltf_path, const rei_vfs_t* vfs, rei_json_state_t* state, rei_gltf_t* out) {
   REI_IGNORE_WARN_START (-Wincompatible-pointer-types)
   rei_json_parse_array (state, sizeof *out->buffers, &out->buffer_count, &out->buffers);
   REI_IGNORE_WARN_STOP
@@ -318,7 +377,9 @@ static void _s_gltf_parse_buffers (const char* const gltf_path, rei_json_state_t
                 strncpy (buffer_path + strlen (buffer_path), uri.src, uri.size);
 	      }
 
-        REI_CHECK (rei_read_file (buffer_path, new_buffer));
+        // Buffers are walked by several accessors at once during interleaving, so reading ahead sequentially doesn't
+        // help. Paging in asynchronously on huge pages does, both for cold and warm page cache.
+        REI_CHECK (rei_vfs_load (vfs, buffer_path, REI_FILE_HINT_WILLNEED | REI_FILE_HINT_HUGEPAGE, new_buffer));
       }
     }
   }
@@ -687,11 +748,11 @@ static void _s_gltf_parse_animations (rei_json_state_t* state, rei_gltf_t* out)
 }
 #endif
 
-rei_result_e rei_gltf_load (const char* relative_path, rei_gltf_t* out) {
+rei_result_e rei_gltf_load (const char* relative_path, const rei_vfs_t* vfs, rei_gltf_t* out) {
   REI_LOG_INFO ("Loading GLTF model from " REI_ANSI_YELLOW "\"%s\"", relative_path);
 
   rei_file_t gltf;
-  REI_CHECK (rei_read_file (relative_path, &gltf));
+  REI_CHECK (rei_vfs_load (vfs, relative_path, REI_FILE_HINT_NONE, &gltf));
 
   rei_json_state_t json_state;
   REI_CHECK (rei_json_tokenize ((const char*) gltf.data, gltf.size, &json_state));
@@ -705,7 +766,7 @@ rei_result_e rei_gltf_load (const char* relative_path, rei_gltf_t* out) {
     if (rei_json_string_eq (&json_state, "nodes", 5)) {
       _s_gltf_parse_nodes (&json_state, out);
     } else if (rei_json_string_eq (&json_state, "buffers", 7)) {
-      _s_gltf_parse_buffers (relative_path, &json_state, out);
+      _s_gltf_parse_buffers (relative_path, vfs, &json_state, out);
     } else if (rei_json_string_eq (&json_state, "bufferViews", 11)) {
       _s_gltf_parse_buffer_views (&json_state, out);
     } else if (rei_json_string_eq (&json_state, "accessors", 9)) {
@@ -1,6 +1,7 @@
 #ifndef REI_ASSET_LOADERS_H
 #define REI_ASSET_LOADERS_H
 
+#include "rei_vfs.h"
 #include "rei_file.h"
 
 typedef enum rei_gltf_accessor_type_e {
@@ -178,13 +179,15 @@ typedef struct rei_gltf_t {
 } rei_gltf_t;
 
 void rei_load_wav (const char* relative_path, rei_wav_t* out);
-void rei_load_png (const char* relative_path, rei_image_t* out);
-void rei_load_jpeg (const char* relative_path, rei_image_t* out);
+// Corrupted images are reported as REI_RESULT_INVALID_IMAGE instead of aborting. Pixels are released with free.
+rei_result_e rei_load_png (const char* relative_path, rei_image_t* out);
+rei_result_e rei_load_jpeg (const char* relative_path, rei_image_t* out);
 
 void rei_load_font (const char* const relative_path, rei_font_t* out);
 void rei_destroy_font (rei_font_t* font);
 
-rei_result_e rei_gltf_load (const char* relative_path, rei_gltf_t* out);
+// vfs is optional, files missing from it are read from disk.
+rei_result_e rei_gltf_load (const char* relative_path, const rei_vfs_t* vfs, rei_gltf_t* out);
 void rei_gltf_destroy (rei_gltf_t* gltf);
 
 #endif /* REI_ASSET_LOADERS_H */
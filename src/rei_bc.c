@@ -0,0 +1,498 @@
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "rei_bc.h"
+
+// Number of times endpoints are refitted to the palette entries their pixels ended up with.
+#define _S_REFINE_COUNT 2u
+
+// Steps along a BC1 line (from the first endpoint to the second) to palette indices.
+static const u32 _s_bc1_indices[4] = {0, 2, 3, 1};
+// Steps along a BC4 line (from the smaller endpoint to the bigger one) to palette indices of the 8 value mode.
+static const u32 _s_bc4_indices[8] = {1, 7, 6, 5, 4, 3, 2, 0};
+// Interpolation weights of BC7 4-bit indices, in 64ths.
+static const u32 _s_bc7_weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+// Pixels of a block as one register per channel (RGBA) and row.
+typedef struct _s_block_t {
+  __m128 rows[4][4];
+} _s_block_t;
+
+static void _s_load_block (const u8* pixels, _s_block_t* out) {
+  const __m128i mask = _mm_set1_epi32 (0xff);
+
+  for (u32 y = 0; y < 4; ++y) {
+    const __m128i row = _mm_loadu_si128 ((const __m128i*) (pixels + y * 16));
+
+    out->rows[0][y] = _mm_cvtepi32_ps (_mm_and_si128 (row, mask));
+    out->rows[1][y] = _mm_cvtepi32_ps (_mm_and_si128 (_mm_srli_epi32 (row, 8), mask));
+    out->rows[2][y] = _mm_cvtepi32_ps (_mm_and_si128 (_mm_srli_epi32 (row, 16), mask));
+    out->rows[3][y] = _mm_cvtepi32_ps (_mm_srli_epi32 (row, 24));
+  }
+}
+
+static f32 _s_reduce_add (__m128 value) {
+  value = _mm_add_ps (value, _mm_movehl_ps (value, value));
+  return _mm_cvtss_f32 (_mm_add_ss (value, _mm_shuffle_ps (value, value, 1)));
+}
+
+static f32 _s_reduce_min (__m128 value) {
+  value = _mm_min_ps (value, _mm_movehl_ps (value, value));
+  return _mm_cvtss_f32 (_mm_min_ss (value, _mm_shuffle_ps (value, value, 1)));
+}
+
+static f32 _s_reduce_max (__m128 value) {
+  value = _mm_max_ps (value, _mm_movehl_ps (value, value));
+  return _mm_cvtss_f32 (_mm_max_ss (value, _mm_shuffle_ps (value, value, 1)));
+}
+
+// Endpoints of a line through the first channel_count channels of a block along their principal axis, spanning
+// the range the pixels project onto.
+static void _s_fit_line (const _s_block_t* block, u32 channel_count, f32 endpoints[2][4]) {
+  f32 mean[4] = {0};
+  __m128 centered[4][4];
+
+  for (u32 c = 0; c < channel_count; ++c) {
+    const __m128 sum = _mm_add_ps (_mm_add_ps (block->rows[c][0], block->rows[c][1]), _mm_add_ps (block->rows[c][2], block->rows[c][3]));
+    mean[c] = _s_reduce_add (sum) / 16.f;
+
+    for (u32 y = 0; y < 4; ++y) centered[c][y] = _mm_sub_ps (block->rows[c][y], _mm_set1_ps (mean[c]));
+  }
+
+  f32 covariance[4][4] = {{0}};
+  u32 widest = 0;
+
+  for (u32 i = 0; i < channel_count; ++i) {
+    for (u32 j = i; j < channel_count; ++j) {
+      __m128 sum = _mm_setzero_ps ();
+      for (u32 y = 0; y < 4; ++y) sum = _mm_add_ps (sum, _mm_mul_ps (centered[i][y], centered[j][y]));
+
+      covariance[i][j] = covariance[j][i] = _s_reduce_add (sum);
+    }
+
+    if (covariance[i][i] > covariance[widest][widest]) widest = i;
+  }
+
+  memset (endpoints, 0, sizeof (f32) * 8u);
+
+  // Flat block, both endpoints are its color.
+  if (covariance[widest][widest] < 1e-3f) {
+    for (u32 c = 0; c < channel_count; ++c) endpoints[0][c] = endpoints[1][c] = mean[c];
+    return;
+  }
+
+  // Power iteration, starting from the channel that varies the most.
+  f32 axis[4] = {0};
+  for (u32 c = 0; c < channel_count; ++c) axis[c] = covariance[widest][c];
+
+  for (u32 iteration = 0; iteration < 8; ++iteration) {
+    f32 next[4] = {0};
+    f32 length = 0.f;
+
+    for (u32 i = 0; i < channel_count; ++i) {
+      for (u32 j = 0; j < channel_count; ++j) next[i] += covariance[i][j] * axis[j];
+      length += next[i] * next[i];
+    }
+
+    if (length < 1e-12f) break;
+
+    const f32 inverse_length = 1.f / sqrtf (length);
+    for (u32 c = 0; c < channel_count; ++c) axis[c] = next[c] * inverse_length;
+  }
+
+  __m128 low = _mm_set1_ps (FLT_MAX);
+  __m128 high = _mm_set1_ps (-FLT_MAX);
+
+  for (u32 y = 0; y < 4; ++y) {
+    __m128 position = _mm_setzero_ps ();
+    for (u32 c = 0; c < channel_count; ++c) position = _mm_add_ps (position, _mm_mul_ps (centered[c][y], _mm_set1_ps (axis[c])));
+
+    low = _mm_min_ps (low, position);
+    high = _mm_max_ps (high, position);
+  }
+
+  const f32 low_position = _s_reduce_min (low);
+  const f32 high_position = _s_reduce_max (high);
+
+  for (u32 c = 0; c < channel_count; ++c) {
+    endpoints[0][c] = REI_CLAMP (mean[c] + axis[c] * low_position, 0.f, 255.f);
+    endpoints[1][c] = REI_CLAMP (mean[c] + axis[c] * high_position, 0.f, 255.f);
+  }
+}
+
+// Positions of pixels along the segment between two endpoints, clamped to [0, 1].
+static void _s_project (const _s_block_t* block, u32 channel_count, const f32 endpoints[2][4], f32 positions[16]) {
+  f32 direction[4];
+  f32 length = 0.f;
+
+  for (u32 c = 0; c < channel_count; ++c) {
+    direction[c] = endpoints[1][c] - endpoints[0][c];
+    length += direction[c] * direction[c];
+  }
+
+  if (length <= 0.f) {
+    memset (positions, 0, sizeof (f32) * 16u);
+    return;
+  }
+
+  const __m128 scale = _mm_set1_ps (1.f / length);
+
+  for (u32 y = 0; y < 4; ++y) {
+    __m128 dot = _mm_setzero_ps ();
+
+    for (u32 c = 0; c < channel_count; ++c) {
+      const __m128 offset = _mm_sub_ps (block->rows[c][y], _mm_set1_ps (endpoints[0][c]));
+      dot = _mm_add_ps (dot, _mm_mul_ps (offset, _mm_set1_ps (direction[c])));
+    }
+
+    const __m128 position = _mm_min_ps (_mm_max_ps (_mm_mul_ps (dot, scale), _mm_setzero_ps ()), _mm_set1_ps (1.f));
+    _mm_storeu_ps (positions + y * 4, position);
+  }
+}
+
+// Least squares endpoints for pixels sitting at the given positions (weights of the second endpoint) along the line
+// between them. Returns false if the positions don't pin the line down (e.g. all of them are the same).
+static b32 _s_solve_endpoints (const _s_block_t* block, u32 channel_count, const f32 positions[16], f32 endpoints[2][4]) {
+  __m128 aa = _mm_setzero_ps ();
+  __m128 ab = _mm_setzero_ps ();
+  __m128 bb = _mm_setzero_ps ();
+  __m128 weighted_a[4] = {_mm_setzero_ps (), _mm_setzero_ps (), _mm_setzero_ps (), _mm_setzero_ps ()};
+  __m128 weighted_b[4] = {_mm_setzero_ps (), _mm_setzero_ps (), _mm_setzero_ps (), _mm_setzero_ps ()};
+
+  for (u32 y = 0; y < 4; ++y) {
+    const __m128 b = _mm_loadu_ps (positions + y * 4);
+    const __m128 a = _mm_sub_ps (_mm_set1_ps (1.f), b);
+
+    aa = _mm_add_ps (aa, _mm_mul_ps (a, a));
+    ab = _mm_add_ps (ab, _mm_mul_ps (a, b));
+    bb = _mm_add_ps (bb, _mm_mul_ps (b, b));
+
+    for (u32 c = 0; c < channel_count; ++c) {
+      weighted_a[c] = _mm_add_ps (weighted_a[c], _mm_mul_ps (a, block->rows[c][y]));
+      weighted_b[c] = _mm_add_ps (weighted_b[c], _mm_mul_ps (b, block->rows[c][y]));
+    }
+  }
+
+  const f32 sum_aa = _s_reduce_add (aa);
+  const f32 sum_ab = _s_reduce_add (ab);
+  const f32 sum_bb = _s_reduce_add (bb);
+
+  const f32 determinant = sum_aa * sum_bb - sum_ab * sum_ab;
+  if (determinant < 1e-3f) return REI_FALSE;
+
+  const f32 inverse = 1.f / determinant;
+
+  for (u32 c = 0; c < channel_count; ++c) {
+    const f32 sum_a = _s_reduce_add (weighted_a[c]);
+    const f32 sum_b = _s_reduce_add (weighted_b[c]);
+
+    endpoints[0][c] = REI_CLAMP ((sum_bb * sum_a - sum_ab * sum_b) * inverse, 0.f, 255.f);
+    endpoints[1][c] = REI_CLAMP ((sum_aa * sum_b - sum_ab * sum_a) * inverse, 0.f, 255.f);
+  }
+
+  return REI_TRUE;
+}
+
+static void _s_swap_endpoints (f32 endpoints[2][4]) {
+  for (u32 c = 0; c < 4; ++c) {
+    const f32 first = endpoints[0][c];
+    endpoints[0][c] = endpoints[1][c];
+    endpoints[1][c] = first;
+  }
+}
+
+static u32 _s_quantize_565 (const f32 color[4]) {
+  const u32 r = (u32) (color[0] * (31.f / 255.f) + 0.5f);
+  const u32 g = (u32) (color[1] * (63.f / 255.f) + 0.5f);
+  const u32 b = (u32) (color[2] * (31.f / 255.f) + 0.5f);
+
+  return (r << 11u) | (g << 5u) | b;
+}
+
+static void _s_expand_565 (u32 color, f32 out[4]) {
+  const u32 r = color >> 11u;
+  const u32 g = (color >> 5u) & 63u;
+  const u32 b = color & 31u;
+
+  out[0] = (f32) ((r << 3u) | (r >> 2u));
+  out[1] = (f32) ((g << 2u) | (g >> 4u));
+  out[2] = (f32) ((b << 3u) | (b >> 2u));
+  out[3] = 0.f;
+}
+
+// Color block of BC1 and BC3 for the given endpoints, which may get swapped. Positions of the palette entries pixels
+// ended up with are written out for refitting the endpoints.
+static f32 _s_encode_bc1_colors (const _s_block_t* block, const u8* pixels, f32 endpoints[2][4], u8* out, f32 positions[16]) {
+  u32 colors[2] = {_s_quantize_565 (endpoints[0]), _s_quantize_565 (endpoints[1])};
+
+  // The 4 color mode is picked by the first endpoint being the bigger one.
+  if (colors[0] < colors[1]) {
+    const u32 first = colors[0];
+    colors[0] = colors[1];
+    colors[1] = first;
+
+    _s_swap_endpoints (endpoints);
+  }
+
+  f32 palette[4][4];
+  _s_expand_565 (colors[0], palette[0]);
+  _s_expand_565 (colors[1], palette[1]);
+
+  for (u32 c = 0; c < 3; ++c) {
+    palette[2][c] = (2.f * palette[0][c] + palette[1][c]) / 3.f;
+    palette[3][c] = (palette[0][c] + 2.f * palette[1][c]) / 3.f;
+  }
+
+  // Palettes are collinear, the nearest entry is the nearest step along the line. Equal endpoints project everything
+  // to the first one.
+  _s_project (block, 3, (const f32 (*)[4]) palette, positions);
+
+  u32 indices = 0;
+  f32 error = 0.f;
+
+  for (u32 i = 0; i < 16; ++i) {
+    const u32 step = (u32) (positions[i] * 3.f + 0.5f);
+    const u32 index = _s_bc1_indices[step];
+
+    positions[i] = (f32) step / 3.f;
+    indices |= index << (2u * i);
+
+    for (u32 c = 0; c < 3; ++c) {
+      const f32 difference = (f32) pixels[i * 4 + c] - palette[index][c];
+      error += difference * difference;
+    }
+  }
+
+  out[0] = (u8) colors[0];
+  out[1] = (u8) (colors[0] >> 8u);
+  out[2] = (u8) colors[1];
+  out[3] = (u8) (colors[1] >> 8u);
+  for (u32 i = 0; i < 4; ++i) out[4 + i] = (u8) (indices >> (8u * i));
+
+  return error;
+}
+
+static f32 _s_encode_colors (const _s_block_t* block, const u8* pixels, u8* out) {
+  f32 endpoints[2][4];
+  _s_fit_line (block, 3, endpoints);
+
+  f32 positions[16];
+  f32 best_error = _s_encode_bc1_colors (block, pixels, endpoints, out, positions);
+
+  for (u32 i = 0; i < _S_REFINE_COUNT && best_error > 0.f; ++i) {
+    if (!_s_solve_endpoints (block, 3, positions, endpoints)) break;
+
+    u8 candidate[REI_BC1_BLOCK_SIZE];
+    const f32 error = _s_encode_bc1_colors (block, pixels, endpoints, candidate, positions);
+    if (error >= best_error) break;
+
+    best_error = error;
+    memcpy (out, candidate, sizeof candidate);
+  }
+
+  return best_error;
+}
+
+// Single channel block (BC4), always in the 8 value mode unless the block is flat.
+static f32 _s_encode_bc4 (const _s_block_t* block, const u8* pixels, u32 channel, u8* out) {
+  const __m128* rows = block->rows[channel];
+
+  const f32 low = _s_reduce_min (_mm_min_ps (_mm_min_ps (rows[0], rows[1]), _mm_min_ps (rows[2], rows[3])));
+  const f32 high = _s_reduce_max (_mm_max_ps (_mm_max_ps (rows[0], rows[1]), _mm_max_ps (rows[2], rows[3])));
+
+  out[0] = (u8) high;
+  out[1] = (u8) low;
+
+  u64 indices = 0;
+  f32 error = 0.f;
+
+  // With equal endpoints every index of zero decodes to the endpoint.
+  if (high > low) {
+    const __m128 scale = _mm_set1_ps (7.f / (high - low));
+    const __m128 half = _mm_set1_ps (0.5f);
+
+    u32 steps[16] REI_ALIGN_AS (16);
+    for (u32 y = 0; y < 4; ++y) {
+      const __m128 step = _mm_add_ps (_mm_mul_ps (_mm_sub_ps (rows[y], _mm_set1_ps (low)), scale), half);
+      _mm_store_si128 ((__m128i*) (steps + y * 4), _mm_cvttps_epi32 (step));
+    }
+
+    for (u32 i = 0; i < 16; ++i) {
+      const f32 value = ((f32) steps[i] * high + (f32) (7u - steps[i]) * low) / 7.f;
+      const f32 difference = (f32) pixels[i * 4 + channel] - value;
+
+      error += difference * difference;
+      indices |= (u64) _s_bc4_indices[steps[i]] << (3u * i);
+    }
+  }
+
+  for (u32 i = 0; i < 6; ++i) out[2 + i] = (u8) (indices >> (8u * i));
+
+  return error;
+}
+
+// Append bits to a 128-bit block (little endian, least significant bits first), which has to be zeroed beforehand.
+static void _s_put_bits (u64 block[2], u32* offset, u32 value, u32 count) {
+  const u32 shift = *offset & 63u;
+
+  block[*offset >> 6u] |= (u64) value << shift;
+  if (shift + count > 64u) block[1] |= (u64) value >> (64u - shift);
+
+  *offset += count;
+}
+
+// Mode 6 endpoints have 7 bits per channel plus a p-bit shared by all channels, pick the one closer to the endpoint.
+static void _s_quantize_bc7_endpoint (const f32 endpoint[4], u32 quantized[4], u32* p_bit, f32 expanded[4]) {
+  f32 best_error = FLT_MAX;
+
+  for (u32 p = 0; p < 2; ++p) {
+    u32 candidate[4];
+    f32 error = 0.f;
+
+    for (u32 c = 0; c < 4; ++c) {
+      candidate[c] = (u32) REI_CLAMP ((endpoint[c] - (f32) p) * 0.5f + 0.5f, 0.f, 127.f);
+
+      const f32 difference = (f32) (candidate[c] * 2u + p) - endpoint[c];
+      error += difference * difference;
+    }
+
+    if (error < best_error) {
+      best_error = error;
+      *p_bit = p;
+      memcpy (quantized, candidate, sizeof candidate);
+    }
+  }
+
+  for (u32 c = 0; c < 4; ++c) expanded[c] = (f32) (quantized[c] * 2u + *p_bit);
+}
+
+// Mode 6 block for the given endpoints, which may get swapped. Positions of the weights pixels ended up with are
+// written out for refitting the endpoints.
+static f32 _s_encode_bc7_mode6 (const _s_block_t* block, const u8* pixels, f32 endpoints[2][4], u8* out, f32 positions[16]) {
+  u32 quantized[2][4];
+  u32 p_bits[2];
+  f32 expanded[2][4];
+
+  _s_quantize_bc7_endpoint (endpoints[0], quantized[0], &p_bits[0], expanded[0]);
+  _s_quantize_bc7_endpoint (endpoints[1], quantized[1], &p_bits[1], expanded[1]);
+
+  _s_project (block, 4, (const f32 (*)[4]) expanded, positions);
+
+  // Weights are close to, but not quite evenly spaced, the nearest one is next to the nearest even step.
+  u32 indices[16];
+  for (u32 i = 0; i < 16; ++i) {
+    const f32 target = positions[i] * 64.f;
+    const u32 step = (u32) (positions[i] * 15.f + 0.5f);
+
+    u32 index = step;
+    if (step > 0 && fabsf (target - (f32) _s_bc7_weights[step - 1]) < fabsf (target - (f32) _s_bc7_weights[index])) index = step - 1;
+    if (step < 15 && fabsf (target - (f32) _s_bc7_weights[step + 1]) < fabsf (target - (f32) _s_bc7_weights[index])) index = step + 1;
+
+    indices[i] = index;
+  }
+
+  // The top bit of the first index is implied to be zero, flip the line around if it's set.
+  if (indices[0] & 8u) {
+    for (u32 c = 0; c < 4; ++c) {
+      const u32 first = quantized[0][c];
+      quantized[0][c] = quantized[1][c];
+      quantized[1][c] = first;
+    }
+
+    const u32 first_p_bit = p_bits[0];
+    p_bits[0] = p_bits[1];
+    p_bits[1] = first_p_bit;
+
+    for (u32 i = 0; i < 16; ++i) indices[i] = 15u - indices[i];
+    _s_swap_endpoints (endpoints);
+  }
+
+  f32 error = 0.f;
+
+  for (u32 i = 0; i < 16; ++i) {
+    const u32 weight = _s_bc7_weights[indices[i]];
+    positions[i] = (f32) weight / 64.f;
+
+    for (u32 c = 0; c < 4; ++c) {
+      const u32 value = ((64u - weight) * (quantized[0][c] * 2u + p_bits[0]) + weight * (quantized[1][c] * 2u + p_bits[1]) + 32u) >> 6u;
+      const f32 difference = (f32) pixels[i * 4 + c] - (f32) value;
+
+      error += difference * difference;
+    }
+  }
+
+  u64 bits[2] = {0};
+  u32 offset = 0;
+
+  _s_put_bits (bits, &offset, 1u << 6u, 7u);
+
+  for (u32 c = 0; c < 4; ++c) {
+    _s_put_bits (bits, &offset, quantized[0][c], 7u);
+    _s_put_bits (bits, &offset, quantized[1][c], 7u);
+  }
+
+  _s_put_bits (bits, &offset, p_bits[0], 1u);
+  _s_put_bits (bits, &offset, p_bits[1], 1u);
+
+  _s_put_bits (bits, &offset, indices[0], 3u);
+  for (u32 i = 1; i < 16; ++i) _s_put_bits (bits, &offset, indices[i], 4u);
+
+  memcpy (out, bits, sizeof bits);
+
+  return error;
+}
+
+u32 rei_bc1_encode_block (const u8* restrict pixels, u8* restrict out) {
+  _s_block_t block;
+  _s_load_block (pixels, &block);
+
+  return (u32) (_s_encode_colors (&block, pixels, out) + 0.5f);
+}
+
+u32 rei_bc3_encode_block (const u8* restrict pixels, u8* restrict out) {
+  _s_block_t block;
+  _s_load_block (pixels, &block);
+
+  const f32 error = _s_encode_bc4 (&block, pixels, 3, out) + _s_encode_colors (&block, pixels, out + 8);
+  return (u32) (error + 0.5f);
+}
+
+u32 rei_bc4_encode_block (const u8* restrict pixels, u8* restrict out) {
+  _s_block_t block;
+  _s_load_block (pixels, &block);
+
+  return (u32) (_s_encode_bc4 (&block, pixels, 0, out) + 0.5f);
+}
+
+u32 rei_bc5_encode_block (const u8* restrict pixels, u8* restrict out) {
+  _s_block_t block;
+  _s_load_block (pixels, &block);
+
+  const f32 error = _s_encode_bc4 (&block, pixels, 0, out) + _s_encode_bc4 (&block, pixels, 1, out + 8);
+  return (u32) (error + 0.5f);
+}
+
+u32 rei_bc7_encode_block (const u8* restrict pixels, u8* restrict out) {
+  _s_block_t block;
+  _s_load_block (pixels, &block);
+
+  f32 endpoints[2][4];
+  _s_fit_line (&block, 4, endpoints);
+
+  f32 positions[16];
+  f32 best_error = _s_encode_bc7_mode6 (&block, pixels, endpoints, out, positions);
+
+  for (u32 i = 0; i < _S_REFINE_COUNT && best_error > 0.f; ++i) {
+    if (!_s_solve_endpoints (&block, 4, positions, endpoints)) break;
+
+    u8 candidate[REI_BC7_BLOCK_SIZE];
+    const f32 error = _s_encode_bc7_mode6 (&block, pixels, endpoints, candidate, positions);
+    if (error >= best_error) break;
+
+    best_error = error;
+    memcpy (out, candidate, sizeof candidate);
+  }
+
+  return (u32) (best_error + 0.5f);
+}
@@ -0,0 +1,31 @@
+#ifndef REI_BC_H
+#define REI_BC_H
+
+#include "rei_types.h"
+
+// Width and height of a compressed block in pixels.
+#define REI_BC_BLOCK_DIM 4u
+// Bytes per compressed block.
+#define REI_BC1_BLOCK_SIZE 8u
+#define REI_BC3_BLOCK_SIZE 16u
+#define REI_BC4_BLOCK_SIZE 8u
+#define REI_BC5_BLOCK_SIZE 16u
+#define REI_BC7_BLOCK_SIZE 16u
+
+// Block compression encoders. Every one of them takes a 4x4 block of RGBA8 pixels (row after row, 64 bytes) and
+// returns the sum of squared errors of the channels it stores, as decoded by the GPU.
+
+// RGB, 4 bits per pixel. Alpha is ignored, blocks are always written in the 4 color mode.
+u32 rei_bc1_encode_block (const u8* restrict pixels, u8* restrict out);
+// RGBA, 8 bits per pixel. Alpha block followed by a BC1 color block.
+u32 rei_bc3_encode_block (const u8* restrict pixels, u8* restrict out);
+// R, 4 bits per pixel. A single channel with 8 steps per block, for grayscale images and masks.
+u32 rei_bc4_encode_block (const u8* restrict pixels, u8* restrict out);
+// RG, 8 bits per pixel. Two independent BC4 blocks, for two channels of data (e.g. tangent space normals) or
+// grayscale with alpha.
+u32 rei_bc5_encode_block (const u8* restrict pixels, u8* restrict out);
+// RGBA, 8 bits per pixel. Only mode 6 (a single RGBA line with 16 steps) is used, which holds up well on
+// gradients and alpha where BC1 and BC3 band.
+u32 rei_bc7_encode_block (const u8* restrict pixels, u8* restrict out);
+
+#endif /* REI_BC_H */
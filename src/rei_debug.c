@@ -9,6 +9,8 @@ const char* rei_show_result (rei_result_e result) {
     SHOW_RESULT (INVALID_JSON);
     SHOW_RESULT (INVALID_FILE_PATH);
     SHOW_RESULT (UNSUPPORTED_FILE_TYPE);
+    SHOW_RESULT (IO_ERROR);
+    SHOW_RESULT (INVALID_IMAGE);
     default: return "Unknown result...";
   }
 
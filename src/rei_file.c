@@ -1,3 +1,6 @@
+// readahead and syncfs are GNU extensions.
+#define _GNU_SOURCE
+
 #ifdef __linux__
 #  include <fcntl.h>
 #  include <unistd.h>
@@ -7,39 +10,317 @@
 #  error "Unhandled platform..."
 #endif
 
+#include <stdio.h>
+#include <errno.h>
 #include <memory.h>
+#include <string.h>
+#include <stdlib.h>
+#include <libgen.h>
 
 #include "rei_file.h"
+#include "rei_debug.h"
 
-rei_result_e rei_read_file (const char* const relative_path, rei_file_t* out) {
+rei_result_e rei_read_file (const char* const relative_path, u32 hints, rei_file_t* out) {
   out->fd = open (relative_path, O_RDONLY);
   if (out->fd == -1) return REI_RESULT_FILE_DOES_NOT_EXIST;
 
   struct stat file_stats;
   fstat (out->fd, &file_stats);
 
-  out->size = (u32) file_stats.st_size;
-  out->data = mmap (NULL, out->size, PROT_READ, MAP_PRIVATE, out->fd, 0);
+  out->size = (u64) file_stats.st_size;
+
+  if (hints & REI_FILE_HINT_READAHEAD) readahead (out->fd, 0, out->size);
+
+  // Huge pages have to be asked for before the first fault, in that case pages are populated after advising.
+  const b8 populates_on_map = (hints & REI_FILE_HINT_POPULATE) && !(hints & REI_FILE_HINT_HUGEPAGE);
+  out->data = mmap (NULL, out->size, PROT_READ, MAP_PRIVATE | (populates_on_map ? MAP_POPULATE : 0), out->fd, 0);
+
+  rei_advise_file (out, 0, out->size, populates_on_map ? hints & ~(u32) REI_FILE_HINT_POPULATE : hints);
+
+  return REI_RESULT_SUCCESS;
+}
+
+// Extend [offset, offset + size) to whole pages, as madvise requires.
+static u8* _s_page_align_range (const rei_file_t* file, u64 offset, u64 size, u64* out_length) {
+  const u64 page_mask = (u64) sysconf (_SC_PAGESIZE) - 1;
+  const u64 begin = (u64) file->data + offset;
+
+  u8* aligned_begin = (u8*) (begin & ~page_mask);
+  *out_length = begin + size - (u64) aligned_begin;
+
+  return aligned_begin;
+}
+
+void rei_advise_file (const rei_file_t* file, u64 offset, u64 size, u32 hints) {
+  // Heap contents are already resident.
+  if (file->fd == REI_FILE_HEAP_FD || !size) return;
+
+  u64 length;
+  u8* begin = _s_page_align_range (file, offset, size, &length);
+
+  if (hints & REI_FILE_HINT_SEQUENTIAL) madvise (begin, length, MADV_SEQUENTIAL);
+  if (hints & REI_FILE_HINT_HUGEPAGE) madvise (begin, length, MADV_HUGEPAGE);
+  if (hints & REI_FILE_HINT_WILLNEED) madvise (begin, length, MADV_WILLNEED);
+
+  // Kernels older than 5.14 don't know MADV_POPULATE_READ, they get to page in asynchronously at least.
+  if (hints & REI_FILE_HINT_POPULATE && madvise (begin, length, MADV_POPULATE_READ)) madvise (begin, length, MADV_WILLNEED);
+}
+
+void rei_release_file_range (const rei_file_t* file, u64 offset, u64 size) {
+  if (file->fd == REI_FILE_HEAP_FD || !size) return;
+
+  u64 length;
+  u8* begin = _s_page_align_range (file, offset, size, &length);
+
+  madvise (begin, length, MADV_DONTNEED);
+}
+
+rei_result_e rei_open_file_window (const char* const relative_path, u64 window_size, u32 hints, rei_file_window_t* out) {
+  out->fd = open (relative_path, O_RDONLY);
+  if (out->fd == -1) return REI_RESULT_FILE_DOES_NOT_EXIST;
+
+  struct stat file_stats;
+  fstat (out->fd, &file_stats);
+
+  const u64 page_mask = (u64) sysconf (_SC_PAGESIZE) - 1;
+
+  out->hints = hints & ~(u32) REI_FILE_HINT_READAHEAD;
+  out->file_size = (u64) file_stats.st_size;
+  out->window_size = (window_size + page_mask) & ~page_mask;
+  out->mapped_offset = 0;
+  out->mapped_size = 0;
+  out->mapped = NULL;
+
+  return REI_RESULT_SUCCESS;
+}
+
+const void* rei_map_file_window (rei_file_window_t* window, u64 offset, u64 size) {
+  REI_ASSERT (offset + size <= window->file_size);
+
+  if (offset >= window->mapped_offset && offset + size <= window->mapped_offset + window->mapped_size) {
+    return window->mapped + (offset - window->mapped_offset);
+  }
+
+  if (window->mapped) munmap (window->mapped, window->mapped_size);
+
+  // Mappings have to start on a page boundary, the window starts at the page holding offset.
+  const u64 page_mask = (u64) sysconf (_SC_PAGESIZE) - 1;
+  const u64 mapped_offset = offset & ~page_mask;
+  const u64 needed_size = offset + size - mapped_offset;
+
+  window->mapped_offset = mapped_offset;
+  window->mapped_size = REI_MIN (REI_MAX (window->window_size, needed_size), window->file_size - mapped_offset);
+
+  const b8 populates_on_map = (window->hints & REI_FILE_HINT_POPULATE) && !(window->hints & REI_FILE_HINT_HUGEPAGE);
+  const s32 flags = MAP_PRIVATE | (populates_on_map ? MAP_POPULATE : 0);
+
+  window->mapped = mmap (NULL, window->mapped_size, PROT_READ, flags, window->fd, (off_t) mapped_offset);
+  REI_ASSERT (window->mapped != MAP_FAILED);
+
+  const rei_file_t mapped_file = {.fd = window->fd, .size = window->mapped_size, .data = window->mapped};
+  rei_advise_file (&mapped_file, 0, window->mapped_size, populates_on_map ? window->hints & ~(u32) REI_FILE_HINT_POPULATE : window->hints);
+
+  return window->mapped + (offset - mapped_offset);
+}
+
+void rei_close_file_window (rei_file_window_t* window) {
+  if (window->mapped) munmap (window->mapped, window->mapped_size);
+  close (window->fd);
+}
+
+static rei_result_e _s_write_all (s32 fd, const u8* data, u64 size, u64 offset) {
+  while (size) {
+    const s64 written = pwrite (fd, data, size, (off_t) offset);
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return REI_RESULT_IO_ERROR;
+    }
+
+    data += written;
+    size -= (u64) written;
+    offset += (u64) written;
+  }
+
+  return REI_RESULT_SUCCESS;
+}
+
+static void _s_flush_file_writer (rei_file_writer_t* writer) {
+  if (writer->result || !writer->buffered_size) return;
+
+  writer->result = _s_write_all (writer->fd, writer->buffer, writer->buffered_size, writer->offset);
+  writer->offset += writer->buffered_size;
+  writer->buffered_size = 0;
+}
+
+// Syncing a file doesn't make its new name durable, the directory holding it has to be synced as well.
+static void _s_sync_parent_dir (const char* const relative_path) {
+  char dir_path[REI_FILE_MAX_PATH];
+  strcpy (dir_path, relative_path);
+
+  const s32 dir_fd = open (dirname (dir_path), O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1) return;
+
+  fsync (dir_fd);
+  close (dir_fd);
+}
+
+rei_result_e rei_open_file_writer (const char* const relative_path, rei_file_writer_t* out) {
+  if (strlen (relative_path) + sizeof (".tmp") > REI_FILE_MAX_PATH) return REI_RESULT_INVALID_FILE_PATH;
+
+  strcpy (out->path, relative_path);
+  sprintf (out->temp_path, "%s.tmp", relative_path);
+
+  out->fd = open (out->temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, (mode_t) 0600);
+  if (out->fd == -1) return REI_RESULT_INVALID_FILE_PATH;
+
+  out->result = REI_RESULT_SUCCESS;
+  out->offset = 0;
+  out->buffered_size = 0;
+  // Allocated on the first small write, files written in one go never need it.
+  out->buffer = NULL;
 
   return REI_RESULT_SUCCESS;
 }
 
-void rei_write_file (const char* const relative_path, const void* data, u64 size) {
- const s32 fd = open (relative_path, O_RDWR | O_CREAT, (mode_t) 0600);
+void rei_append_file (rei_file_writer_t* writer, const void* data, u64 size) {
+  if (writer->result) return;
+
+  if (writer->buffered_size + size > REI_FILE_WRITER_BUFFER_SIZE) {
+    _s_flush_file_writer (writer);
+
+    // Big writes skip the buffer instead of being copied through it.
+    if (size >= REI_FILE_WRITER_BUFFER_SIZE) {
+      if (!writer->result) writer->result = _s_write_all (writer->fd, data, size, writer->offset);
+      writer->offset += size;
+      return;
+    }
+  }
+
+  if (!writer->buffer) writer->buffer = malloc (REI_FILE_WRITER_BUFFER_SIZE);
+
+  memcpy (writer->buffer + writer->buffered_size, data, size);
+  writer->buffered_size += size;
+}
+
+rei_result_e rei_close_file_writer (rei_file_writer_t* writer, rei_file_batch_t* batch) {
+  _s_flush_file_writer (writer);
+  free (writer->buffer);
+
+  if (!writer->result && !batch && fdatasync (writer->fd)) writer->result = REI_RESULT_IO_ERROR;
+  if (close (writer->fd) && !writer->result) writer->result = REI_RESULT_IO_ERROR;
+
+  if (writer->result) {
+    unlink (writer->temp_path);
+    return writer->result;
+  }
 
-  lseek (fd, (off_t) size, SEEK_SET);
-  write (fd, "", 1);
+  if (batch) {
+    pthread_mutex_lock (batch->lock);
 
-  void* mapped = mmap (NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    if (batch->count == batch->capacity) {
+      batch->capacity = batch->capacity ? batch->capacity << 1u : 16u;
+      batch->paths = realloc (batch->paths, sizeof *batch->paths * batch->capacity);
+    }
 
-  memcpy (mapped, data, size);
-  msync (mapped, size, MS_SYNC);
+    strcpy (batch->paths[batch->count++], writer->path);
+    pthread_mutex_unlock (batch->lock);
 
-  munmap (mapped, size);
-  close (fd);
+    return REI_RESULT_SUCCESS;
+  }
+
+  if (rename (writer->temp_path, writer->path)) {
+    unlink (writer->temp_path);
+    return REI_RESULT_IO_ERROR;
+  }
+
+  _s_sync_parent_dir (writer->path);
+  return REI_RESULT_SUCCESS;
+}
+
+void rei_create_file_batch (rei_file_batch_t* out) {
+  out->lock = malloc (sizeof *out->lock);
+  pthread_mutex_init (out->lock, NULL);
+
+  out->count = 0;
+  out->capacity = 0;
+  out->paths = NULL;
+}
+
+rei_result_e rei_commit_file_batch (rei_file_batch_t* batch) {
+  rei_result_e result = REI_RESULT_SUCCESS;
+  pthread_mutex_lock (batch->lock);
+
+  char temp_path[REI_FILE_MAX_PATH];
+  char dir_path[REI_FILE_MAX_PATH];
+  char previous_dir_path[REI_FILE_MAX_PATH] = {0};
+
+  // A single syncfs flushes every file of the batch living on the same file system, files
+  // are usually written to a handful of directories so only changes of directory are synced.
+  for (u32 i = 0; i < batch->count; ++i) {
+    strcpy (dir_path, batch->paths[i]);
+    const char* dir = dirname (dir_path);
+    if (!strcmp (dir, previous_dir_path)) continue;
+
+    strcpy (previous_dir_path, dir);
+
+    const s32 dir_fd = open (dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || syncfs (dir_fd)) result = REI_RESULT_IO_ERROR;
+    if (dir_fd != -1) close (dir_fd);
+  }
+
+  // Contents are durable, the files can replace their destinations now.
+  for (u32 i = 0; i < batch->count; ++i) {
+    const char* path = batch->paths[i];
+    sprintf (temp_path, "%s.tmp", path);
+
+    if (result || rename (temp_path, path)) {
+      unlink (temp_path);
+      result = REI_RESULT_IO_ERROR;
+      continue;
+    }
+
+    // Directories are synced once the last file of a run of files sharing them has been renamed.
+    if (i + 1 < batch->count) {
+      strcpy (dir_path, path);
+      strcpy (previous_dir_path, dirname (dir_path));
+      strcpy (dir_path, batch->paths[i + 1]);
+      if (!strcmp (dirname (dir_path), previous_dir_path)) continue;
+    }
+
+    _s_sync_parent_dir (path);
+  }
+
+  batch->count = 0;
+  pthread_mutex_unlock (batch->lock);
+
+  return result;
+}
+
+void rei_destroy_file_batch (rei_file_batch_t* batch) {
+  pthread_mutex_destroy (batch->lock);
+  free (batch->lock);
+  free (batch->paths);
+}
+
+rei_result_e rei_write_file (const char* const relative_path, const void* data, u64 size) {
+  rei_file_writer_t writer;
+
+  const rei_result_e result = rei_open_file_writer (relative_path, &writer);
+  if (result) return result;
+
+  rei_append_file (&writer, data, size);
+  return rei_close_file_writer (&writer, NULL);
 }
 
 void rei_free_file (rei_file_t* file) {
+  if (file->fd == REI_FILE_VIEW_FD) return;
+
+  if (file->fd == REI_FILE_HEAP_FD) {
+    free (file->data);
+    return;
+  }
+
   munmap (file->data, file->size);
   close (file->fd);
 }
@@ -1,18 +1,107 @@
 #ifndef REI_FILE_H
 #define REI_FILE_H
 
+#include <pthread.h>
+
 #include "rei_types.h"
 
+// Size of a rei_file_writer_t's buffer, bigger writes go to the file directly.
+#define REI_FILE_WRITER_BUFFER_SIZE (1u << 20u)
+#define REI_FILE_MAX_PATH 256u
+
+// Values of rei_file_t::fd for contents that aren't a mapping of their own.
+// Heap contents are freed by rei_free_file, views borrow memory owned by someone else (e.g. a rei_vfs_t).
+#define REI_FILE_HEAP_FD (-1)
+#define REI_FILE_VIEW_FD (-2)
+
+// Access pattern hints for mapped files, any combination of them may be passed.
+typedef enum rei_file_hint_e {
+  REI_FILE_HINT_NONE = 0u,
+  // Fault every page in while mapping, so that accessing the contents never page faults.
+  REI_FILE_HINT_POPULATE = 1u << 0u,
+  // Contents are read front to back (MADV_SEQUENTIAL), the kernel reads ahead more aggressively.
+  REI_FILE_HINT_SEQUENTIAL = 1u << 1u,
+  // Contents are needed soon (MADV_WILLNEED), they start being paged in asynchronously.
+  REI_FILE_HINT_WILLNEED = 1u << 2u,
+  // Back the mapping with transparent huge pages where the file system supports it (MADV_HUGEPAGE).
+  REI_FILE_HINT_HUGEPAGE = 1u << 3u,
+  // Pull the whole file into the page cache before mapping it (readahead), blocks until it's read.
+  REI_FILE_HINT_READAHEAD = 1u << 4u,
+} rei_file_hint_e;
+
 typedef struct rei_file_t {
   s32 fd;
-  u32 size;
+  u32 __padding;
+  u64 size;
   void* data;
 } rei_file_t;
 
 // Read file by mapping its contents into out->data. No allocations required, but it has to be unmapped (rei_free_file) later.
-rei_result_e rei_read_file (const char* const relative_path, rei_file_t* out);
+// hints is a combination of rei_file_hint_e flags.
+rei_result_e rei_read_file (const char* const relative_path, u32 hints, rei_file_t* out);
+
+// Apply hints to part of a mapped file or view (e.g. a single rei_vfs_t entry), REI_FILE_HINT_READAHEAD is ignored.
+void rei_advise_file (const rei_file_t* file, u64 offset, u64 size, u32 hints);
+// Drop pages of a range that won't be touched again (MADV_DONTNEED), they're faulted back in from the page cache if need be.
+void rei_release_file_range (const rei_file_t* file, u64 offset, u64 size);
+
+// Sliding view over a file too big to be mapped whole, only window_size bytes of it are mapped at any time.
+typedef struct rei_file_window_t {
+  s32 fd;
+  // Applied to every window as it gets mapped (rei_file_hint_e flags, REI_FILE_HINT_READAHEAD is ignored).
+  u32 hints;
+  u64 file_size;
+  u64 window_size;
+
+  // Currently mapped part of the file, its offset is page aligned.
+  u64 mapped_offset;
+  u64 mapped_size;
+  u8* mapped;
+} rei_file_window_t;
+
+rei_result_e rei_open_file_window (const char* const relative_path, u64 window_size, u32 hints, rei_file_window_t* out);
+// Get a pointer to [offset, offset + size) of the file, only remapping if that range isn't covered by the current window.
+// Windows grow to fit ranges bigger than window_size. The pointer stays valid until the next call or closing the window.
+const void* rei_map_file_window (rei_file_window_t* window, u64 offset, u64 size);
+void rei_close_file_window (rei_file_window_t* window);
+
+// Streams data into a temporary file next to the destination, which is only replaced once the writer is closed.
+// Readers see either the old or the new contents, never a partially written file or a stale tail.
+typedef struct rei_file_writer_t {
+  s32 fd;
+  // First error hit while writing, every call after that is a no-op.
+  rei_result_e result;
+  // Bytes handed to the file so far, and bytes waiting in the buffer behind them.
+  u64 offset;
+  u64 buffered_size;
+  u8* buffer;
+  char path[REI_FILE_MAX_PATH];
+  char temp_path[REI_FILE_MAX_PATH];
+} rei_file_writer_t;
+
+// Files closed into a batch are synced all at once and renamed into place by rei_commit_file_batch,
+// instead of paying for one fdatasync per file. Closing writers into the same batch is thread safe.
+typedef struct rei_file_batch_t {
+  pthread_mutex_t* lock;
+  u32 count;
+  u32 capacity;
+  char (* paths)[REI_FILE_MAX_PATH];
+} rei_file_batch_t;
+
+rei_result_e rei_open_file_writer (const char* const relative_path, rei_file_writer_t* out);
+void rei_append_file (rei_file_writer_t* writer, const void* data, u64 size);
+// Without a batch, the file is synced and renamed over its destination right away.
+// If anything failed, the temporary file is removed and the destination is left untouched.
+rei_result_e rei_close_file_writer (rei_file_writer_t* writer, rei_file_batch_t* batch);
+
+void rei_create_file_batch (rei_file_batch_t* out);
+// Sync every file closed into the batch and move them into place. The batch is empty (but still usable) afterwards.
+rei_result_e rei_commit_file_batch (rei_file_batch_t* batch);
+void rei_destroy_file_batch (rei_file_batch_t* batch);
 
-void rei_write_file (const char* const relative_path, const void* data, u64 size);
+// Write a whole file at once through a rei_file_writer_t.
+rei_result_e rei_write_file (const char* const relative_path, const void* data, u64 size);
+// Unmap file, or free its contents if they were read into heap memory. Does nothing for views.
 void rei_free_file (rei_file_t* file);
 
 #endif /* REI_FILE_H */
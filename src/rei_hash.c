@@ -1,4 +1,7 @@
+#include <memory.h>
+
 #include "rei_hash.h"
+#include "rei_defines.h"
 
 // Basically a stolen sample implementation from wikipedia (I have no idea what it's doing).
 REI_CONST u32 rei_murmur_hash (const u8* key, u64 length, u32 seed) {
@@ -47,3 +50,83 @@ REI_CONST u32 rei_murmur_hash (const u8* key, u64 length, u32 seed) {
 
   return hash;
 }
+
+static u64 _s_rotl64 (u64 value, u32 shift) {
+  return (value << shift) | (value >> (64u - shift));
+}
+
+static u64 _s_fmix64 (u64 k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+
+  return k;
+}
+
+// MurmurHash3_x64_128 keeping the first half, blocks are loaded with memcpy since contents may be unaligned.
+u64 rei_murmur_hash_64 (const u8* key, u64 length, u64 seed) {
+  const u64 c1 = 0x87c37b91114253d5ull;
+  const u64 c2 = 0x4cf5ad432745937full;
+
+  u64 h1 = seed;
+  u64 h2 = seed;
+
+  for (u64 i = length >> 4; i; --i) {
+    u64 k1, k2;
+    memcpy (&k1, key, sizeof k1);
+    memcpy (&k2, key + sizeof k1, sizeof k2);
+    key += sizeof k1 + sizeof k2;
+
+    k1 *= c1;
+    k1 = _s_rotl64 (k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+
+    h1 = _s_rotl64 (h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = _s_rotl64 (k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+
+    h2 = _s_rotl64 (h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  u64 k1 = 0;
+  u64 k2 = 0;
+  const u64 tail_size = length & 15;
+
+  for (u64 i = tail_size; i > 8; --i) k2 = (k2 << 8) | key[i - 1];
+  for (u64 i = REI_MIN (tail_size, 8); i; --i) k1 = (k1 << 8) | key[i - 1];
+
+  if (tail_size > 8) {
+    k2 *= c2;
+    k2 = _s_rotl64 (k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+  }
+
+  if (tail_size) {
+    k1 *= c1;
+    k1 = _s_rotl64 (k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = _s_fmix64 (h1);
+  h2 = _s_fmix64 (h2);
+
+  return h1 + h2;
+}
@@ -5,5 +5,7 @@
 
 // Murmur3 hash.
 REI_CONST u32 rei_murmur_hash (const u8* key, u64 length, u32 seed);
+// 64-bit Murmur3 (first half of the x64 128-bit variant), for hashing whole file contents.
+u64 rei_murmur_hash_64 (const u8* key, u64 length, u64 seed);
 
 #endif /* REI_HASH_H */
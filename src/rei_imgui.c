@@ -1,8 +1,12 @@
 #include <memory.h>
+#include <alloca.h>
 
 #include "rei_imgui.h"
 #include "rei_window.h"
 
+// Minimum number of draw lists worth handing over to another thread.
+#define _S_DRAW_LISTS_PER_CHUNK 4u
+
 void rei_imgui_create_ctxt (
   const rei_vk_device_t* vk_device,
   rei_vk_allocator_t* vk_allocator,
@@ -245,7 +249,42 @@ void rei_imgui_handle_events (ImGuiIO* io, const rei_xcb_window_t* window, const
   }
 }
 
+// Destination buffers shared by all chunks of the draw list copy loop.
+typedef struct _s_draw_list_copy_t {
+  const ImDrawData* draw_data;
+  ImDrawVert* vertices;
+  ImDrawIdx* indices;
+} _s_draw_list_copy_t;
+
+// Copy draw lists [begin, end), their offsets are found by summing up sizes of the preceding lists (there are only a few of them).
+static void _s_copy_draw_lists (u64 begin, u64 end, void* ctx) {
+  const _s_draw_list_copy_t* copy = (const _s_draw_list_copy_t*) ctx;
+
+  ImDrawVert* vertices = copy->vertices;
+  ImDrawIdx* indices = copy->indices;
+
+  for (u64 i = 0; i < begin; ++i) {
+    const ImDrawList* current = copy->draw_data->CmdLists[i];
+
+    vertices += current->VtxBuffer.Size;
+    indices += current->IdxBuffer.Size;
+  }
+
+  for (u64 i = begin; i < end; ++i) {
+    const ImDrawList* current = copy->draw_data->CmdLists[i];
+    const u64 idx_buffer_size = (u64) current->IdxBuffer.Size;
+    const u64 vtx_buffer_size = (u64) current->VtxBuffer.Size;
+
+    memcpy (vertices, current->VtxBuffer.Data, sizeof (ImDrawVert) * vtx_buffer_size);
+    memcpy (indices, current->IdxBuffer.Data, sizeof (ImDrawIdx) * idx_buffer_size);
+
+    vertices += vtx_buffer_size;
+    indices += idx_buffer_size;
+  }
+}
+
 void rei_imgui_update_buffers (
+  rei_thread_pool_t* thread_pool,
   rei_vk_allocator_t* vk_allocator,
   rei_imgui_frame_data_t* frame_data,
   const ImDrawData* draw_data,
@@ -274,21 +313,14 @@ void rei_imgui_update_buffers (
     rei_vk_map_buffer (vk_allocator, idx_buffer);
   }
 
-  // Write IMGUI data to buffers.
-  ImDrawVert* vertices = (ImDrawVert*) vtx_buffer->mapped;
-  ImDrawIdx* indices = (ImDrawIdx*) idx_buffer->mapped;
-
-  for (s32 i = 0; i < draw_data->CmdListsCount; ++i) {
-    const ImDrawList* current = draw_data->CmdLists[i];
-    const u64 idx_buffer_size = (u64) current->IdxBuffer.Size;
-    const u64 vtx_buffer_size = (u64) current->VtxBuffer.Size;
-
-    memcpy (vertices, current->VtxBuffer.Data, sizeof (ImDrawVert) * vtx_buffer_size);
-    memcpy (indices, current->IdxBuffer.Data, sizeof (ImDrawIdx) * idx_buffer_size);
+  // Write IMGUI data to buffers. Most frames have a single small draw list, so it only goes wide with many windows open.
+  _s_draw_list_copy_t copy = {
+    .draw_data = draw_data,
+    .vertices = (ImDrawVert*) vtx_buffer->mapped,
+    .indices = (ImDrawIdx*) idx_buffer->mapped
+  };
 
-    vertices += vtx_buffer_size;
-    indices += idx_buffer_size;
-  }
+  rei_parallel_for (thread_pool, 0, (u64) draw_data->CmdListsCount, _S_DRAW_LISTS_PER_CHUNK, _s_copy_draw_lists, &copy);
 
   rei_vk_flush_buffers (vk_allocator, 2, frame_data->buffers[frame_index]);
 }
@@ -327,7 +359,7 @@ void rei_imgui_draw_cmd (VkCommandBuffer vk_cmd_buffer, const rei_imgui_frame_da
   }
 }
 
-void rei_imgui_debug_window_wid (ImGuiIO* io) {
+void rei_imgui_debug_window_wid (ImGuiIO* io, const rei_thread_pool_t* thread_pool) {
   igBegin ("Debug menu:", NULL, 0);
 
   igSeparator ();
@@ -338,5 +370,35 @@ void rei_imgui_debug_window_wid (ImGuiIO* io) {
   igText ("IMGUI data: %d vertices with %d indices", io->MetricsRenderVertices, io->MetricsRenderIndices);
   igSeparator ();
 
+  rei_thread_pool_stats_t pool_stats;
+  pool_stats.workers = alloca (sizeof *pool_stats.workers * thread_pool->thread_count);
+  rei_thread_pool_get_stats (thread_pool, &pool_stats);
+
+  igText (
+    "Thread pool: %u workers, %u queued, %u pending, %u sleeping",
+    pool_stats.worker_count,
+    pool_stats.queued_task_count,
+    pool_stats.pending_task_count,
+    pool_stats.sleeping_thread_count
+  );
+
+  for (u32 i = 0; i < pool_stats.worker_count; ++i) {
+    const rei_thread_worker_stats_t* current = &pool_stats.workers[i];
+    const u64 total_ns = current->busy_ns + current->idle_ns;
+
+    igText (
+      "  #%-2u %8lu tasks | busy %5.1f%% | %6lu wake-ups | %6lu steals | lock wait %7.3f ms | max depth %u",
+      i,
+      current->task_count,
+      total_ns ? 100.0 * (f64) current->busy_ns / (f64) total_ns : 0.0,
+      current->wake_up_count,
+      current->steal_count,
+      (f64) current->lock_wait_ns / 1000000.0,
+      current->max_queue_depth
+    );
+  }
+
+  igSeparator ();
+
   igEnd ();
 }
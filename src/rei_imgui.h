@@ -2,6 +2,7 @@
 #define REI_IMGUI_H
 
 #include "rei_vk.h"
+#include "rei_thread.h"
 #include "rei_defines.h"
 
 #ifndef CIMGUI_DEFINE_ENUMS_AND_STRUCTS
@@ -57,11 +58,11 @@ void rei_imgui_destroy_frame_data (const rei_vk_device_t* vk_device, rei_vk_allo
 
 void rei_imgui_new_frame (ImGuiIO* io);
 void rei_imgui_handle_events (ImGuiIO* io, const rei_xcb_window_t* window, const xcb_generic_event_t* event);
-void rei_imgui_update_buffers (rei_vk_allocator_t* vk_allocator, rei_imgui_frame_data_t* buffers, const ImDrawData* draw_data, u32 frame_index);
+void rei_imgui_update_buffers (rei_thread_pool_t* thread_pool, rei_vk_allocator_t* vk_allocator, rei_imgui_frame_data_t* buffers, const ImDrawData* draw_data, u32 frame_index);
 
 void rei_imgui_draw_cmd (VkCommandBuffer vk_cmd_buffer, const rei_imgui_frame_data_t* frame_data, const ImDrawData* draw_data, u32 frame_index);
 
 // Widgets.
-void rei_imgui_debug_window_wid (ImGuiIO* io);
+void rei_imgui_debug_window_wid (ImGuiIO* io, const rei_thread_pool_t* thread_pool);
 
 #endif /* REI_IMGUI_H */
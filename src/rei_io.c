@@ -0,0 +1,384 @@
+// Thread naming is a GNU extension.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <memory.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "rei_io.h"
+#include "rei_debug.h"
+
+// There's no libc wrapper for io_uring, the rings are set up by hand instead of pulling in liburing.
+static s32 _s_io_uring_setup (u32 entry_count, struct io_uring_params* params) {
+  return (s32) syscall (__NR_io_uring_setup, entry_count, params);
+}
+
+static s32 _s_io_uring_enter (s32 ring_fd, u32 submit_count, u32 min_complete, u32 flags) {
+  return (s32) syscall (__NR_io_uring_enter, ring_fd, submit_count, min_complete, flags, NULL, 0);
+}
+
+static b8 _s_setup_ring (rei_io_t* io, u32 queue_depth) {
+  struct io_uring_params params;
+  memset (&params, 0, sizeof params);
+
+  // Fails with ENOSYS on old kernels and EPERM where io_uring is disabled (containers, io_uring_disabled sysctl).
+  const s32 ring_fd = _s_io_uring_setup (queue_depth, &params);
+  if (ring_fd < 0) return REI_FALSE;
+
+  io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (u32);
+  io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+
+  // Newer kernels map both rings at once.
+  const b8 is_single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (is_single_mmap) io->sq_ring_size = io->cq_ring_size = REI_MAX (io->sq_ring_size, io->cq_ring_size);
+
+  io->sq_ring = mmap (NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  REI_ASSERT (io->sq_ring != MAP_FAILED);
+
+  if (is_single_mmap) {
+    io->cq_ring = io->sq_ring;
+  } else {
+    io->cq_ring = mmap (NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    REI_ASSERT (io->cq_ring != MAP_FAILED);
+  }
+
+  io->sqes = mmap (
+    NULL,
+    params.sq_entries * sizeof *io->sqes,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE,
+    ring_fd,
+    IORING_OFF_SQES
+  );
+
+  REI_ASSERT (io->sqes != MAP_FAILED);
+
+  u8* sq_ring = io->sq_ring;
+  u8* cq_ring = io->cq_ring;
+
+  io->sq_head = (u32*) (sq_ring + params.sq_off.head);
+  io->sq_tail = (u32*) (sq_ring + params.sq_off.tail);
+  io->sq_array = (u32*) (sq_ring + params.sq_off.array);
+  io->sq_mask = *(u32*) (sq_ring + params.sq_off.ring_mask);
+
+  io->cq_head = (u32*) (cq_ring + params.cq_off.head);
+  io->cq_tail = (u32*) (cq_ring + params.cq_off.tail);
+  io->cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+  io->cq_mask = *(u32*) (cq_ring + params.cq_off.ring_mask);
+
+  // The completion ring is twice as big as the submission ring, capping reads in flight
+  // to the latter means completions can never overflow.
+  io->queue_depth = params.sq_entries;
+  io->ring_fd = ring_fd;
+
+  return REI_TRUE;
+}
+
+// Hand the kernel as many pending reads as there are free queue entries. Has to be called with io->lock held.
+static void _s_submit_pending (rei_io_t* io) {
+  u32 tail = *io->sq_tail;
+  u32 submit_count = 0;
+
+  while (io->pending_head && io->in_flight_count < io->queue_depth) {
+    rei_io_read_t* read = io->pending_head;
+    io->pending_head = read->next;
+    if (!io->pending_head) io->pending_tail = NULL;
+
+    read->chunk.iov_base = (u8*) read->file.data + read->offset;
+    read->chunk.iov_len = REI_MIN (read->file.size - read->offset, REI_IO_MAX_CHUNK_SIZE);
+
+    const u32 index = tail & io->sq_mask;
+    struct io_uring_sqe* sqe = &io->sqes[index];
+    memset (sqe, 0, sizeof *sqe);
+
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = read->file.fd;
+    sqe->off = read->offset;
+    sqe->addr = (u64) &read->chunk;
+    sqe->len = 1;
+    sqe->user_data = (u64) read;
+
+    io->sq_array[index] = index;
+
+    ++tail;
+    ++submit_count;
+    ++io->in_flight_count;
+  }
+
+  if (!submit_count) return;
+
+  // Publish entries before the kernel gets to look at the new tail.
+  __atomic_store_n (io->sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (submit_count) {
+    const s32 submitted = _s_io_uring_enter (io->ring_fd, submit_count, 0, 0);
+
+    if (submitted < 0) {
+      REI_ASSERT (errno == EINTR || errno == EAGAIN);
+      continue;
+    }
+
+    submit_count -= (u32) submitted;
+  }
+}
+
+static void _s_complete_read (rei_io_t* io, rei_io_read_t* read) {
+  if (read->file.fd != -1) close (read->file.fd);
+
+  // From now on the contents are plain heap memory, see rei_free_file.
+  read->file.fd = REI_FILE_HEAP_FD;
+
+  if (read->result) {
+    free (read->file.data);
+    read->file.data = NULL;
+    read->file.size = 0;
+  }
+
+  // The read belongs to the caller again as soon as the counter is released, nothing may touch it past that.
+  rei_thread_counter_t* counter = read->counter;
+
+  if (read->on_complete) rei_thread_pool_add_task (io->thread_pool, read->on_complete, read, counter, read->priority);
+  if (counter) rei_thread_pool_decrement_counter (io->thread_pool, counter);
+}
+
+static void* _s_reap_routine (void* arg) {
+  rei_io_t* io = (rei_io_t*) arg;
+
+  for (;;) {
+    if (_s_io_uring_enter (io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+      REI_ASSERT (errno == EINTR);
+      continue;
+    }
+
+    rei_io_read_t* finished = NULL;
+    // Reads that came back short or were interrupted, they go to the front of the queue.
+    rei_io_read_t* retry_head = NULL;
+    rei_io_read_t* retry_tail = NULL;
+
+    u32 reaped_count = 0;
+    b8 has_to_quit = REI_FALSE;
+
+    u32 head = *io->cq_head;
+    const u32 tail = __atomic_load_n (io->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe* cqe = &io->cqes[head & io->cq_mask];
+      rei_io_read_t* read = (rei_io_read_t*) cqe->user_data;
+
+      // Sent by rei_io_destroy.
+      if (!read) {
+        has_to_quit = REI_TRUE;
+        continue;
+      }
+
+      ++reaped_count;
+
+      if (cqe->res > 0) {
+        read->offset += (u64) cqe->res;
+      } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+        // Zero bytes read means the file got truncated since it was opened.
+        read->result = REI_RESULT_IO_ERROR;
+      }
+
+      if (read->result || read->offset == read->file.size) {
+        read->next = finished;
+        finished = read;
+      } else {
+        read->next = NULL;
+        if (retry_tail) retry_tail->next = read;
+        else retry_head = read;
+        retry_tail = read;
+      }
+    }
+
+    __atomic_store_n (io->cq_head, head, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock (io->lock);
+
+    io->in_flight_count -= reaped_count;
+
+    if (retry_head) {
+      retry_tail->next = io->pending_head;
+      io->pending_head = retry_head;
+      if (!io->pending_tail) io->pending_tail = retry_tail;
+    }
+
+    // Completions free up queue entries for reads that didn't fit before.
+    _s_submit_pending (io);
+
+    pthread_mutex_unlock (io->lock);
+
+    while (finished) {
+      rei_io_read_t* read = finished;
+      finished = read->next;
+      _s_complete_read (io, read);
+    }
+
+    if (has_to_quit) break;
+  }
+
+  return NULL;
+}
+
+// Fallback for kernels without io_uring, reads are done one after another with blocking calls.
+static void* _s_blocking_routine (void* arg) {
+  rei_io_t* io = (rei_io_t*) arg;
+
+  for (;;) {
+    pthread_mutex_lock (io->lock);
+    while (!io->pending_head && !io->has_to_quit) pthread_cond_wait (io->pending_cond, io->lock);
+
+    rei_io_read_t* read = io->pending_head;
+    if (read) {
+      io->pending_head = read->next;
+      if (!io->pending_head) io->pending_tail = NULL;
+    }
+
+    pthread_mutex_unlock (io->lock);
+
+    if (!read) break;
+
+    while (read->offset < read->file.size) {
+      const u64 chunk_size = REI_MIN (read->file.size - read->offset, REI_IO_MAX_CHUNK_SIZE);
+      const s64 result = pread (read->file.fd, (u8*) read->file.data + read->offset, chunk_size, (off_t) read->offset);
+
+      if (result > 0) {
+        read->offset += (u64) result;
+      } else if (result == 0 || errno != EINTR) {
+        read->result = REI_RESULT_IO_ERROR;
+        break;
+      }
+    }
+
+    _s_complete_read (io, read);
+  }
+
+  return NULL;
+}
+
+void rei_io_create (const rei_io_ci_t* create_info, rei_io_t* out) {
+  memset (out, 0, sizeof *out);
+
+  out->thread_pool = create_info->thread_pool;
+  out->ring_fd = -1;
+
+  out->lock = malloc (sizeof *out->lock);
+  out->pending_cond = malloc (sizeof *out->pending_cond);
+  pthread_mutex_init (out->lock, NULL);
+  pthread_cond_init (out->pending_cond, NULL);
+
+  if (!create_info->use_blocking_reads) {
+    const u32 queue_depth = create_info->queue_depth ? create_info->queue_depth : REI_IO_QUEUE_DEPTH;
+    if (!_s_setup_ring (out, queue_depth)) REI_LOG_STR_WARN ("io_uring is unavailable, falling back to blocking reads.");
+  }
+
+  pthread_create (&out->thread, NULL, out->ring_fd == -1 ? _s_blocking_routine : _s_reap_routine, out);
+  pthread_setname_np (out->thread, "rei-io");
+}
+
+void rei_io_destroy (rei_io_t* io) {
+  pthread_mutex_lock (io->lock);
+  io->has_to_quit = REI_TRUE;
+
+  if (io->ring_fd == -1) {
+    pthread_cond_signal (io->pending_cond);
+  } else {
+    // Wake the reaper up with a no-op, the queue is empty since every submission is consumed right away.
+    const u32 tail = *io->sq_tail;
+    const u32 index = tail & io->sq_mask;
+
+    struct io_uring_sqe* sqe = &io->sqes[index];
+    memset (sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_NOP;
+
+    io->sq_array[index] = index;
+    __atomic_store_n (io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (_s_io_uring_enter (io->ring_fd, 1, 0, 0) < 0) REI_ASSERT (errno == EINTR || errno == EAGAIN);
+  }
+
+  pthread_mutex_unlock (io->lock);
+  pthread_join (io->thread, NULL);
+
+  if (io->ring_fd != -1) {
+    munmap (io->sqes, (io->sq_mask + 1) * sizeof *io->sqes);
+    if (io->cq_ring != io->sq_ring) munmap (io->cq_ring, io->cq_ring_size);
+    munmap (io->sq_ring, io->sq_ring_size);
+    close (io->ring_fd);
+  }
+
+  pthread_cond_destroy (io->pending_cond);
+  pthread_mutex_destroy (io->lock);
+  free (io->pending_cond);
+  free (io->lock);
+}
+
+void rei_io_read_files (
+  rei_io_t* io,
+  u32 count,
+  rei_io_read_t* reads,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority) {
+
+  if (counter) rei_thread_counter_increment (counter, count);
+
+  rei_io_read_t* first = NULL;
+  rei_io_read_t* last = NULL;
+
+  // Opening is cheap next to reading and stays synchronous, so that sizes are known before submitting.
+  for (u32 i = 0; i < count; ++i) {
+    rei_io_read_t* current = &reads[i];
+
+    current->counter = counter;
+    current->priority = priority;
+    current->offset = 0;
+    current->result = REI_RESULT_SUCCESS;
+    current->next = NULL;
+    current->file.data = NULL;
+    current->file.size = 0;
+
+    current->file.fd = open (current->relative_path, O_RDONLY | O_CLOEXEC);
+
+    if (current->file.fd == -1) {
+      current->result = REI_RESULT_FILE_DOES_NOT_EXIST;
+      _s_complete_read (io, current);
+      continue;
+    }
+
+    struct stat file_stats;
+    fstat (current->file.fd, &file_stats);
+
+    current->file.size = (u64) file_stats.st_size;
+
+    if (!current->file.size) {
+      _s_complete_read (io, current);
+      continue;
+    }
+
+    current->file.data = malloc (current->file.size);
+
+    if (last) last->next = current;
+    else first = current;
+    last = current;
+  }
+
+  if (!first) return;
+
+  pthread_mutex_lock (io->lock);
+
+  if (io->pending_tail) io->pending_tail->next = first;
+  else io->pending_head = first;
+  io->pending_tail = last;
+
+  if (io->ring_fd == -1) pthread_cond_signal (io->pending_cond);
+  else _s_submit_pending (io);
+
+  pthread_mutex_unlock (io->lock);
+}
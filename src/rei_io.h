@@ -0,0 +1,92 @@
+#ifndef REI_IO_H
+#define REI_IO_H
+
+#include <sys/uio.h>
+
+#include "rei_file.h"
+#include "rei_thread.h"
+
+// Default number of submission queue entries, reads past that many are held back until others complete.
+#define REI_IO_QUEUE_DEPTH 64u
+// Largest amount of bytes requested from the kernel at once, bigger files are read in several steps.
+#define REI_IO_MAX_CHUNK_SIZE (1u << 30u)
+
+typedef struct rei_io_ci_t {
+  // Pool completions are reported to.
+  rei_thread_pool_t* thread_pool;
+  // Zero means REI_IO_QUEUE_DEPTH.
+  u32 queue_depth;
+  // Skip io_uring and read files with blocking calls on the I/O thread (done anyway where io_uring isn't available).
+  b32 use_blocking_reads;
+} rei_io_ci_t;
+
+// Single file read. Memory is owned by the caller and has to stay put until the read completes.
+typedef struct rei_io_read_t {
+  // Filled in by the caller.
+  const char* relative_path;
+  // Optional, queued on the pool with the read itself as argument once the file is in memory (or failed to load).
+  rei_thread_task_action_f on_complete;
+  void* arg;
+
+  // Filled in once the read completes. Contents are heap allocated and released with rei_free_file.
+  rei_file_t file;
+  rei_result_e result;
+
+  // Internal state.
+  rei_thread_priority_e priority;
+  u64 offset;
+  rei_thread_counter_t* counter;
+  struct iovec chunk;
+  struct rei_io_read_t* next;
+} rei_io_read_t;
+
+typedef struct rei_io_t {
+  rei_thread_pool_t* thread_pool;
+
+  // Rings shared with the kernel, ring_fd is -1 when reads are done with blocking calls instead.
+  s32 ring_fd;
+  u32 sq_mask;
+  u32 cq_mask;
+  u32 queue_depth;
+  u32* sq_head;
+  u32* sq_tail;
+  u32* sq_array;
+  u32* cq_head;
+  u32* cq_tail;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  void* cq_ring;
+  u64 sq_ring_size;
+  u64 cq_ring_size;
+
+  // Guards everything below, the I/O thread sleeps on pending_cond in blocking mode.
+  pthread_mutex_t* lock;
+  pthread_cond_t* pending_cond;
+  // Reads waiting for a free queue entry (or for the I/O thread in blocking mode).
+  rei_io_read_t* pending_head;
+  rei_io_read_t* pending_tail;
+  // Reads handed to the kernel whose completion hasn't been reaped yet.
+  u32 in_flight_count;
+  b32 has_to_quit;
+
+  // Reaps completions (or does all the reading in blocking mode).
+  pthread_t thread;
+} rei_io_t;
+
+void rei_io_create (const rei_io_ci_t* create_info, rei_io_t* out);
+// All reads have to be complete by now.
+void rei_io_destroy (rei_io_t* io);
+
+// Start reading count files at once, returns without waiting for any of them. Counter is optional, it is
+// incremented for every read and decremented once its on_complete task (if any) has run, so that
+// rei_thread_pool_wait_counter covers the whole load. Completion tasks are queued with the given priority.
+void rei_io_read_files (
+  rei_io_t* io,
+  u32 count,
+  rei_io_read_t* reads,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority
+);
+
+#endif /* REI_IO_H */
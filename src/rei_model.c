@@ -1,4 +1,5 @@
 #include <memory.h>
+#include <string.h>
 #include <alloca.h>
 
 #include "rei_asset.h"
@@ -46,189 +47,449 @@ static void* _s_get_gltf_accessor_data (const rei_gltf_t* const gltf, u32 index)
   return buffer->data + accessor->byte_offset + buffer_view->offset;
 }
 
-static void _s_load_textures (
-  const char* const model_path,
-  const rei_gltf_t* const gltf,
-  const rei_vk_device_t* vk_device,
-  rei_vk_allocator_t* vk_allocator,
-  const rei_vk_imm_ctxt_t* vk_imm_ctxt,
-  rei_model_t* out) {
+// Job arguments for every stage of model loading.
+typedef struct _s_geometry_job_t {
+  const rei_gltf_t* gltf;
+  rei_thread_pool_t* thread_pool;
+  rei_vk_allocator_t* vk_allocator;
+  rei_vk_buffer_t* staging_buffer;
+  u64 vtx_buffer_size;
+  u64 idx_buffer_size;
+  rei_model_t* out;
+} _s_geometry_job_t;
+
+typedef struct _s_texture_job_t {
+  rei_io_t* io;
+  const rei_vfs_t* vfs;
+  rei_thread_pool_t* thread_pool;
+  const rei_vk_device_t* vk_device;
+  rei_vk_allocator_t* vk_allocator;
+  rei_vk_buffer_t* staging_buffer;
+  rei_vk_image_t* out;
+  rei_model_texture_t* state;
+  rei_vk_texture_upload_t upload;
+  char path[128];
+} _s_texture_job_t;
+
+typedef struct _s_descriptor_job_t {
+  const rei_gltf_t* gltf;
+  const rei_vk_device_t* vk_device;
+  VkSampler vk_sampler;
+  VkDescriptorSetLayout vk_descriptor_layout;
+  rei_model_t* out;
+} _s_descriptor_job_t;
+
+// Extent of a single primitive in model space and in texture space.
+typedef struct _s_primitive_bounds_t {
+  f32 min[3];
+  f32 max[3];
+  f32 uv_min[2];
+  f32 uv_max[2];
+} _s_primitive_bounds_t;
+
+// Destination of every primitive's vertices and indices, shared by all chunks of the interleaving loop.
+typedef struct _s_interleave_ctxt_t {
+  const rei_gltf_t* gltf;
+  const rei_gltf_primitive_t* primitives;
+  const u32* vtx_offsets;
+  const u32* idx_offsets;
+  rei_vertex_t* vertices;
+  u32* indices;
+  _s_primitive_bounds_t* bounds;
+} _s_interleave_ctxt_t;
+
+// Interleave vertex attributes and rebase indices of primitives [begin, end).
+static void _s_interleave_primitives (u64 begin, u64 end, void* ctx) {
+  const _s_interleave_ctxt_t* interleave_ctxt = (const _s_interleave_ctxt_t*) ctx;
+  const rei_gltf_t* gltf = interleave_ctxt->gltf;
+
+  const u64 vec2_size = sizeof (f32) * 2;
+  const u64 vec3_size = sizeof (f32) * 3;
+
+  for (u64 i = begin; i < end; ++i) {
+    const rei_gltf_primitive_t* current_primitive = &interleave_ctxt->primitives[i];
+
+    const u32 vtx_start = interleave_ctxt->vtx_offsets[i];
+    rei_vertex_t* vertices = &interleave_ctxt->vertices[vtx_start];
+    u32* indices = &interleave_ctxt->indices[interleave_ctxt->idx_offsets[i]];
+
+    const f32* position = (const f32*) _s_get_gltf_accessor_data (gltf, current_primitive->position_index);
+    const f32* normal = (const f32*) _s_get_gltf_accessor_data (gltf, current_primitive->normal_index);
+    const f32* uv = (const f32*) _s_get_gltf_accessor_data (gltf, current_primitive->uv_index);
+
+    const u32 current_vertex_count = gltf->accessors[current_primitive->position_index].count;
+
+    _s_primitive_bounds_t* bounds = &interleave_ctxt->bounds[i];
+    for (u32 k = 0; k < 3; ++k) bounds->min[k] = bounds->max[k] = current_vertex_count ? position[k] : 0.f;
+    for (u32 k = 0; k < 2; ++k) bounds->uv_min[k] = bounds->uv_max[k] = current_vertex_count ? uv[k] : 0.f;
+
+    for (u32 j = 0; j < current_vertex_count; ++j) {
+      rei_vertex_t* new_vertex = &vertices[j];
+
+      memcpy (&new_vertex->x, &position[j * 3], vec3_size);
+      memcpy (&new_vertex->nx, &normal[j * 3], vec3_size);
+      memcpy (&new_vertex->u, &uv[j * 2], vec2_size);
+
+      for (u32 k = 0; k < 3; ++k) {
+        bounds->min[k] = REI_MIN (bounds->min[k], position[j * 3 + k]);
+        bounds->max[k] = REI_MAX (bounds->max[k], position[j * 3 + k]);
+      }
 
-  out->texture_count = gltf->texture_count;
-  out->textures = malloc (sizeof *out->textures * out->texture_count);
+      for (u32 k = 0; k < 2; ++k) {
+        bounds->uv_min[k] = REI_MIN (bounds->uv_min[k], uv[j * 2 + k]);
+        bounds->uv_max[k] = REI_MAX (bounds->uv_max[k], uv[j * 2 + k]);
+      }
+    }
 
-  char full_path[128] = {0};
-  strcpy (full_path, model_path);
-  char* filename = strrchr (full_path, '/');
+    const u32 current_index_count = gltf->accessors[current_primitive->indices_index].count;
+    const u16* index_data = (const u16*) _s_get_gltf_accessor_data (gltf, current_primitive->indices_index);
 
-  rei_vk_buffer_t* staging_buffers = malloc (sizeof *staging_buffers * out->texture_count);
+    for (u32 k = 0; k < current_index_count; ++k) indices[k] = index_data[k] + vtx_start;
+  }
+}
 
-  VkCommandBuffer vk_cmd_buffer;
-  rei_vk_start_imm_cmd (vk_device, vk_imm_ctxt, &vk_cmd_buffer);
+// Merge all primitives into a single vertex/index staging buffer and form batches of them.
+static void _s_build_geometry (void* arg) {
+  _s_geometry_job_t* job = (_s_geometry_job_t*) arg;
+  const rei_gltf_t* gltf = job->gltf;
+  rei_model_t* out = job->out;
 
-  for (u32 i = 0; i < gltf->texture_count; ++i) {
-    const rei_gltf_texture_t* current_texture = &gltf->textures[i];
-    const rei_gltf_image_t* current_image = &gltf->images[current_texture->image_index];
+  // Merge all primitives into a single array.
+  u32 primitive_count = 0;
+  for (u32 i = 0; i < gltf->mesh_count; ++i) primitive_count += gltf->meshes[i].primitive_count;
 
-    strcpy (filename + 1, current_image->uri);
+  u32 primitive_offset = 0;
+  rei_gltf_primitive_t* sorted_primitives = malloc (sizeof *sorted_primitives * primitive_count);
 
-    rei_texture_t new_texture;
+  for (u32 i = 0; i < gltf->mesh_count; ++i) {
+    const rei_gltf_mesh_t* current_mesh = &gltf->meshes[i];
 
-    char* ext = strrchr (full_path, '.');
-    if (ext++) {
-      strcpy (ext, "rtex");
-      rei_texture_load (full_path, &new_texture);
-    }
+    const u32 current_size = sizeof (rei_gltf_primitive_t) * current_mesh->primitive_count;
+    memcpy (sorted_primitives + primitive_offset, current_mesh->primitives, current_size);
 
-    rei_vk_create_texture_cmd (vk_device, vk_allocator, vk_cmd_buffer, &staging_buffers[i], &new_texture, &out->textures[i]);
-    rei_texture_destroy (&new_texture);
+    primitive_offset += current_size;
   }
 
-  rei_vk_end_imm_cmd (vk_device, vk_imm_ctxt, vk_cmd_buffer);
+  _s_sort_gltf_primitives (sorted_primitives, 0, primitive_count - 1);
 
-  for (u32 i = 0; i < gltf->texture_count; ++i) rei_vk_destroy_buffer (vk_allocator, &staging_buffers[i]);
-  free (staging_buffers);
-}
+  u32 vtx_count = 0;
+  u32 idx_count = 0;
 
-void rei_model_create (
-  const char* relative_path,
-  const rei_vk_device_t* vk_device,
-  rei_vk_allocator_t* vk_allocator,
-  const rei_vk_imm_ctxt_t* vk_imm_ctxt,
-  VkSampler vk_sampler,
-  VkDescriptorSetLayout vk_descriptor_layout,
-  rei_model_t* out) {
+  // Count overall number of vertices and indices, remembering where each primitive starts.
+  u32* vtx_offsets = malloc (sizeof *vtx_offsets * primitive_count);
+  u32* idx_offsets = malloc (sizeof *idx_offsets * primitive_count);
 
-  rei_gltf_t gltf;
-  REI_CHECK (rei_gltf_load (relative_path, &gltf));
-  REI_LOG_WARN ("%lu", gltf.meshes[0].primitive_count);
-
-  { // Create vertex and index buffers.
+  for (u64 i = 0; i < primitive_count; ++i) {
+    const rei_gltf_primitive_t* current = &sorted_primitives[i];
 
-    // Merge all primitives into a single array.
-    u32 primitive_count = 0;
-    for (u32 i = 0; i < gltf.mesh_count; ++i) primitive_count += gltf.meshes[i].primitive_count;
+    vtx_offsets[i] = vtx_count;
+    idx_offsets[i] = idx_count;
 
-    u32 primitive_offset = 0;
-    rei_gltf_primitive_t* sorted_primitives = malloc (sizeof *sorted_primitives * primitive_count);
+    vtx_count += gltf->accessors[current->position_index].count;
+    idx_count += gltf->accessors[current->indices_index].count;
+  }
 
-    for (u32 i = 0; i < gltf.mesh_count; ++i) {
-      const rei_gltf_mesh_t* current_mesh = &gltf.meshes[i];
+  job->vtx_buffer_size = sizeof (rei_vertex_t) * vtx_count;
+  // FIXME I don't get why do I have to use u32 as the index type when indices in the model are definitely u16...
+  job->idx_buffer_size = sizeof (u32) * idx_count;
+
+  rei_vk_buffer_t* staging_buffer = job->staging_buffer;
+  rei_vk_create_buffer (job->vk_allocator, job->vtx_buffer_size + job->idx_buffer_size, REI_VK_BUFFER_TYPE_STAGING, staging_buffer);
+  rei_vk_map_buffer (job->vk_allocator, staging_buffer);
+
+  rei_vertex_t* vertices = (rei_vertex_t*) staging_buffer->mapped;
+  u32* indices = (u32*) (staging_buffer->mapped + job->vtx_buffer_size);
+
+  _s_primitive_bounds_t* primitive_bounds = malloc (sizeof *primitive_bounds * primitive_count);
+
+  _s_interleave_ctxt_t interleave_ctxt = {
+    .gltf = gltf,
+    .primitives = sorted_primitives,
+    .vtx_offsets = vtx_offsets,
+    .idx_offsets = idx_offsets,
+    .vertices = vertices,
+    .indices = indices,
+    .bounds = primitive_bounds
+  };
+
+  rei_parallel_for (job->thread_pool, 0, primitive_count, 1, _s_interleave_primitives, &interleave_ctxt);
+
+  { // Merge primitive bounds into the ones of the textures they sample, streaming goes by them.
+    _s_primitive_bounds_t* texture_bounds = malloc (sizeof *texture_bounds * out->texture_count);
+    b8* is_sampled = malloc (sizeof *is_sampled * out->texture_count);
+    memset (is_sampled, 0, sizeof *is_sampled * out->texture_count);
+
+    for (u32 i = 0; i < primitive_count; ++i) {
+      const u32 texture_index = gltf->materials[sorted_primitives[i].material_index].albedo_index;
+      const _s_primitive_bounds_t* current = &primitive_bounds[i];
+      _s_primitive_bounds_t* merged = &texture_bounds[texture_index];
+
+      if (!is_sampled[texture_index]) {
+        is_sampled[texture_index] = REI_TRUE;
+        *merged = *current;
+        continue;
+      }
 
-      const u32 current_size = sizeof (rei_gltf_primitive_t) * current_mesh->primitive_count;
-      memcpy (sorted_primitives + primitive_offset, current_mesh->primitives, current_size);
+      for (u32 k = 0; k < 3; ++k) {
+        merged->min[k] = REI_MIN (merged->min[k], current->min[k]);
+        merged->max[k] = REI_MAX (merged->max[k], current->max[k]);
+      }
 
-      primitive_offset += current_size;
+      for (u32 k = 0; k < 2; ++k) {
+        merged->uv_min[k] = REI_MIN (merged->uv_min[k], current->uv_min[k]);
+        merged->uv_max[k] = REI_MAX (merged->uv_max[k], current->uv_max[k]);
+      }
     }
 
-    _s_sort_gltf_primitives (sorted_primitives, 0, primitive_count - 1);
+    for (u32 i = 0; i < out->texture_count; ++i) {
+      rei_model_texture_t* state = &out->texture_states[i];
+      const _s_primitive_bounds_t* current = &texture_bounds[i];
 
-    u32 vtx_count = 0;
-    u32 idx_count = 0;
+      if (!is_sampled[i]) {
+        state->bounds.x = state->bounds.y = state->bounds.z = state->bounds.w = 0.f;
+        state->uv_extent = 0.f;
+        continue;
+      }
 
-    // Count overall number of vertices and indices.
-    for (u64 i = 0; i < primitive_count; ++i) {
-      const rei_gltf_primitive_t* current = &sorted_primitives[i];
+      const f32 half_x = (current->max[0] - current->min[0]) * .5f;
+      const f32 half_y = (current->max[1] - current->min[1]) * .5f;
+      const f32 half_z = (current->max[2] - current->min[2]) * .5f;
 
-      vtx_count += gltf.accessors[current->position_index].count;
-      idx_count += gltf.accessors[current->indices_index].count;
+      state->bounds.x = current->min[0] + half_x;
+      state->bounds.y = current->min[1] + half_y;
+      state->bounds.z = current->min[2] + half_z;
+      state->bounds.w = sqrtf (half_x * half_x + half_y * half_y + half_z * half_z);
+      state->uv_extent = REI_MAX (current->uv_max[0] - current->uv_min[0], current->uv_max[1] - current->uv_min[1]);
     }
 
-    const u64 vtx_buffer_size = sizeof (rei_vertex_t) * vtx_count;
-    // FIXME I don't get why do I have to use u32 as the index type when indices in the model are definitely u16...
-    const u64 idx_buffer_size = sizeof (u32) * idx_count;
+    free (is_sampled);
+    free (texture_bounds);
+  }
 
-    rei_vk_buffer_t staging_buffer;
-    rei_vk_create_buffer (vk_allocator, vtx_buffer_size + idx_buffer_size, REI_VK_BUFFER_TYPE_STAGING, &staging_buffer);
-    rei_vk_map_buffer (vk_allocator, &staging_buffer);
+  free (primitive_bounds);
 
-    rei_vertex_t* vertices = (rei_vertex_t*) staging_buffer.mapped;
-    u32* indices = (u32*) (staging_buffer.mapped + vtx_buffer_size);
+  // Nothing reads the buffers past interleaving, their pages may go long before the gltf is destroyed.
+  for (u32 i = 0; i < gltf->buffer_count; ++i) rei_release_file_range (&gltf->buffers[i], 0, gltf->buffers[i].size);
 
-    u32 vtx_offset = 0;
-    u32 idx_offset = 0;
+  out->batch_count = gltf->material_count;
+  out->batches = malloc (sizeof *out->batches);
+  out->batches->first_indices = malloc (sizeof *out->batches->first_indices * out->batch_count);
+  out->batches->idx_counts = malloc (sizeof *out->batches->idx_counts * out->batch_count);
+  out->batches->material_indices = malloc (sizeof *out->batches->material_indices * out->batch_count);
 
-    const u64 vec2_size = sizeof (f32) * 2;
-    const u64 vec3_size = sizeof (f32) * 3;
+  u32 batch_offset = 0;
 
-    out->batch_count = gltf.material_count;
-    out->batches = malloc (sizeof *out->batches);
-    out->batches->first_indices = malloc (sizeof *out->batches->first_indices * out->batch_count);
-    out->batches->idx_counts = malloc (sizeof *out->batches->idx_counts * out->batch_count);
-    out->batches->material_indices = malloc (sizeof *out->batches->material_indices * out->batch_count);
+  struct {
+    u32 first_index;
+    u32 idx_count;
+    u32 material_index;
+  } current_batch = {0};
 
-    u32 batch_offset = 0;
+  for (u64 i = 0; i < primitive_count; ++i) {
+    const rei_gltf_primitive_t* current_primitive = &sorted_primitives[i];
+    const u32 current_index_count = gltf->accessors[current_primitive->indices_index].count;
 
-    struct {
-      u32 first_index;
-      u32 idx_count;
-      u32 material_index;
-    } current_batch = {0};
+    if (current_batch.material_index == current_primitive->material_index) {
+      current_batch.idx_count += current_index_count;
+    } else {
+      out->batches->first_indices[batch_offset] = current_batch.first_index;
+      out->batches->idx_counts[batch_offset] = current_batch.idx_count;
+      out->batches->material_indices[batch_offset] = current_batch.material_index;
 
-    for (u64 i = 0; i < primitive_count; ++i) {
-      const rei_gltf_primitive_t* current_primitive = &sorted_primitives[i];
+      ++batch_offset;
 
-      const u32 vtx_start = vtx_offset;
+      current_batch.first_index = idx_offsets[i];
+      current_batch.idx_count = current_index_count;
+      current_batch.material_index = current_primitive->material_index;
+    }
+  }
 
-      const f32* position = (const f32*) _s_get_gltf_accessor_data (&gltf, current_primitive->position_index);
-      const f32* normal = (const f32*) _s_get_gltf_accessor_data (&gltf, current_primitive->normal_index);
-      const f32* uv = (const f32*) _s_get_gltf_accessor_data (&gltf, current_primitive->uv_index);
+  out->batches->first_indices[batch_offset] = current_batch.first_index;
+  out->batches->idx_counts[batch_offset] = current_batch.idx_count;
+  out->batches->material_indices[batch_offset] = current_batch.material_index;
 
-      const u32 current_vertex_count = gltf.accessors[current_primitive->position_index].count;
+  rei_vk_unmap_buffer (job->vk_allocator, staging_buffer);
+  free (idx_offsets);
+  free (vtx_offsets);
+  free (sorted_primitives);
 
-      for (u32 j = 0; j < current_vertex_count; ++j) {
-        rei_vertex_t* new_vertex = &vertices[vtx_offset++];
+  out->buffers = malloc (sizeof *out->buffers);
 
-        memcpy (&new_vertex->x, &position[j * 3], vec3_size);
-        memcpy (&new_vertex->nx, &normal[j * 3], vec3_size);
-        memcpy (&new_vertex->u, &uv[j * 2], vec2_size);
-      }
+  rei_vk_create_buffer (job->vk_allocator, job->vtx_buffer_size, REI_VK_BUFFER_TYPE_VTX_CONST, &out->buffers->vtx);
+  rei_vk_create_buffer (job->vk_allocator, job->idx_buffer_size, REI_VK_BUFFER_TYPE_IDX_CONST, &out->buffers->idx);
+}
 
-      const u32 current_index_count = gltf.accessors[current_primitive->indices_index].count;
-      const u16* index_data = (const u16*) _s_get_gltf_accessor_data (&gltf, current_primitive->indices_index);
+// Load a single rtex file, decompress it into its staging buffer and create an image for it.
+// Packed textures are taken straight from the pack's mapping. Loose ones are read asynchronously, the job runs
+// on a fiber so the worker goes on with other jobs while the file is being read.
+static void _s_load_texture (void* arg) {
+  _s_texture_job_t* job = (_s_texture_job_t*) arg;
 
-      if (current_batch.material_index == current_primitive->material_index) {
-        current_batch.idx_count += current_index_count;
-      } else {
-        out->batches->first_indices[batch_offset] = current_batch.first_index;
-	      out->batches->idx_counts[batch_offset] = current_batch.idx_count;
-	      out->batches->material_indices[batch_offset] = current_batch.material_index;
+  rei_io_read_t read = {.relative_path = job->path};
+  rei_vfs_file_t packed_file;
+  const b8 is_packed = job->vfs && !rei_vfs_open (job->vfs, job->path, &packed_file);
 
-	      ++batch_offset;
+  if (is_packed) {
+    REI_CHECK (rei_vfs_load (job->vfs, job->path, REI_FILE_HINT_SEQUENTIAL, &read.file));
+  } else {
+    rei_thread_counter_t read_counter = {0};
 
-	      current_batch.first_index = idx_offset;
-	      current_batch.idx_count = current_index_count;
-	      current_batch.material_index = current_primitive->material_index;
-      }
+    rei_io_read_files (job->io, 1, &read, &read_counter, REI_THREAD_PRIORITY_STREAMING);
+    rei_thread_pool_wait_counter (job->thread_pool, &read_counter);
 
-      for (u32 k = 0; k < current_index_count; ++k) {
-        indices[idx_offset++] = index_data[k] + vtx_start;
-      }
-    }
+    REI_CHECK (read.result);
+  }
 
-    out->batches->first_indices[batch_offset] = current_batch.first_index;
-    out->batches->idx_counts[batch_offset] = current_batch.idx_count;
-    out->batches->material_indices[batch_offset] = current_batch.material_index;
+  rei_texture_t new_texture;
+  REI_CHECK (rei_texture_load_file (&read.file, &new_texture));
+
+  // Only the smallest levels are decompressed and uploaded, rei_stream_t brings the others in once they're needed.
+  const rei_texture_header_t* header = new_texture.header;
+  const u32 dim = REI_MAX (header->width, header->height);
+
+  u32 first_mip = 0;
+  while (first_mip + 1u < header->mip_count && (dim >> first_mip) > REI_MODEL_RESIDENT_MIP_DIM) ++first_mip;
+
+  job->state->first_mip = first_mip;
+  job->state->version = 0;
+  job->state->is_packed = is_packed;
+  job->state->is_srgb_in_shader = rei_vk_is_srgb_in_shader (header);
+
+  REI_CHECK (rei_vk_create_texture (
+    job->vk_device,
+    job->vk_allocator,
+    job->thread_pool,
+    job->staging_buffer,
+    &new_texture,
+    first_mip,
+    header->mip_count - first_mip,
+    &job->upload,
+    job->out
+  ));
+
+  rei_texture_destroy (&new_texture);
+}
 
-    rei_vk_unmap_buffer (vk_allocator, &staging_buffer);
-    free (sorted_primitives);
+// Point every material descriptor to its albedo texture. Runs once all textures have been created.
+static void _s_write_descriptors (void* arg) {
+  _s_descriptor_job_t* job = (_s_descriptor_job_t*) arg;
+  const rei_gltf_t* gltf = job->gltf;
+  rei_model_t* out = job->out;
 
-    out->buffers = malloc (sizeof *out->buffers);
+  // Create descriptor pool big enough to hold all the materials of a model, twice (see rei_model_t::spare_descriptors).
+  rei_vk_create_descriptor_pool (
+    job->vk_device,
+    gltf->material_count * 2u,
+    1,
+    &(const VkDescriptorPoolSize) {
+      .descriptorCount = gltf->material_count * 2u,
+      .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+    },
+    &out->descriptor_pool
+  );
+
+  out->descriptors = malloc (sizeof *out->descriptors * gltf->material_count);
+  rei_vk_allocate_descriptors (job->vk_device, out->descriptor_pool, job->vk_descriptor_layout, gltf->material_count, out->descriptors);
 
-    rei_vk_create_buffer (vk_allocator, vtx_buffer_size, REI_VK_BUFFER_TYPE_VTX_CONST, &out->buffers->vtx);
-    rei_vk_create_buffer (vk_allocator, idx_buffer_size, REI_VK_BUFFER_TYPE_IDX_CONST, &out->buffers->idx);
+  out->spare_descriptor_count = gltf->material_count;
+  out->spare_descriptors = malloc (sizeof *out->spare_descriptors * gltf->material_count);
+  rei_vk_allocate_descriptors (job->vk_device, out->descriptor_pool, job->vk_descriptor_layout, gltf->material_count, out->spare_descriptors);
 
-    VkCommandBuffer cmd_buffer;
-    rei_vk_start_imm_cmd (vk_device, vk_imm_ctxt, &cmd_buffer);
+  out->material_count = gltf->material_count;
+  out->material_textures = malloc (sizeof *out->material_textures * gltf->material_count);
+  for (u32 i = 0; i < gltf->material_count; ++i) out->material_textures[i] = gltf->materials[i].albedo_index;
 
-    rei_vk_copy_buffer_cmd (cmd_buffer, vtx_buffer_size, 0, &staging_buffer, &out->buffers->vtx);
-    rei_vk_copy_buffer_cmd (cmd_buffer, idx_buffer_size, vtx_buffer_size, &staging_buffer, &out->buffers->idx);
+  VkImageView* texture_views = alloca (sizeof *texture_views * gltf->material_count);
+  for (u32 i = 0; i < gltf->material_count; ++i) texture_views[i] = out->textures[out->material_textures[i]].view;
 
-    rei_vk_end_imm_cmd (vk_device, vk_imm_ctxt, cmd_buffer);
-    rei_vk_destroy_buffer (vk_allocator, &staging_buffer);
+  rei_vk_write_image_descriptors (job->vk_device, job->vk_sampler, texture_views, gltf->material_count, out->descriptors);
+}
+
+void rei_model_create (
+  const char* relative_path,
+  rei_thread_pool_t* thread_pool,
+  rei_io_t* io,
+  const rei_vfs_t* vfs,
+  const rei_vk_device_t* vk_device,
+  rei_vk_allocator_t* vk_allocator,
+  const rei_vk_imm_ctxt_t* vk_imm_ctxt,
+  VkSampler vk_sampler,
+  VkDescriptorSetLayout vk_descriptor_layout,
+  rei_model_t* out) {
+
+  rei_gltf_t gltf;
+  REI_CHECK (rei_gltf_load (relative_path, vfs, &gltf));
+  REI_LOG_WARN ("%lu", gltf.meshes[0].primitive_count);
+
+  // Loading is expressed as the following job graph, only command recording is left to the calling thread:
+  //   geometry
+  //   texture 0..N -> descriptors
+  rei_vk_buffer_t geometry_staging_buffer;
+
+  _s_geometry_job_t geometry_job_data = {
+    .gltf = &gltf,
+    .thread_pool = thread_pool,
+    .vk_allocator = vk_allocator,
+    .staging_buffer = &geometry_staging_buffer,
+    .out = out
+  };
+
+  rei_thread_job_t geometry_job;
+  rei_thread_job_create (_s_build_geometry, &geometry_job_data, &geometry_job);
+  // Interleaving goes wide from inside the job, on a fiber the worker is free to load textures while it waits.
+  geometry_job.runs_on_fiber = REI_TRUE;
+
+  out->texture_count = gltf.texture_count;
+  out->textures = malloc (sizeof *out->textures * out->texture_count);
+  out->texture_states = malloc (sizeof *out->texture_states * out->texture_count);
+
+  rei_vk_buffer_t* texture_staging_buffers = malloc (sizeof *texture_staging_buffers * out->texture_count);
+  _s_texture_job_t* texture_job_data = malloc (sizeof *texture_job_data * out->texture_count);
+  rei_thread_job_t* texture_jobs = malloc (sizeof *texture_jobs * out->texture_count);
+
+  _s_descriptor_job_t descriptor_job_data = {
+    .gltf = &gltf,
+    .vk_device = vk_device,
+    .vk_sampler = vk_sampler,
+    .vk_descriptor_layout = vk_descriptor_layout,
+    .out = out
+  };
+
+  rei_thread_job_t descriptor_job;
+  rei_thread_job_create (_s_write_descriptors, &descriptor_job_data, &descriptor_job);
+
+  for (u32 i = 0; i < gltf.texture_count; ++i) {
+    const rei_gltf_image_t* current_image = &gltf.images[gltf.textures[i].image_index];
+    _s_texture_job_t* current = &texture_job_data[i];
+
+    current->io = io;
+    current->vfs = vfs;
+    current->thread_pool = thread_pool;
+    current->vk_device = vk_device;
+    current->vk_allocator = vk_allocator;
+    current->staging_buffer = &texture_staging_buffers[i];
+    current->out = &out->textures[i];
+    current->state = &out->texture_states[i];
+
+    strcpy (current->path, relative_path);
+    char* filename = strrchr (current->path, '/');
+    strcpy (filename + 1, current_image->uri);
+
+    char* ext = strrchr (current->path, '.');
+    if (ext++) strcpy (ext, "rtex");
+
+    rei_thread_job_create (_s_load_texture, current, &texture_jobs[i]);
+    texture_jobs[i].runs_on_fiber = REI_TRUE;
+    rei_thread_job_depend_on (&descriptor_job, &texture_jobs[i]);
   }
 
-  { // Create model matrix.
+  rei_thread_counter_t load_counter = {0};
+
+  rei_thread_pool_submit_job (thread_pool, &geometry_job, &load_counter, REI_THREAD_PRIORITY_STREAMING);
+  rei_thread_pool_submit_job (thread_pool, &descriptor_job, &load_counter, REI_THREAD_PRIORITY_STREAMING);
+  for (u32 i = 0; i < gltf.texture_count; ++i) rei_thread_pool_submit_job (thread_pool, &texture_jobs[i], &load_counter, REI_THREAD_PRIORITY_STREAMING);
+
+  { // Create model matrix while the pool is busy.
     const rei_gltf_node_t* default_node = &gltf.nodes[0];
 
     rei_vec3_u scale_vector = {
@@ -242,27 +503,31 @@ void rei_model_create (
     rei_mat4_scale (out->model_matrix, &scale_vector);
   }
 
-  _s_load_textures (relative_path, &gltf, vk_device, vk_allocator, vk_imm_ctxt, out);
+  // Other users of the pool may keep it busy, only wait for what this model needs.
+  rei_thread_pool_wait_counter (thread_pool, &load_counter);
 
-  // Create descriptor pool big enough to hold all the materials of a model.
-  rei_vk_create_descriptor_pool (
-    vk_device,
-    gltf.material_count,
-    1,
-    &(const VkDescriptorPoolSize) {
-      .descriptorCount = gltf.material_count,
-      .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
-    },
-    &out->descriptor_pool
-  );
+  VkCommandBuffer vk_cmd_buffer;
+  rei_vk_start_imm_cmd (vk_device, vk_imm_ctxt, &vk_cmd_buffer);
 
-  out->descriptors = malloc (sizeof *out->descriptors * gltf.material_count);
-  rei_vk_allocate_descriptors (vk_device, out->descriptor_pool, vk_descriptor_layout, gltf.material_count, out->descriptors);
+  rei_vk_copy_buffer_cmd (vk_cmd_buffer, geometry_job_data.vtx_buffer_size, 0, &geometry_staging_buffer, &out->buffers->vtx);
+  rei_vk_copy_buffer_cmd (vk_cmd_buffer, geometry_job_data.idx_buffer_size, geometry_job_data.vtx_buffer_size, &geometry_staging_buffer, &out->buffers->idx);
 
-  VkImageView* texture_views = alloca (sizeof *texture_views * gltf.material_count);
-  for (u32 i = 0; i < gltf.material_count; ++i) texture_views[i] = out->textures[gltf.materials[i].albedo_index].view;
+  for (u32 i = 0; i < out->texture_count; ++i) {
+    const _s_texture_job_t* current = &texture_job_data[i];
+    rei_vk_upload_texture_cmd (vk_cmd_buffer, current->staging_buffer, &current->upload, NULL, 0, current->out);
+  }
+
+  rei_vk_end_imm_cmd (vk_device, vk_imm_ctxt, vk_cmd_buffer);
 
-  rei_vk_write_image_descriptors (vk_device, vk_sampler, texture_views, gltf.material_count, out->descriptors);
+  rei_vk_destroy_buffer (vk_allocator, &geometry_staging_buffer);
+  for (u32 i = 0; i < out->texture_count; ++i) rei_vk_destroy_buffer (vk_allocator, &texture_staging_buffers[i]);
+
+  out->texture_paths = malloc (sizeof *out->texture_paths * out->texture_count);
+  for (u32 i = 0; i < out->texture_count; ++i) strcpy (out->texture_paths[i], texture_job_data[i].path);
+
+  free (texture_jobs);
+  free (texture_job_data);
+  free (texture_staging_buffers);
 
   rei_gltf_destroy (&gltf);
 }
@@ -281,13 +546,53 @@ void rei_model_draw_cmd (
   vkCmdPushConstants (vk_cmd_buffer, vk_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof (rei_mat4_t), &mvp);
 
   for (u32 i = 0; i < model->batch_count; ++i) {
-    REI_VK_BIND_DESCRIPTORS (vk_cmd_buffer, vk_pipeline_layout, 1, &model->descriptors[model->batches->material_indices[i]]);
+    const u32 material_index = model->batches->material_indices[i];
+    const u32 is_srgb_in_shader = model->texture_states[model->material_textures[material_index]].is_srgb_in_shader;
+
+    REI_VK_BIND_DESCRIPTORS (vk_cmd_buffer, vk_pipeline_layout, 1, &model->descriptors[material_index]);
+    vkCmdPushConstants (vk_cmd_buffer, vk_pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, sizeof (rei_mat4_t), sizeof is_srgb_in_shader, &is_srgb_in_shader);
     vkCmdDrawIndexed (vk_cmd_buffer, model->batches->idx_counts[i], 1, model->batches->first_indices[i], 0, 0);
   }
 }
 
+b8 rei_model_replace_texture (
+  const rei_vk_device_t* vk_device,
+  rei_vk_allocator_t* vk_allocator,
+  VkSampler vk_sampler,
+  const char* rtex_path,
+  rei_vk_image_t* image,
+  b32 is_srgb_in_shader,
+  rei_model_t* model) {
+
+  u32 texture_index = 0;
+  while (texture_index < model->texture_count && strcmp (model->texture_paths[texture_index], rtex_path)) ++texture_index;
+
+  if (texture_index == model->texture_count) return REI_FALSE;
+
+  rei_vk_image_t* texture = &model->textures[texture_index];
+  rei_vk_destroy_image (vk_device, vk_allocator, texture);
+  *texture = *image;
+
+  rei_model_texture_t* state = &model->texture_states[texture_index];
+  state->first_mip = 0;
+  state->is_srgb_in_shader = is_srgb_in_shader;
+  // Reloads always cook and read the loose file, packed entries don't change at runtime.
+  state->is_packed = REI_FALSE;
+  ++state->version;
+
+  for (u32 i = 0; i < model->material_count; ++i) {
+    if (model->material_textures[i] == texture_index) {
+      rei_vk_write_image_descriptors (vk_device, vk_sampler, &texture->view, 1, &model->descriptors[i]);
+    }
+  }
+
+  return REI_TRUE;
+}
+
 void rei_model_destroy (const rei_vk_device_t* vk_device, rei_vk_allocator_t* vk_allocator, rei_model_t* model) {
   free (model->model_matrix);
+  free (model->material_textures);
+  free (model->texture_paths);
 
   free (model->batches->first_indices);
   free (model->batches->idx_counts);
@@ -295,9 +600,11 @@ void rei_model_destroy (const rei_vk_device_t* vk_device, rei_vk_allocator_t* vk
   free (model->batches);
 
   vkDestroyDescriptorPool (vk_device->handle, model->descriptor_pool, NULL);
+  free (model->spare_descriptors);
   free (model->descriptors);
 
   for (u32 i = 0; i < model->texture_count; ++i) rei_vk_destroy_image (vk_device, vk_allocator, &model->textures[i]);
+  free (model->texture_states);
   free (model->textures);
 
   rei_vk_destroy_buffer (vk_allocator, &model->buffers->idx);
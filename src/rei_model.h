@@ -2,6 +2,30 @@
 #define REI_MODEL_H
 
 #include "rei_vk.h"
+#include "rei_io.h"
+#include "rei_vfs.h"
+#include "rei_thread.h"
+
+// Textures are created with their levels no bigger than this only, the rest is left to rei_stream_t.
+#define REI_MODEL_RESIDENT_MIP_DIM 128u
+
+// What streaming needs to know about a texture.
+typedef struct rei_model_texture_t {
+  // Bounding sphere of the geometry sampling the texture in model space, radius in w (zero if nothing samples it).
+  rei_vec4_u bounds;
+  // How many times the texture repeats across that geometry along its longer axis, at most.
+  f32 uv_extent;
+  // First level of the rtex the image holds, the ones before it aren't resident.
+  u32 first_mip;
+  // Bumped whenever the image is replaced as a whole, e.g. by rei_model_replace_texture.
+  u32 version;
+  // See rei_vk_is_srgb_in_shader, pushed to the fragment shader with every batch sampling the texture.
+  b32 is_srgb_in_shader;
+  // Set if the image was made from the rtex in the model's vfs, from the loose file otherwise. Levels streamed in
+  // later have to come from the same file, the other one may have been cooked differently.
+  b32 is_packed;
+  u32 __padding[3];
+} rei_model_texture_t;
 
 typedef struct rei_model_t {
   struct {rei_vk_buffer_t vtx, idx;}* buffers;
@@ -16,14 +40,30 @@ typedef struct rei_model_t {
   }* batches;
 
   rei_vk_image_t* textures;
+  rei_model_texture_t* texture_states;
   VkDescriptorPool descriptor_pool;
   VkDescriptorSet* descriptors;
+  // One more set per material, taken by rei_stream_t to swap textures without waiting for frames in flight.
+  VkDescriptorSet* spare_descriptors;
+  u32 spare_descriptor_count;
+
+  // Kept around for hot reloading and streaming: rtex path of every texture and the texture every material samples.
+  u32 material_count;
+  char (* texture_paths)[128];
+  u32* material_textures;
+
   // TODO Create a global array of matrices which will be processed before rei_model_draw_cmd.
   rei_mat4_t* model_matrix;
 } rei_model_t;
 
+// Load a GLTF model, spreading decompression and staging of its data across thread_pool. Textures only get their
+// levels up to REI_MODEL_RESIDENT_MIP_DIM. Files are taken from vfs if it's not NULL and has them, loose textures are
+// read through io.
 void rei_model_create (
   const char* relative_path,
+  rei_thread_pool_t* thread_pool,
+  rei_io_t* io,
+  const rei_vfs_t* vfs,
   const rei_vk_device_t* vk_device,
   rei_vk_allocator_t* vk_allocator,
   const rei_vk_imm_ctxt_t* vk_imm_ctxt,
@@ -39,6 +79,19 @@ void rei_model_draw_cmd (
   const rei_mat4_t* view_projection
 );
 
+// Replace the texture loaded from rtex_path with image (already uploaded, with all of its levels) and point the
+// materials using it there. is_srgb_in_shader is that of the rtex the image was created from. The GPU must not use the model meanwhile. Returns false, leaving image alone, if the model
+// doesn't use that texture.
+b8 rei_model_replace_texture (
+  const rei_vk_device_t* vk_device,
+  rei_vk_allocator_t* vk_allocator,
+  VkSampler vk_sampler,
+  const char* rtex_path,
+  rei_vk_image_t* image,
+  b32 is_srgb_in_shader,
+  rei_model_t* model
+);
+
 void rei_model_destroy (const rei_vk_device_t* vk_device, rei_vk_allocator_t* vk_allocator, rei_model_t* model);
 
 #endif /* REI_MODEL_H */
@@ -0,0 +1,74 @@
+#include "rei_pixel.h"
+#include "rei_debug.h"
+
+void rei_pixel_expand_rgb (const u8* restrict src, u64 pixel_count, u8* restrict dst) {
+  u64 i = 0;
+
+#ifdef __SSSE3__
+  // 16 pixels at a time: three loads realigned into four registers of four pixels each, spread out by a shuffle.
+  const __m128i spread = _mm_setr_epi8 (0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32 ((s32) 0xff000000u);
+
+  for (; i + 16u <= pixel_count; i += 16u) {
+    const __m128i a = _mm_loadu_si128 ((const __m128i*) (src + i * 3u));
+    const __m128i b = _mm_loadu_si128 ((const __m128i*) (src + i * 3u + 16u));
+    const __m128i c = _mm_loadu_si128 ((const __m128i*) (src + i * 3u + 32u));
+
+    __m128i* out = (__m128i*) (dst + i * 4u);
+    _mm_storeu_si128 (out + 0, _mm_or_si128 (_mm_shuffle_epi8 (a, spread), alpha));
+    _mm_storeu_si128 (out + 1, _mm_or_si128 (_mm_shuffle_epi8 (_mm_alignr_epi8 (b, a, 12), spread), alpha));
+    _mm_storeu_si128 (out + 2, _mm_or_si128 (_mm_shuffle_epi8 (_mm_alignr_epi8 (c, b, 8), spread), alpha));
+    _mm_storeu_si128 (out + 3, _mm_or_si128 (_mm_shuffle_epi8 (_mm_srli_si128 (c, 4), spread), alpha));
+  }
+#endif
+
+  for (; i < pixel_count; ++i) {
+    dst[i * 4u + 0u] = src[i * 3u + 0u];
+    dst[i * 4u + 1u] = src[i * 3u + 1u];
+    dst[i * 4u + 2u] = src[i * 3u + 2u];
+    dst[i * 4u + 3u] = 255;
+  }
+}
+
+void rei_pixel_pack (const u8* restrict src, u64 pixel_count, const u8* channels, u32 channel_count, u8* restrict dst) {
+  REI_ASSERT (channel_count == 1u || channel_count == 2u || channel_count == 4u);
+
+  u64 i = 0;
+
+#ifdef __SSSE3__
+  // The picked channels of four pixels end up at the bottom of a register, 16 pixels fill one to four of them.
+  s8 picks[16];
+  for (u32 j = 0; j < 16u; ++j) {
+    const u32 pixel = j / channel_count;
+    picks[j] = pixel < 4u ? (s8) (pixel * 4u + channels[j % channel_count]) : -1;
+  }
+
+  const __m128i pick = _mm_loadu_si128 ((const __m128i*) picks);
+
+  for (; i + 16u <= pixel_count; i += 16u) {
+    const __m128i* in = (const __m128i*) (src + i * 4u);
+    __m128i* out = (__m128i*) (dst + i * channel_count);
+
+    const __m128i a = _mm_shuffle_epi8 (_mm_loadu_si128 (in + 0), pick);
+    const __m128i b = _mm_shuffle_epi8 (_mm_loadu_si128 (in + 1), pick);
+    const __m128i c = _mm_shuffle_epi8 (_mm_loadu_si128 (in + 2), pick);
+    const __m128i d = _mm_shuffle_epi8 (_mm_loadu_si128 (in + 3), pick);
+
+    if (channel_count == 1u) {
+      _mm_storeu_si128 (out, _mm_unpacklo_epi64 (_mm_unpacklo_epi32 (a, b), _mm_unpacklo_epi32 (c, d)));
+    } else if (channel_count == 2u) {
+      _mm_storeu_si128 (out + 0, _mm_unpacklo_epi64 (a, b));
+      _mm_storeu_si128 (out + 1, _mm_unpacklo_epi64 (c, d));
+    } else {
+      _mm_storeu_si128 (out + 0, a);
+      _mm_storeu_si128 (out + 1, b);
+      _mm_storeu_si128 (out + 2, c);
+      _mm_storeu_si128 (out + 3, d);
+    }
+  }
+#endif
+
+  for (; i < pixel_count; ++i) {
+    for (u32 j = 0; j < channel_count; ++j) dst[i * channel_count + j] = src[i * 4u + channels[j]];
+  }
+}
@@ -0,0 +1,16 @@
+#ifndef REI_PIXEL_H
+#define REI_PIXEL_H
+
+#include "rei_types.h"
+
+// Conversions between layouts of 8-bit pixels, vectorized with SSSE3 when available. They're bound by memory
+// bandwidth, src and dst must not overlap.
+
+// RGB to opaque RGBA.
+void rei_pixel_expand_rgb (const u8* restrict src, u64 pixel_count, u8* restrict dst);
+
+// RGBA to channel_count (1, 2 or 4) channels per pixel, channel i of dst taken from channel channels[i] of src. Covers
+// single channel extraction, packing two channels together and swizzling.
+void rei_pixel_pack (const u8* restrict src, u64 pixel_count, const u8* channels, u32 channel_count, u8* restrict dst);
+
+#endif /* REI_PIXEL_H */
@@ -0,0 +1,315 @@
+// Thread naming and d_type are GNU extensions.
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <poll.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <memory.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "rei_asset.h"
+#include "rei_debug.h"
+#include "rei_reload.h"
+
+#define _S_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+static u64 _s_get_time_ns (void) {
+  struct timespec time;
+  clock_gettime (CLOCK_MONOTONIC, &time);
+
+  return (u64) time.tv_sec * 1000000000ull + (u64) time.tv_nsec;
+}
+
+// Watch a directory and everything below it, relative_path is assumed to have a trailing slash.
+static void _s_add_watch (rei_reload_t* reload, const char* const relative_path) {
+  if (reload->watch_count == REI_RELOAD_MAX_WATCHES) {
+    REI_LOG_WARN ("Too many directories to watch, skipping " REI_ANSI_YELLOW "\"%s\"", relative_path);
+    return;
+  }
+
+  const s32 watch_descriptor = inotify_add_watch (reload->inotify_fd, relative_path, _S_WATCH_MASK);
+  if (watch_descriptor == -1) return;
+
+  reload->watch_descriptors[reload->watch_count] = watch_descriptor;
+  strcpy (reload->watch_paths[reload->watch_count++], relative_path);
+
+  DIR* dir = opendir (relative_path);
+  if (!dir) return;
+
+  struct dirent* current;
+  while ((current = readdir (dir))) {
+    if (current->d_type != DT_DIR || current->d_name[0] == '.') continue;
+
+    char sub_path[REI_FILE_MAX_PATH];
+    if (snprintf (sub_path, sizeof sub_path, "%s%s/", relative_path, current->d_name) < (s32) sizeof sub_path) {
+      _s_add_watch (reload, sub_path);
+    }
+  }
+
+  closedir (dir);
+}
+
+// Has to be called with reload->lock held.
+static void _s_remove_request (rei_reload_t* reload, rei_reload_request_t* request) {
+  rei_reload_request_t** link = &reload->requests;
+  while (*link != request) link = &(*link)->next;
+
+  *link = request->next;
+}
+
+static void _s_queue_recook (rei_reload_t* reload, const char* const source_path);
+
+static void _s_recook_texture (void* arg) {
+  rei_reload_request_t* request = (rei_reload_request_t*) arg;
+  rei_reload_t* reload = request->reload;
+
+  pthread_mutex_lock (reload->lock);
+  request->has_started = REI_TRUE;
+  pthread_mutex_unlock (reload->lock);
+
+  rei_texture_t texture;
+  rei_result_e result = rei_texture_compress (reload->thread_pool, request->source_path, NULL);
+  if (!result) result = rei_texture_load (request->rtex_path, &texture);
+
+  if (!result) {
+    // Everything but the upload itself happens here, off the thread that submits to the GPU.
+    result = rei_vk_create_texture (
+      reload->vk_device,
+      reload->vk_allocator,
+      reload->thread_pool,
+      &request->staging_buffer,
+      &texture,
+      0,
+      texture.header->mip_count,
+      &request->upload,
+      &request->image
+    );
+
+    request->is_srgb_in_shader = rei_vk_is_srgb_in_shader (texture.header);
+    rei_texture_destroy (&texture);
+  }
+
+  if (result) {
+    REI_LOG_WARN ("Failed to re-cook " REI_ANSI_YELLOW "\"%s\"" REI_ANSI_RED " (%s)", request->source_path, rei_show_result (result));
+  }
+
+  // The request may be swapped in and freed as soon as the lock is released.
+  char source_path[REI_FILE_MAX_PATH];
+  strcpy (source_path, request->source_path);
+
+  pthread_mutex_lock (reload->lock);
+  const b32 is_dirty = request->is_dirty;
+
+  if (result) {
+    _s_remove_request (reload, request);
+  } else {
+    request->is_ready = REI_TRUE;
+  }
+
+  pthread_mutex_unlock (reload->lock);
+
+  if (result) free (request);
+  if (is_dirty) _s_queue_recook (reload, source_path);
+}
+
+static void _s_queue_recook (rei_reload_t* reload, const char* const source_path) {
+  pthread_mutex_lock (reload->lock);
+
+  // Editors tend to write a file several times in a row, one re-cook that hasn't started yet covers them all.
+  // One that's running is re-queued once done instead, two of them would write the same rtex at once.
+  for (rei_reload_request_t* current = reload->requests; current; current = current->next) {
+    if (current->is_ready || strcmp (current->source_path, source_path)) continue;
+
+    if (current->has_started) current->is_dirty = REI_TRUE;
+
+    pthread_mutex_unlock (reload->lock);
+    return;
+  }
+
+  rei_reload_request_t* request = malloc (sizeof *request);
+  memset (request, 0, sizeof *request);
+
+  strcpy (request->source_path, source_path);
+  strcpy (request->rtex_path, source_path);
+  strcpy (strrchr (request->rtex_path, '.') + 1, "rtex");
+
+  request->reload = reload;
+  request->start_ns = _s_get_time_ns ();
+  request->next = reload->requests;
+  reload->requests = request;
+
+  pthread_mutex_unlock (reload->lock);
+
+  rei_thread_pool_add_task (reload->thread_pool, _s_recook_texture, request, &reload->counter, REI_THREAD_PRIORITY_STREAMING);
+}
+
+static void _s_handle_event (rei_reload_t* reload, const struct inotify_event* event) {
+  if (!event->len) return;
+
+  u32 watch_index = 0;
+  while (watch_index < reload->watch_count && reload->watch_descriptors[watch_index] != event->wd) ++watch_index;
+  if (watch_index == reload->watch_count) return;
+
+  char path[REI_FILE_MAX_PATH];
+  if (snprintf (path, sizeof path, "%s%s", reload->watch_paths[watch_index], event->name) >= (s32) sizeof path) return;
+
+  if (event->mask & IN_ISDIR) {
+    if (event->mask & IN_CREATE) {
+      strcat (path, "/");
+      _s_add_watch (reload, path);
+    }
+
+    return;
+  }
+
+  // New files show up as IN_CREATE first, they're only worth looking at once written.
+  if (event->mask & IN_CREATE) return;
+
+  const char* ext = strrchr (event->name, '.');
+  if (!ext++) return;
+
+  if (!strcmp (ext, "png") || !strcmp (ext, "jpg") || !strcmp (ext, "jpeg")) {
+    _s_queue_recook (reload, path);
+  } else if (!strcmp (ext, "gltf") || !strcmp (ext, "bin")) {
+    __atomic_store_n (&reload->has_geometry_changed, REI_TRUE, __ATOMIC_RELEASE);
+  }
+}
+
+static void* _s_watch_routine (void* arg) {
+  rei_reload_t* reload = (rei_reload_t*) arg;
+
+  // Events are variable sized, the buffer has to be aligned for the fixed part of them.
+  u8 events[4096] REI_ALIGN_AS (__alignof__ (struct inotify_event));
+
+  struct pollfd fds[2] = {
+    {.fd = reload->inotify_fd, .events = POLLIN},
+    {.fd = reload->quit_fd, .events = POLLIN}
+  };
+
+  for (;;) {
+    if (poll (fds, REI_ARRAY_SIZE (fds), -1) < 0) continue;
+    if (fds[1].revents) break;
+
+    const s64 size = read (reload->inotify_fd, events, sizeof events);
+    if (size <= 0) continue;
+
+    for (const u8* current = events; current < events + size;) {
+      const struct inotify_event* event = (const struct inotify_event*) current;
+      current += sizeof *event + event->len;
+
+      _s_handle_event (reload, event);
+    }
+  }
+
+  return NULL;
+}
+
+void rei_reload_create (const rei_reload_ci_t* create_info, rei_reload_t* out) {
+  memset (out, 0, sizeof *out);
+
+  out->thread_pool = create_info->thread_pool;
+  out->vk_device = create_info->vk_device;
+  out->vk_allocator = create_info->vk_allocator;
+
+  out->lock = malloc (sizeof *out->lock);
+  pthread_mutex_init (out->lock, NULL);
+
+  out->watch_paths = malloc (sizeof *out->watch_paths * REI_RELOAD_MAX_WATCHES);
+  out->inotify_fd = inotify_init1 (IN_CLOEXEC);
+  out->quit_fd = eventfd (0, EFD_CLOEXEC);
+  REI_ASSERT (out->inotify_fd != -1 && out->quit_fd != -1);
+
+  _s_add_watch (out, create_info->root_path);
+
+  pthread_create (&out->watcher, NULL, _s_watch_routine, out);
+  pthread_setname_np (out->watcher, "rei-reload");
+}
+
+void rei_reload_destroy (rei_reload_t* reload) {
+  const u64 quit = 1;
+  write (reload->quit_fd, &quit, sizeof quit);
+  pthread_join (reload->watcher, NULL);
+
+  // Nothing can queue new re-cooks anymore, let the ones running finish.
+  rei_thread_pool_wait_counter (reload->thread_pool, &reload->counter);
+
+  while (reload->requests) {
+    rei_reload_request_t* request = reload->requests;
+    reload->requests = request->next;
+
+    rei_vk_destroy_buffer (reload->vk_allocator, &request->staging_buffer);
+    rei_vk_destroy_image (reload->vk_device, reload->vk_allocator, &request->image);
+    free (request);
+  }
+
+  close (reload->quit_fd);
+  close (reload->inotify_fd);
+
+  free (reload->watch_paths);
+  pthread_mutex_destroy (reload->lock);
+  free (reload->lock);
+}
+
+b8 rei_reload_apply (
+  rei_reload_t* reload,
+  const rei_vk_imm_ctxt_t* vk_imm_ctxt,
+  VkSampler vk_sampler,
+  rei_model_t* model) {
+
+  rei_reload_request_t* ready = NULL;
+
+  pthread_mutex_lock (reload->lock);
+
+  for (rei_reload_request_t** link = &reload->requests; *link;) {
+    rei_reload_request_t* current = *link;
+
+    if (current->is_ready) {
+      *link = current->next;
+      current->next = ready;
+      ready = current;
+    } else {
+      link = &current->next;
+    }
+  }
+
+  pthread_mutex_unlock (reload->lock);
+
+  const b8 has_geometry_changed = (b8) __atomic_exchange_n (&reload->has_geometry_changed, REI_FALSE, __ATOMIC_ACQ_REL);
+  if (!ready && !has_geometry_changed) return REI_FALSE;
+
+  // Frames in flight may still sample the textures about to be replaced.
+  vkDeviceWaitIdle (reload->vk_device->handle);
+
+  if (ready) {
+    VkCommandBuffer vk_cmd_buffer;
+    rei_vk_start_imm_cmd (reload->vk_device, vk_imm_ctxt, &vk_cmd_buffer);
+
+    for (rei_reload_request_t* current = ready; current; current = current->next) {
+      rei_vk_upload_texture_cmd (vk_cmd_buffer, &current->staging_buffer, &current->upload, NULL, 0, &current->image);
+    }
+
+    rei_vk_end_imm_cmd (reload->vk_device, vk_imm_ctxt, vk_cmd_buffer);
+  }
+
+  while (ready) {
+    rei_reload_request_t* current = ready;
+    ready = current->next;
+
+    rei_vk_destroy_buffer (reload->vk_allocator, &current->staging_buffer);
+
+    if (rei_model_replace_texture (reload->vk_device, reload->vk_allocator, vk_sampler, current->rtex_path, &current->image, current->is_srgb_in_shader, model)) {
+      const f64 turnaround_ms = (f64) (_s_get_time_ns () - current->start_ns) / 1000000.0;
+      REI_LOG_INFO ("Reloaded " REI_ANSI_YELLOW "\"%s\"" REI_ANSI_RESET " in %.2f ms", current->rtex_path, turnaround_ms);
+    } else {
+      rei_vk_destroy_image (reload->vk_device, reload->vk_allocator, &current->image);
+    }
+
+    free (current);
+  }
+
+  return has_geometry_changed;
+}
@@ -0,0 +1,75 @@
+#ifndef REI_RELOAD_H
+#define REI_RELOAD_H
+
+#include "rei_file.h"
+#include "rei_model.h"
+
+// Maximum number of directories watched below rei_reload_ci_t::root_path (itself included).
+#define REI_RELOAD_MAX_WATCHES 64u
+
+typedef struct rei_reload_ci_t {
+  // Directory watched for changed sources along with its subdirectories, assumed to have a trailing slash.
+  const char* root_path;
+  rei_thread_pool_t* thread_pool;
+  const rei_vk_device_t* vk_device;
+  rei_vk_allocator_t* vk_allocator;
+} rei_reload_ci_t;
+
+// Texture re-cooked from a changed source, waiting to be swapped in.
+typedef struct rei_reload_request_t {
+  char source_path[REI_FILE_MAX_PATH];
+  char rtex_path[REI_FILE_MAX_PATH];
+  struct rei_reload_t* reload;
+  rei_vk_buffer_t staging_buffer;
+  rei_vk_image_t image;
+  rei_vk_texture_upload_t upload;
+  // Set once a worker picked the request up, later changes to the same source mark it dirty.
+  b32 has_started;
+  b32 is_ready;
+  // See rei_vk_is_srgb_in_shader, taken from the re-cooked rtex.
+  b32 is_srgb_in_shader;
+  // Set if the source changed again while being re-cooked, it's queued once more when done (the rtex only has
+  // one writer at a time).
+  b32 is_dirty;
+  // When the change was noticed, for reporting turnaround times.
+  u64 start_ns;
+  struct rei_reload_request_t* next;
+} rei_reload_request_t;
+
+typedef struct rei_reload_t {
+  rei_thread_pool_t* thread_pool;
+  const rei_vk_device_t* vk_device;
+  rei_vk_allocator_t* vk_allocator;
+
+  s32 inotify_fd;
+  // Written to by rei_reload_destroy to wake the watcher up.
+  s32 quit_fd;
+  u32 watch_count;
+  // Set when a glTF or its buffers changed, the model has to be recreated as a whole.
+  b32 has_geometry_changed;
+  s32 watch_descriptors[REI_RELOAD_MAX_WATCHES];
+  char (* watch_paths)[REI_FILE_MAX_PATH];
+
+  // Guards requests, which holds both in flight and ready ones.
+  pthread_mutex_t* lock;
+  rei_reload_request_t* requests;
+  // Tracks re-cooks running on the pool.
+  rei_thread_counter_t counter;
+
+  pthread_t watcher;
+} rei_reload_t;
+
+void rei_reload_create (const rei_reload_ci_t* create_info, rei_reload_t* out);
+void rei_reload_destroy (rei_reload_t* reload);
+
+// Swap textures re-cooked since the last call into model. Has to be called between frames, from the thread
+// submitting to the GPU. Waits for the device to go idle, but only if there's anything to swap.
+// Returns true if the model's glTF or buffers changed, in which case it has to be recreated by the caller.
+b8 rei_reload_apply (
+  rei_reload_t* reload,
+  const rei_vk_imm_ctxt_t* vk_imm_ctxt,
+  VkSampler vk_sampler,
+  rei_model_t* model
+);
+
+#endif /* REI_RELOAD_H */
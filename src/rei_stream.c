@@ -0,0 +1,513 @@
+#include <math.h>
+#include <memory.h>
+#include <string.h>
+
+#include "rei_debug.h"
+#include "rei_stream.h"
+#include "rei_defines.h"
+#include "rei_math.inl"
+
+static u64 _s_get_resident_size (const rei_stream_texture_t* texture, u32 first_mip) {
+  u64 size = 0;
+  for (u32 i = first_mip; i < texture->mip_count; ++i) size += texture->mip_sizes[i];
+
+  return size;
+}
+
+// Read the rtex file the current image of a texture was made from, a packed one is never used in place of a reloaded one.
+static rei_result_e _s_load_texture_file (const rei_stream_t* stream, u32 texture_index, b32 is_packed, rei_file_t* out) {
+  return rei_vfs_load (is_packed ? stream->vfs : NULL, stream->model->texture_paths[texture_index], REI_FILE_HINT_NONE, out);
+}
+
+// Read what streaming needs from the rtex header of a texture, again whenever the texture gets re-cooked.
+static rei_result_e _s_read_texture_info (rei_stream_t* stream, u32 texture_index) {
+  rei_stream_texture_t* texture = &stream->textures[texture_index];
+  const rei_model_texture_t* state = &stream->model->texture_states[texture_index];
+  texture->version = state->version;
+
+  rei_file_t file;
+  rei_texture_t rtex;
+
+  rei_result_e result = _s_load_texture_file (stream, texture_index, state->is_packed, &file);
+  if (!result) result = rei_texture_load_file (&file, &rtex);
+  if (result) return result;
+
+  const rei_texture_header_t* header = rtex.header;
+  texture->mip_count = header->mip_count;
+  texture->format = header->format;
+  texture->dim = REI_MAX (header->width, header->height);
+  for (u32 i = 0; i < header->mip_count; ++i) texture->mip_sizes[i] = header->mips[i].size;
+
+  // The levels rei_model_create starts out with.
+  texture->tail_first_mip = 0;
+  while (texture->tail_first_mip + 1u < texture->mip_count && (texture->dim >> texture->tail_first_mip) > REI_MODEL_RESIDENT_MIP_DIM) {
+    ++texture->tail_first_mip;
+  }
+
+  rei_texture_destroy (&rtex);
+  return REI_RESULT_SUCCESS;
+}
+
+static u32 _s_count_materials (const rei_model_t* model, u32 texture_index) {
+  u32 count = 0;
+  for (u32 i = 0; i < model->material_count; ++i) count += model->material_textures[i] == texture_index;
+
+  return count;
+}
+
+static void _s_stream_texture (void* arg) {
+  rei_stream_request_t* request = (rei_stream_request_t*) arg;
+  rei_stream_t* stream = request->stream;
+  const rei_stream_texture_t* info = &stream->textures[request->texture_index];
+
+  rei_file_t file;
+  rei_texture_t texture;
+
+  rei_result_e result = _s_load_texture_file (stream, request->texture_index, request->is_packed, &file);
+  if (!result) result = rei_texture_load_file (&file, &texture);
+
+  if (!result) {
+    // The rtex may have been re-cooked into something else since the request was made, its levels won't fit then.
+    // Images of different formats can't be copied between either.
+    b8 is_same = texture.header->format == info->format && texture.header->mip_count == info->mip_count;
+    for (u32 i = 0; is_same && i < info->mip_count; ++i) is_same = texture.header->mips[i].size == info->mip_sizes[i];
+
+    if (is_same) {
+      // Levels both images hold are copied on the GPU, only the new first level (if any) is read and decompressed.
+      const u32 staged_mip_count = request->first_mip < request->previous_first_mip ? request->previous_first_mip - request->first_mip : 0;
+
+      result = rei_vk_create_texture (
+        stream->vk_device,
+        stream->vk_allocator,
+        stream->thread_pool,
+        &request->staging_buffer,
+        &texture,
+        request->first_mip,
+        staged_mip_count,
+        &request->upload,
+        &request->image
+      );
+    } else {
+      result = REI_RESULT_UNSUPPORTED_FILE_TYPE;
+    }
+
+    rei_texture_destroy (&texture);
+  }
+
+  pthread_mutex_lock (stream->lock);
+  request->has_failed = result != REI_RESULT_SUCCESS;
+  request->is_ready = REI_TRUE;
+  pthread_mutex_unlock (stream->lock);
+}
+
+static void _s_queue_request (rei_stream_t* stream, u32 texture_index, u32 first_mip) {
+  const rei_model_texture_t* state = &stream->model->texture_states[texture_index];
+
+  rei_stream_request_t* request = malloc (sizeof *request);
+  memset (request, 0, sizeof *request);
+
+  request->stream = stream;
+  request->texture_index = texture_index;
+  request->first_mip = first_mip;
+  request->previous_first_mip = state->first_mip;
+  request->version = state->version;
+  request->is_packed = state->is_packed;
+
+  stream->textures[texture_index].is_busy = REI_TRUE;
+
+  pthread_mutex_lock (stream->lock);
+  request->next = stream->requests;
+  stream->requests = request;
+  pthread_mutex_unlock (stream->lock);
+
+  rei_thread_pool_add_task (stream->thread_pool, _s_stream_texture, request, &stream->counter, REI_THREAD_PRIORITY_STREAMING);
+}
+
+static void _s_destroy_request (rei_stream_t* stream, rei_stream_request_t* request) {
+  if (!request->has_failed) {
+    if (request->upload.staged_mip_count) rei_vk_destroy_buffer (stream->vk_allocator, &request->staging_buffer);
+    rei_vk_destroy_image (stream->vk_device, stream->vk_allocator, &request->image);
+  }
+
+  free (request);
+}
+
+// Point the materials sampling a texture to its new image through spare descriptor sets. The sets they used until now
+// are retired along with the image they point to, frames in flight may still use both.
+static void _s_swap_texture (rei_stream_t* stream, VkSampler vk_sampler, rei_stream_request_t* request) {
+  rei_model_t* model = stream->model;
+  const u32 texture_index = request->texture_index;
+
+  const rei_vk_image_t previous = model->textures[texture_index];
+  model->textures[texture_index] = request->image;
+  model->texture_states[texture_index].first_mip = request->first_mip;
+  request->image = previous;
+
+  request->retired_descriptors = malloc (sizeof *request->retired_descriptors * REI_MAX (request->retired_descriptor_count, 1u));
+
+  u32 retired_count = 0;
+  for (u32 i = 0; i < model->material_count; ++i) {
+    if (model->material_textures[i] != texture_index) continue;
+
+    VkDescriptorSet* descriptor = &model->descriptors[i];
+    request->retired_descriptors[retired_count++] = *descriptor;
+
+    *descriptor = model->spare_descriptors[--model->spare_descriptor_count];
+    rei_vk_write_image_descriptors (stream->vk_device, vk_sampler, &model->textures[texture_index].view, 1, descriptor);
+  }
+
+  request->retire_frame = stream->frame_index;
+  request->next = stream->retired;
+  stream->retired = request;
+}
+
+static void _s_release_retired (rei_stream_t* stream, b8 has_to_release_all) {
+  rei_model_t* model = stream->model;
+
+  for (rei_stream_request_t** link = &stream->retired; *link;) {
+    rei_stream_request_t* current = *link;
+
+    // Every frame recorded before the swap is done once REI_VK_FRAME_COUNT more have begun.
+    if (!has_to_release_all && stream->frame_index - current->retire_frame <= REI_VK_FRAME_COUNT) {
+      link = &current->next;
+      continue;
+    }
+
+    *link = current->next;
+
+    rei_vk_destroy_image (stream->vk_device, stream->vk_allocator, &current->image);
+
+    memcpy (
+      model->spare_descriptors + model->spare_descriptor_count,
+      current->retired_descriptors,
+      sizeof *current->retired_descriptors * current->retired_descriptor_count
+    );
+
+    model->spare_descriptor_count += current->retired_descriptor_count;
+
+    free (current->retired_descriptors);
+    free (current);
+  }
+}
+
+// Swap in every texture streamed since the last update, as far as there are spare descriptor sets for them.
+static void _s_apply_requests (rei_stream_t* stream, const rei_vk_imm_ctxt_t* vk_imm_ctxt, VkSampler vk_sampler) {
+  rei_model_t* model = stream->model;
+
+  rei_stream_request_t* ready = NULL;
+  rei_stream_request_t* dropped = NULL;
+  u32 spare_descriptor_count = model->spare_descriptor_count;
+
+  pthread_mutex_lock (stream->lock);
+
+  for (rei_stream_request_t** link = &stream->requests; *link;) {
+    rei_stream_request_t* current = *link;
+
+    if (!current->is_ready) {
+      link = &current->next;
+      continue;
+    }
+
+    // Hot reloading may have replaced the texture meanwhile (see rei_model_replace_texture).
+    const rei_model_texture_t* state = &model->texture_states[current->texture_index];
+    const b8 is_stale = state->version != current->version || state->first_mip != current->previous_first_mip;
+
+    if (current->has_failed || is_stale) {
+      *link = current->next;
+      current->next = dropped;
+      dropped = current;
+      continue;
+    }
+
+    // Every material has a spare set, but retired ones only come back a few frames after the swap.
+    current->retired_descriptor_count = _s_count_materials (model, current->texture_index);
+
+    if (current->retired_descriptor_count > spare_descriptor_count) {
+      link = &current->next;
+      continue;
+    }
+
+    spare_descriptor_count -= current->retired_descriptor_count;
+
+    *link = current->next;
+    current->next = ready;
+    ready = current;
+  }
+
+  pthread_mutex_unlock (stream->lock);
+
+  while (dropped) {
+    rei_stream_request_t* current = dropped;
+    dropped = current->next;
+
+    rei_stream_texture_t* texture = &stream->textures[current->texture_index];
+    texture->is_busy = REI_FALSE;
+
+    if (current->has_failed) {
+      texture->has_failed = REI_TRUE;
+      REI_LOG_WARN ("Failed to stream " REI_ANSI_YELLOW "\"%s\"", model->texture_paths[current->texture_index]);
+    }
+
+    _s_destroy_request (stream, current);
+  }
+
+  if (!ready) return;
+
+  VkCommandBuffer vk_cmd_buffer;
+  rei_vk_start_imm_cmd (stream->vk_device, vk_imm_ctxt, &vk_cmd_buffer);
+
+  for (rei_stream_request_t* current = ready; current; current = current->next) {
+    const u32 previous_mip_count = stream->textures[current->texture_index].mip_count - current->previous_first_mip;
+
+    rei_vk_upload_texture_cmd (
+      vk_cmd_buffer,
+      &current->staging_buffer,
+      &current->upload,
+      &model->textures[current->texture_index],
+      previous_mip_count,
+      &current->image
+    );
+  }
+
+  rei_vk_end_imm_cmd (stream->vk_device, vk_imm_ctxt, vk_cmd_buffer);
+
+  while (ready) {
+    rei_stream_request_t* current = ready;
+    ready = current->next;
+
+    if (current->upload.staged_mip_count) rei_vk_destroy_buffer (stream->vk_allocator, &current->staging_buffer);
+
+    stream->textures[current->texture_index].is_busy = REI_FALSE;
+    _s_swap_texture (stream, vk_sampler, current);
+  }
+}
+
+// Work out the first level every texture needs from how many pixels its geometry covers: the one whose texels come
+// closest to a pixel each, taking the texture to repeat uv_extent times across the geometry. Textures of geometry
+// outside the view only need the levels that are never evicted.
+static void _s_update_wanted_mips (rei_stream_t* stream, const rei_mat4_t* view_projection, f32 viewport_height) {
+  const rei_model_t* model = stream->model;
+
+  rei_mat4_t mvp;
+  rei_mat4_mul (view_projection, model->model_matrix, &mvp);
+
+  // Rows of the matrix as applied to column vectors, rei_mat4_t holds its columns.
+  f32 rows[4][4];
+  for (u32 i = 0; i < 4; ++i) {
+    for (u32 j = 0; j < 4; ++j) rows[i][j] = ((const f32*) &mvp.rows[j])[i];
+  }
+
+  // Side planes of the view in model space (Gribb & Hartmann), normalized so that they give distances.
+  f32 planes[4][4];
+  for (u32 j = 0; j < 4; ++j) {
+    planes[0][j] = rows[3][j] + rows[0][j];
+    planes[1][j] = rows[3][j] - rows[0][j];
+    planes[2][j] = rows[3][j] + rows[1][j];
+    planes[3][j] = rows[3][j] - rows[1][j];
+  }
+
+  for (u32 i = 0; i < 4; ++i) {
+    const f32 length = sqrtf (planes[i][0] * planes[i][0] + planes[i][1] * planes[i][1] + planes[i][2] * planes[i][2]);
+    for (u32 j = 0; j < 4; ++j) planes[i][j] /= length;
+  }
+
+  // Scale of the model matrix and focal length of the projection along with it.
+  const f32 scale = sqrtf (rows[3][0] * rows[3][0] + rows[3][1] * rows[3][1] + rows[3][2] * rows[3][2]);
+  const f32 focal_length = sqrtf (rows[1][0] * rows[1][0] + rows[1][1] * rows[1][1] + rows[1][2] * rows[1][2]);
+
+  for (u32 i = 0; i < model->texture_count; ++i) {
+    rei_stream_texture_t* texture = &stream->textures[i];
+    const rei_model_texture_t* state = &model->texture_states[i];
+    const rei_vec4_u* bounds = &state->bounds;
+
+    texture->wanted_first_mip = texture->tail_first_mip;
+    texture->screen_size = 0.f;
+
+    if (bounds->w <= 0.f || state->uv_extent <= 0.f) continue;
+
+    b8 is_visible = REI_TRUE;
+    for (u32 j = 0; j < 4 && is_visible; ++j) {
+      const f32* plane = planes[j];
+      is_visible = plane[0] * bounds->x + plane[1] * bounds->y + plane[2] * bounds->z + plane[3] >= -bounds->w;
+    }
+
+    if (!is_visible) continue;
+
+    const f32 depth = rows[3][0] * bounds->x + rows[3][1] * bounds->y + rows[3][2] * bounds->z + rows[3][3];
+
+    // The camera is within the bounds, some of the geometry may be right in front of it.
+    if (depth <= bounds->w * scale) {
+      texture->wanted_first_mip = 0;
+      texture->screen_size = viewport_height;
+      continue;
+    }
+
+    texture->screen_size = bounds->w * focal_length * viewport_height / depth;
+
+    const f32 texels_per_pixel = (f32) texture->dim * state->uv_extent / texture->screen_size;
+    if (texels_per_pixel > 1.f) {
+      texture->wanted_first_mip = (u32) REI_MIN (floorf (log2f (texels_per_pixel)), (f32) texture->tail_first_mip);
+    } else {
+      texture->wanted_first_mip = 0;
+    }
+  }
+}
+
+// Request a level more for the textures missing the most of them, making room within the budget by evicting levels of
+// textures that have more than they need.
+static void _s_queue_requests (rei_stream_t* stream) {
+  const rei_model_t* model = stream->model;
+
+  u64 resident_size = 0;
+  u32 request_count = 0;
+
+  for (u32 i = 0; i < model->texture_count; ++i) {
+    resident_size += _s_get_resident_size (&stream->textures[i], model->texture_states[i].first_mip);
+  }
+
+  pthread_mutex_lock (stream->lock);
+
+  // Requests in flight are counted in as if they were done.
+  for (const rei_stream_request_t* current = stream->requests; current; current = current->next) {
+    const rei_stream_texture_t* texture = &stream->textures[current->texture_index];
+
+    resident_size += _s_get_resident_size (texture, current->first_mip);
+    resident_size -= _s_get_resident_size (texture, current->previous_first_mip);
+    request_count += current->first_mip < current->previous_first_mip;
+  }
+
+  pthread_mutex_unlock (stream->lock);
+
+  while (request_count < REI_STREAM_MAX_REQUESTS) {
+    // The texture missing the most levels, the biggest on screen of those missing as many.
+    u32 best_index = REI_U32_MAX;
+    u32 best_missing_count = 0;
+
+    for (u32 i = 0; i < model->texture_count; ++i) {
+      const rei_stream_texture_t* texture = &stream->textures[i];
+      const u32 first_mip = model->texture_states[i].first_mip;
+
+      if (texture->is_busy || texture->has_failed || first_mip <= texture->wanted_first_mip) continue;
+
+      const u32 missing_count = first_mip - texture->wanted_first_mip;
+
+      if (missing_count > best_missing_count ||
+        (missing_count == best_missing_count && texture->screen_size > stream->textures[best_index].screen_size)) {
+
+        best_index = i;
+        best_missing_count = missing_count;
+      }
+    }
+
+    if (best_index == REI_U32_MAX) break;
+
+    const u32 first_mip = model->texture_states[best_index].first_mip - 1u;
+    const u64 size = stream->textures[best_index].mip_sizes[first_mip];
+
+    while (resident_size + size > stream->vram_budget) {
+      // The texture with the most levels to spare, the smallest on screen of those with as many.
+      u32 victim_index = REI_U32_MAX;
+      u32 victim_spare_count = 0;
+
+      for (u32 i = 0; i < model->texture_count; ++i) {
+        const rei_stream_texture_t* texture = &stream->textures[i];
+        const u32 current_first_mip = model->texture_states[i].first_mip;
+
+        if (texture->is_busy || texture->has_failed || current_first_mip >= texture->wanted_first_mip) continue;
+
+        const u32 spare_count = texture->wanted_first_mip - current_first_mip;
+
+        if (spare_count > victim_spare_count ||
+          (spare_count == victim_spare_count && texture->screen_size < stream->textures[victim_index].screen_size)) {
+
+          victim_index = i;
+          victim_spare_count = spare_count;
+        }
+      }
+
+      // Everything resident is needed, the budget is used up.
+      if (victim_index == REI_U32_MAX) return;
+
+      const u32 victim_first_mip = model->texture_states[victim_index].first_mip;
+      resident_size -= stream->textures[victim_index].mip_sizes[victim_first_mip];
+
+      _s_queue_request (stream, victim_index, victim_first_mip + 1u);
+    }
+
+    resident_size += size;
+    ++request_count;
+
+    _s_queue_request (stream, best_index, first_mip);
+  }
+}
+
+void rei_stream_create (const rei_stream_ci_t* create_info, rei_stream_t* out) {
+  memset (out, 0, sizeof *out);
+
+  out->thread_pool = create_info->thread_pool;
+  out->vfs = create_info->vfs;
+  out->vk_device = create_info->vk_device;
+  out->vk_allocator = create_info->vk_allocator;
+  out->model = create_info->model;
+  out->vram_budget = create_info->vram_budget ? create_info->vram_budget : REI_STREAM_VRAM_BUDGET;
+
+  out->lock = malloc (sizeof *out->lock);
+  pthread_mutex_init (out->lock, NULL);
+
+  const u32 texture_count = out->model->texture_count;
+  out->textures = malloc (sizeof *out->textures * texture_count);
+  memset (out->textures, 0, sizeof *out->textures * texture_count);
+
+  for (u32 i = 0; i < texture_count; ++i) {
+    if (_s_read_texture_info (out, i)) {
+      out->textures[i].has_failed = REI_TRUE;
+      REI_LOG_WARN ("Failed to stream " REI_ANSI_YELLOW "\"%s\"", out->model->texture_paths[i]);
+    }
+  }
+}
+
+void rei_stream_destroy (rei_stream_t* stream) {
+  rei_thread_pool_wait_counter (stream->thread_pool, &stream->counter);
+
+  // Retired images may still be sampled by frames in flight.
+  vkDeviceWaitIdle (stream->vk_device->handle);
+  _s_release_retired (stream, REI_TRUE);
+
+  while (stream->requests) {
+    rei_stream_request_t* request = stream->requests;
+    stream->requests = request->next;
+
+    _s_destroy_request (stream, request);
+  }
+
+  free (stream->textures);
+  pthread_mutex_destroy (stream->lock);
+  free (stream->lock);
+}
+
+void rei_stream_update (
+  rei_stream_t* stream,
+  const rei_vk_imm_ctxt_t* vk_imm_ctxt,
+  VkSampler vk_sampler,
+  const rei_mat4_t* view_projection,
+  f32 viewport_height) {
+
+  ++stream->frame_index;
+
+  _s_release_retired (stream, REI_FALSE);
+  _s_apply_requests (stream, vk_imm_ctxt, vk_sampler);
+
+  // Textures re-cooked by hot reloading come back with all of their levels, and maybe different ones.
+  for (u32 i = 0; i < stream->model->texture_count; ++i) {
+    rei_stream_texture_t* texture = &stream->textures[i];
+    if (texture->is_busy || texture->has_failed || texture->version == stream->model->texture_states[i].version) continue;
+
+    if (_s_read_texture_info (stream, i)) {
+      texture->has_failed = REI_TRUE;
+      REI_LOG_WARN ("Failed to stream " REI_ANSI_YELLOW "\"%s\"", stream->model->texture_paths[i]);
+    }
+  }
+
+  _s_update_wanted_mips (stream, view_projection, viewport_height);
+  _s_queue_requests (stream);
+}
@@ -0,0 +1,103 @@
+#ifndef REI_STREAM_H
+#define REI_STREAM_H
+
+#include "rei_model.h"
+
+// Default rei_stream_ci_t::vram_budget.
+#define REI_STREAM_VRAM_BUDGET (256ull << 20u)
+// Textures getting a level more at once, more would only hold back the ones in the most need of one.
+#define REI_STREAM_MAX_REQUESTS 4u
+
+typedef struct rei_stream_ci_t {
+  rei_thread_pool_t* thread_pool;
+  // Optional, rtex files it doesn't have are mapped from disk.
+  const rei_vfs_t* vfs;
+  const rei_vk_device_t* vk_device;
+  rei_vk_allocator_t* vk_allocator;
+  rei_model_t* model;
+  // Bytes of texture levels kept in VRAM, zero means REI_STREAM_VRAM_BUDGET. Levels loaded by rei_model_create
+  // always stay, even past the budget.
+  u64 vram_budget;
+} rei_stream_ci_t;
+
+// What the streamer knows about a texture of the model.
+typedef struct rei_stream_texture_t {
+  // Sizes of the levels in the rtex and its rei_texture_format_e, as of version (see rei_model_texture_t).
+  u32 mip_sizes[REI_TEXTURE_MAX_MIPS];
+  u32 mip_count;
+  u32 format;
+  u32 version;
+  // Longer side of the first level.
+  u32 dim;
+  // Levels from this one on are never evicted (see REI_MODEL_RESIDENT_MIP_DIM).
+  u32 tail_first_mip;
+  // First level the texture should have as of the last update, and how big its geometry was on screen in pixels.
+  u32 wanted_first_mip;
+  f32 screen_size;
+  // Set while a request for the texture is in flight, or for good once one failed.
+  b32 is_busy;
+  b32 has_failed;
+} rei_stream_texture_t;
+
+// New image of a texture with a level more or less than it has now.
+typedef struct rei_stream_request_t {
+  struct rei_stream_t* stream;
+  u32 texture_index;
+  // First level of the new image and the one it replaces, and the texture version it was requested for.
+  u32 first_mip;
+  u32 previous_first_mip;
+  u32 version;
+  b32 is_ready;
+  b32 has_failed;
+  // Materials sampling the texture at the time of the swap.
+  u32 retired_descriptor_count;
+  // Where the image of that version was read from, see rei_model_texture_t.
+  b32 is_packed;
+  rei_vk_buffer_t staging_buffer;
+  rei_vk_image_t image;
+  rei_vk_texture_upload_t upload;
+  // Once swapped, image holds the image it replaced. Both it and the descriptors the materials used until then are
+  // released after the frames in flight at retire_frame.
+  VkDescriptorSet* retired_descriptors;
+  u64 retire_frame;
+  struct rei_stream_request_t* next;
+} rei_stream_request_t;
+
+typedef struct rei_stream_t {
+  rei_thread_pool_t* thread_pool;
+  const rei_vfs_t* vfs;
+  const rei_vk_device_t* vk_device;
+  rei_vk_allocator_t* vk_allocator;
+  rei_model_t* model;
+  u64 vram_budget;
+  // rei_stream_update calls so far.
+  u64 frame_index;
+
+  rei_stream_texture_t* textures;
+
+  // Guards requests, which holds both in flight and ready ones.
+  pthread_mutex_t* lock;
+  rei_stream_request_t* requests;
+  // Swapped out images waiting for the frames that may still sample them, only touched by rei_stream_update.
+  rei_stream_request_t* retired;
+  // Tracks requests running on the pool.
+  rei_thread_counter_t counter;
+} rei_stream_t;
+
+// Start streaming the textures of model, which has to outlive the streamer.
+void rei_stream_create (const rei_stream_ci_t* create_info, rei_stream_t* out);
+// Waits for the requests in flight and the GPU.
+void rei_stream_destroy (rei_stream_t* stream);
+
+// Swap in the levels streamed since the last call, then request more levels for the textures that look the blurriest
+// through view_projection, evicting levels of others to stay within the budget. Has to be called once per frame before
+// recording it, from the thread submitting to the GPU. Never waits for frames in flight.
+void rei_stream_update (
+  rei_stream_t* stream,
+  const rei_vk_imm_ctxt_t* vk_imm_ctxt,
+  VkSampler vk_sampler,
+  const rei_mat4_t* view_projection,
+  f32 viewport_height
+);
+
+#endif /* REI_STREAM_H */
@@ -6,6 +6,11 @@
 #include "rei_imgui.h"
 #include "rei_window.h"
 #include "rei_camera.h"
+#include "rei_io.h"
+#include "rei_vfs.h"
+#include "rei_reload.h"
+#include "rei_stream.h"
+#include "rei_thread.h"
 #include "rei_defines.h"
 #include "rei_asset_loaders.h"
 
@@ -172,7 +177,13 @@ int main (void) {
   VkSampler default_sampler;
   VkSampler vk_text_sampler;
 
+  rei_thread_pool_t thread_pool;
+  rei_io_t io;
+  rei_vfs_t vfs;
+  rei_reload_t reload;
+
   rei_model_t test_model;
+  rei_stream_t stream;
   rei_camera_t camera;
   rei_mat4_t* camera_projection;
 
@@ -205,8 +216,8 @@ int main (void) {
 
   rei_vk_create_imm_ctxt (&vk_device, vk_device.gfx_index, &imm_ctxt);
 
-  // FIXME max_lod is hardcoded.
-  rei_vk_create_sampler (&vk_device, 0.f, 0.f, VK_FILTER_NEAREST, &default_sampler);
+  // Model textures come with their whole mip chain (see rei_texture_compress), the text atlas has a single level.
+  rei_vk_create_sampler (&vk_device, 0.f, VK_LOD_CLAMP_NONE, VK_FILTER_LINEAR, &default_sampler);
   rei_vk_create_sampler (&vk_device, 0.f, 0.f, VK_FILTER_NEAREST, &vk_text_sampler);
 
 #if 0
@@ -244,13 +255,38 @@ int main (void) {
   rei_vk_create_pipeline_layout (
     &vk_device,
     1, &default_desc_layout,
-    1, &(const VkPushConstantRange) {.stageFlags = VK_SHADER_STAGE_VERTEX_BIT, .offset = 0, .size = sizeof (rei_mat4_t)},
+    2, (const VkPushConstantRange[]) {
+      {.stageFlags = VK_SHADER_STAGE_VERTEX_BIT, .offset = 0, .size = sizeof (rei_mat4_t)},
+      // Whether the albedo texture has to be decoded from sRGB, see rei_model_texture_t::is_srgb_in_shader.
+      {.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT, .offset = sizeof (rei_mat4_t), .size = sizeof (u32)},
+    },
     &default_pipeline_layout
   );
 
   _s_create_model_gfx_pipeline (&vk_device, &vk_render_pass, &vk_swapchain, default_pipeline_layout, &default_pipeline);
 
-  rei_model_create ("assets/sponza/Sponza.gltf", &vk_device, &vk_allocator, &imm_ctxt, default_sampler, default_desc_layout, &test_model);
+  rei_thread_pool_create (&(const rei_thread_pool_ci_t) {.pinning = REI_THREAD_PINNING_PHYSICAL_CORE, .name = "rei-worker"}, &thread_pool);
+  rei_io_create (&(const rei_io_ci_t) {.thread_pool = &thread_pool}, &io);
+  // Loose files are read unless a pack was put at assets/sponza.rpak, nothing in the tree writes one.
+  const b8 has_vfs = !rei_vfs_create ("assets/sponza.rpak", &vfs);
+  rei_model_create ("assets/sponza/Sponza.gltf", &thread_pool, &io, has_vfs ? &vfs : NULL, &vk_device, &vk_allocator, &imm_ctxt, default_sampler, default_desc_layout, &test_model);
+
+  // Only the smallest levels of textures are loaded along with the model, the rest are streamed in as they are needed.
+  const rei_stream_ci_t stream_create_info = {
+    .thread_pool = &thread_pool,
+    .vfs = has_vfs ? &vfs : NULL,
+    .vk_device = &vk_device,
+    .vk_allocator = &vk_allocator,
+    .model = &test_model,
+  };
+
+  rei_stream_create (&stream_create_info, &stream);
+
+  // Edited sources under assets/ get re-cooked and swapped in while running.
+  rei_reload_create (
+    &(const rei_reload_ci_t) {.root_path = "assets/", .thread_pool = &thread_pool, .vk_device = &vk_device, .vk_allocator = &vk_allocator},
+    &reload
+  );
 
   rei_camera_create (0.f, 1.f, 0.f, -90.f, 0.f, &camera);
 
@@ -275,6 +311,13 @@ int main (void) {
   const f32 delta_time = 1.f / 60.f;
 
   for (;;) {
+    if (rei_reload_apply (&reload, &imm_ctxt, default_sampler, &test_model)) {
+      rei_stream_destroy (&stream);
+      rei_model_destroy (&vk_device, &vk_allocator, &test_model);
+      rei_model_create ("assets/sponza/Sponza.gltf", &thread_pool, &io, has_vfs ? &vfs : NULL, &vk_device, &vk_allocator, &imm_ctxt, default_sampler, default_desc_layout, &test_model);
+      rei_stream_create (&stream_create_info, &stream);
+    }
+
     ImGuiIO* imgui_io = igGetIO ();
     imgui_io->DeltaTime = delta_time;
 
@@ -296,24 +339,26 @@ int main (void) {
       free (event);
     }
 
+    rei_mat4_t view_projection;
+    rei_camera_get_view_projection (&camera, &camera_position, camera_projection, &view_projection);
+
+    rei_stream_update (&stream, &imm_ctxt, default_sampler, &view_projection, (f32) vk_swapchain.height);
+
     frame_index %= REI_VK_FRAME_COUNT;
 
     VkCommandBuffer vk_cmd_buffer;
     const rei_vk_frame_data_t* vk_current_frame = &vk_frames[frame_index];
     const u32 vk_image_index = rei_vk_begin_frame (&vk_device, &vk_render_pass, vk_current_frame, &vk_swapchain, &vk_cmd_buffer);
 
-    rei_mat4_t view_projection;
-    rei_camera_get_view_projection (&camera, &camera_position, camera_projection, &view_projection);
-
     vkCmdBindPipeline (vk_cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, default_pipeline);
     rei_model_draw_cmd (&test_model, vk_cmd_buffer, default_pipeline_layout, &view_projection);
 
     rei_imgui_new_frame (imgui_io);
-    rei_imgui_debug_window_wid (imgui_io);
+    rei_imgui_debug_window_wid (imgui_io, &thread_pool);
     igRender ();
 
     const ImDrawData* imgui_data = igGetDrawData ();
-    rei_imgui_update_buffers (&vk_allocator, &imgui_frame_data, imgui_data, frame_index);
+    rei_imgui_update_buffers (&thread_pool, &vk_allocator, &imgui_frame_data, imgui_data, frame_index);
 
     rei_imgui_draw_cmd (vk_cmd_buffer, &imgui_frame_data, imgui_data, frame_index);
 
@@ -332,7 +377,12 @@ RESOURCE_CLEANUP_L:
   rei_imgui_destroy_frame_data (&vk_device, &vk_allocator, &imgui_frame_data);
   rei_imgui_destroy_ctxt (&vk_device, &vk_allocator, &imgui_ctxt);
 
+  rei_reload_destroy (&reload);
+  rei_stream_destroy (&stream);
   rei_model_destroy (&vk_device, &vk_allocator, &test_model);
+  if (has_vfs) rei_vfs_destroy (&vfs);
+  rei_io_destroy (&io);
+  rei_thread_pool_destroy (&thread_pool);
   vkDestroyPipeline (vk_device.handle, default_pipeline, NULL);
   vkDestroyPipelineLayout (vk_device.handle, default_pipeline_layout, NULL);
   vkDestroyDescriptorPool (vk_device.handle, main_desc_pool, NULL);
@@ -1,130 +1,1111 @@
+// Affinity, thread naming and ucontext are GNU extensions.
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <memory.h>
+#include <sched.h>
 #include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "rei_debug.h"
 #include "rei_thread.h"
 
-static void* _s_thread_routine (void* arg) {
-  rei_thread_pool_t* thread_pool = (rei_thread_pool_t*) arg;
+struct rei_thread_fiber_t {
+  ucontext_t context;
+  rei_thread_pool_t* pool;
+  // Task the fiber is running (still pending while the fiber is suspended).
+  rei_thread_task_t* task;
+  // Link in the pool's free list or in a counter's waiter list.
+  rei_thread_fiber_t* next;
+  rei_thread_fiber_t* next_allocated;
+  void* stack;
+  u64 stack_size;
+  rei_thread_priority_e priority;
+  u32 __padding;
+};
 
-  for (;;) {
-    pthread_mutex_lock (thread_pool->task_queue.mutex);
-    rei_thread_task_t* current_task = NULL;
+typedef struct _s_thread_state_t {
+  // Worker the calling thread belongs to (NULL for threads outside of any pool).
+  rei_thread_worker_t* worker;
+  // Fiber the calling thread is running, NULL while on its own stack.
+  rei_thread_fiber_t* fiber;
+  // Set by a fiber right before it switches back to the scheduler, handled by the scheduler right after.
+  rei_thread_fiber_t* finished_fiber;
+  u32* suspend_lock;
+  // Where fibers go back to once they finish or get suspended.
+  ucontext_t scheduler_context;
+  // Priority of the task the calling thread is running, threads outside of any pool are assumed to be frame critical.
+  rei_thread_priority_e priority;
+  // Victim selection state for threads outside of any pool that help out while waiting.
+  u32 random_state;
+} _s_thread_state_t;
 
-    if (thread_pool->task_queue.head) {
-      current_task = thread_pool->task_queue.head;
-      thread_pool->task_queue.head = thread_pool->task_queue.head->next;
-    } else {
-      pthread_cond_wait (thread_pool->has_work_cond, thread_pool->task_queue.mutex);
+static __thread _s_thread_state_t _s_thread_state = {.priority = REI_THREAD_PRIORITY_FRAME, .random_state = 1};
+
+// A fiber can be suspended on one thread and resumed on another, while the compiler is free to compute the address
+// of a thread local once and keep it around across calls. Every access goes through here, so that it hits the running thread.
+// Never hold on to the result across anything that may switch fibers (running a task, waiting on a counter).
+static __attribute__ ((noinline)) _s_thread_state_t* _s_get_thread_state (void) {
+  __asm__ volatile ("" ::: "memory");
+  return &_s_thread_state;
+}
+
+static u64 _s_get_time_ns (void) {
+  struct timespec time;
+  clock_gettime (CLOCK_MONOTONIC, &time);
+
+  return (u64) time.tv_sec * 1000000000ull + (u64) time.tv_nsec;
+}
+
+// Stats are only ever written by the worker they belong to, but read by anyone taking a snapshot.
+static void _s_add_stat (u64* stat, u64 value) {
+  __atomic_store_n (stat, __atomic_load_n (stat, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// Deque critical sections are a handful of instructions long, so spin on them,
+// but give the core away if the holder seems to have been preempted.
+static void _s_spin_lock (u32* lock) {
+  if (!__atomic_exchange_n (lock, 1u, __ATOMIC_ACQUIRE)) return;
+
+  // Contended, only now is it worth timing.
+  const u64 wait_start = _s_get_time_ns ();
+
+  do {
+    for (u32 spin_count = 0; __atomic_load_n (lock, __ATOMIC_RELAXED); ++spin_count) {
+      if (spin_count < 64) {
+        _mm_pause ();
+      } else {
+        sched_yield ();
+      }
+    }
+  } while (__atomic_exchange_n (lock, 1u, __ATOMIC_ACQUIRE));
+
+  rei_thread_worker_t* worker = _s_get_thread_state ()->worker;
+  if (worker) _s_add_stat (&worker->stats.lock_wait_ns, _s_get_time_ns () - wait_start);
+}
+
+static void _s_spin_unlock (u32* lock) {
+  __atomic_store_n (lock, 0u, __ATOMIC_RELEASE);
+}
+
+// Sleep as long as *address equals expected (returns right away otherwise, or on a spurious wake up).
+// Returns REI_FALSE if it didn't get to sleep at all.
+static b8 _s_futex_wait (u32* address, u32 expected) {
+  return syscall (SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0) == 0;
+}
+
+static void _s_futex_wake (u32* address, u32 count) {
+  syscall (SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void _s_deque_create (rei_thread_deque_t* out) {
+  out->lock = 0;
+  out->mask = REI_THREAD_DEQUE_CAPACITY - 1;
+  out->max_depth = 0;
+  out->top = 0;
+  out->bottom = 0;
+  out->tasks = malloc (sizeof *out->tasks * REI_THREAD_DEQUE_CAPACITY);
+}
+
+static b8 _s_deque_is_empty (const rei_thread_deque_t* deque) {
+  return __atomic_load_n (&deque->bottom, __ATOMIC_RELAXED) == __atomic_load_n (&deque->top, __ATOMIC_RELAXED);
+}
+
+// Push count tasks linked through their next field in a single critical section.
+static void _s_deque_push (rei_thread_deque_t* deque, rei_thread_task_t* first, u32 count) {
+  _s_spin_lock (&deque->lock);
+
+  // Double the capacity until the new tasks fit, unwrapping live tasks into their new slots.
+  while (deque->bottom - deque->top + count > (u64) deque->mask + 1) {
+    const u32 new_mask = (deque->mask << 1) | 1;
+    rei_thread_task_t** new_tasks = malloc (sizeof *new_tasks * (new_mask + 1));
+
+    for (u64 i = deque->top; i < deque->bottom; ++i) new_tasks[i & new_mask] = deque->tasks[i & deque->mask];
+
+    free (deque->tasks);
+    deque->tasks = new_tasks;
+    deque->mask = new_mask;
+  }
+
+  u64 bottom = deque->bottom;
+  for (rei_thread_task_t* current = first; count--; current = current->next) deque->tasks[bottom++ & deque->mask] = current;
+
+  __atomic_store_n (&deque->bottom, bottom, __ATOMIC_RELAXED);
+  if (bottom - deque->top > deque->max_depth) __atomic_store_n (&deque->max_depth, (u32) (bottom - deque->top), __ATOMIC_RELAXED);
+
+  _s_spin_unlock (&deque->lock);
+}
+
+// Take the most recently pushed task (owner side).
+static rei_thread_task_t* _s_deque_pop (rei_thread_deque_t* deque) {
+  if (_s_deque_is_empty (deque)) return NULL;
+
+  rei_thread_task_t* task = NULL;
+  _s_spin_lock (&deque->lock);
+
+  if (deque->bottom != deque->top) {
+    __atomic_store_n (&deque->bottom, deque->bottom - 1, __ATOMIC_RELAXED);
+    task = deque->tasks[deque->bottom & deque->mask];
+  }
+
+  _s_spin_unlock (&deque->lock);
+  return task;
+}
+
+// Take the oldest task (thief side).
+static rei_thread_task_t* _s_deque_steal (rei_thread_deque_t* deque) {
+  if (_s_deque_is_empty (deque)) return NULL;
+
+  rei_thread_task_t* task = NULL;
+  _s_spin_lock (&deque->lock);
+
+  if (deque->bottom != deque->top) {
+    task = deque->tasks[deque->top & deque->mask];
+    __atomic_store_n (&deque->top, deque->top + 1, __ATOMIC_RELAXED);
+  }
+
+  _s_spin_unlock (&deque->lock);
+  return task;
+}
+
+// Allocate a new block of tasks and link all of them into a free list (caller owns the whole list).
+static rei_thread_task_t* _s_allocate_task_block (rei_thread_pool_t* thread_pool) {
+  rei_thread_task_block_t* new_block = malloc (sizeof *new_block);
+
+  for (u32 i = 0; i < REI_THREAD_TASK_BLOCK_SIZE - 1; ++i) new_block->tasks[i].next = &new_block->tasks[i + 1];
+  new_block->tasks[REI_THREAD_TASK_BLOCK_SIZE - 1].next = NULL;
+
+  _s_spin_lock (&thread_pool->free_tasks.lock);
+  new_block->next = thread_pool->free_tasks.blocks;
+  thread_pool->free_tasks.blocks = new_block;
+  _s_spin_unlock (&thread_pool->free_tasks.lock);
+
+  return new_block->tasks;
+}
+
+static rei_thread_task_t* _s_acquire_task (rei_thread_pool_t* thread_pool) {
+  rei_thread_worker_t* worker = _s_get_thread_state ()->worker;
+  rei_thread_task_t* task;
+
+  if (worker && worker->pool == thread_pool) {
+    if (!worker->free_tasks) {
+      // Refill local cache with a whole batch, so that the shared lock is taken once per batch and not per task.
+      _s_spin_lock (&thread_pool->free_tasks.lock);
+
+      rei_thread_task_t* batch = thread_pool->free_tasks.head;
+      rei_thread_task_t* last = batch;
+      u32 count = batch ? 1 : 0;
+
+      for (; count < REI_THREAD_TASK_BATCH_SIZE && last && last->next; ++count) last = last->next;
+
+      if (last) {
+        thread_pool->free_tasks.head = last->next;
+        last->next = NULL;
+      }
+
+      _s_spin_unlock (&thread_pool->free_tasks.lock);
+
+      if (batch) {
+        worker->free_tasks = batch;
+        worker->free_task_count = count;
+      } else {
+        worker->free_tasks = _s_allocate_task_block (thread_pool);
+        worker->free_task_count = REI_THREAD_TASK_BLOCK_SIZE;
+      }
+    }
+
+    task = worker->free_tasks;
+    worker->free_tasks = task->next;
+    --worker->free_task_count;
+
+    return task;
+  }
+
+  _s_spin_lock (&thread_pool->free_tasks.lock);
+  task = thread_pool->free_tasks.head;
+  if (task) thread_pool->free_tasks.head = task->next;
+  _s_spin_unlock (&thread_pool->free_tasks.lock);
+
+  if (!task) {
+    // Keep one task and hand the rest of the block over to everyone else.
+    task = _s_allocate_task_block (thread_pool);
+    rei_thread_task_t* rest = task->next;
+    rei_thread_task_t* last = &task[REI_THREAD_TASK_BLOCK_SIZE - 1];
+
+    _s_spin_lock (&thread_pool->free_tasks.lock);
+    last->next = thread_pool->free_tasks.head;
+    thread_pool->free_tasks.head = rest;
+    _s_spin_unlock (&thread_pool->free_tasks.lock);
+  }
+
+  return task;
+}
+
+static void _s_release_task (rei_thread_pool_t* thread_pool, rei_thread_task_t* task) {
+  rei_thread_worker_t* worker = _s_get_thread_state ()->worker;
+
+  if (worker && worker->pool == thread_pool) {
+    task->next = worker->free_tasks;
+    worker->free_tasks = task;
+
+    // Give a batch back once the local cache gets too big, otherwise tasks added from outside threads
+    // would slowly migrate into worker caches and force the shared free list to keep allocating.
+    if (++worker->free_task_count >= REI_THREAD_TASK_BATCH_SIZE * 2) {
+      rei_thread_task_t* first = worker->free_tasks;
+      rei_thread_task_t* last = first;
+
+      for (u32 i = 1; i < REI_THREAD_TASK_BATCH_SIZE; ++i) last = last->next;
+
+      worker->free_tasks = last->next;
+      worker->free_task_count -= REI_THREAD_TASK_BATCH_SIZE;
+
+      _s_spin_lock (&thread_pool->free_tasks.lock);
+      last->next = thread_pool->free_tasks.head;
+      thread_pool->free_tasks.head = first;
+      _s_spin_unlock (&thread_pool->free_tasks.lock);
+    }
+
+    return;
+  }
+
+  _s_spin_lock (&thread_pool->free_tasks.lock);
+  task->next = thread_pool->free_tasks.head;
+  thread_pool->free_tasks.head = task;
+  _s_spin_unlock (&thread_pool->free_tasks.lock);
+}
+
+// Xorshift32, good enough to spread thieves across victims.
+static u32 _s_next_random (u32* state) {
+  u32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  return *state = x;
+}
+
+// Find a task of the given priority, worker is NULL for threads outside of the pool (they can only steal).
+static rei_thread_task_t* _s_find_task_in_lane (rei_thread_pool_t* thread_pool, rei_thread_worker_t* worker, rei_thread_priority_e priority) {
+  rei_thread_task_t* task = worker ? _s_deque_pop (&worker->deques[priority]) : NULL;
+
+  if (!task) {
+    // Sweep over every other worker once, starting from a random victim.
+    const u32 worker_count = (u32) thread_pool->thread_count;
+    const u32 first_victim = _s_next_random (worker ? &worker->random_state : &_s_get_thread_state ()->random_state) % worker_count;
+
+    for (u32 i = 0; i < worker_count && !task; ++i) {
+      const u32 victim = (first_victim + i) % worker_count;
+      if (!worker || victim != worker->index) task = _s_deque_steal (&thread_pool->workers[victim].deques[priority]);
     }
 
-    if (thread_pool->has_to_quit) break;
+    if (task && worker) _s_add_stat (&worker->stats.steal_count, 1);
+  }
+
+  return task;
+}
+
+static rei_thread_task_t* _s_find_task (rei_thread_pool_t* thread_pool, rei_thread_worker_t* worker) {
+  rei_thread_task_t* task = NULL;
+
+  // Frame work always goes first, except that every so often a worker checks the streaming lane before it,
+  // lest a steady stream of frame work starve background work forever. Outside threads never do, they are
+  // only helping out while waiting for something.
+  if (worker && worker->frame_streak >= REI_THREAD_STARVATION_LIMIT) {
+    worker->frame_streak = 0;
+    task = _s_find_task_in_lane (thread_pool, worker, REI_THREAD_PRIORITY_STREAMING);
+  }
+
+  for (u32 i = 0; i < REI_THREAD_PRIORITY_COUNT && !task; ++i) task = _s_find_task_in_lane (thread_pool, worker, (rei_thread_priority_e) i);
+
+  if (task) {
+    __atomic_sub_fetch (&thread_pool->queued_task_count, 1, __ATOMIC_SEQ_CST);
+    if (worker) worker->frame_streak = task->priority == REI_THREAD_PRIORITY_FRAME ? worker->frame_streak + 1 : 0;
+  }
+
+  return task;
+}
+
+static void _s_notify_waiters (rei_thread_pool_t* thread_pool) {
+  // Both rei_thread_pool_wait_all and rei_thread_pool_wait_counter sleep on the same condition.
+  pthread_mutex_lock (thread_pool->sleep_mutex);
+  pthread_cond_broadcast (thread_pool->no_work_cond);
+  pthread_mutex_unlock (thread_pool->sleep_mutex);
+}
+
+static void _s_push_tasks (rei_thread_pool_t* thread_pool, rei_thread_task_t* first, u32 count, rei_thread_priority_e priority);
+
+// Queue fibers that were waiting on a counter, they pick up where they left off on whichever thread gets to them.
+static void _s_resume_fibers (rei_thread_pool_t* thread_pool, rei_thread_fiber_t* fibers) {
+  while (fibers) {
+    rei_thread_fiber_t* fiber = fibers;
+    fibers = fiber->next;
+
+    rei_thread_task_t* new_task = _s_acquire_task (thread_pool);
+    new_task->action = NULL;
+    new_task->arg = NULL;
+    new_task->counter = NULL;
+    new_task->priority = fiber->priority;
+    new_task->runs_on_fiber = REI_TRUE;
+    new_task->fiber = fiber;
+
+    _s_push_tasks (thread_pool, new_task, 1, fiber->priority);
+  }
+}
+
+// Returns true if the counter reached zero, in which case threads waiting on it have to be notified.
+static b8 _s_decrement_counter (rei_thread_pool_t* thread_pool, rei_thread_counter_t* counter) {
+  rei_thread_fiber_t* waiters = NULL;
+
+  // Counters are only ever decremented under their lock, so that waiters can tell when nobody touches them anymore.
+  _s_spin_lock (&counter->lock);
+
+  const b8 reached_zero = !__atomic_sub_fetch (&counter->value, 1, __ATOMIC_SEQ_CST);
+  if (reached_zero) {
+    waiters = counter->waiters;
+    counter->waiters = NULL;
+  }
+
+  _s_spin_unlock (&counter->lock);
+
+  _s_resume_fibers (thread_pool, waiters);
+  return reached_zero;
+}
+
+static void _s_run_task (rei_thread_pool_t* thread_pool, rei_thread_task_t* task) {
+  // Tasks may run others while waiting, so the previous priority has to be restored afterwards.
+  // Fibers may come back on another thread, whose scheduler restores its own priority anyway.
+  _s_thread_state_t* thread_state = _s_get_thread_state ();
+  const rei_thread_priority_e previous_priority = thread_state->priority;
+  thread_state->priority = task->priority;
+
+  if (thread_state->worker) _s_add_stat (&thread_state->worker->stats.task_count, 1);
+
+  task->action (task->arg);
+
+  _s_get_thread_state ()->priority = previous_priority;
+
+  rei_thread_counter_t* counter = task->counter;
+  _s_release_task (thread_pool, task);
+
+  b8 has_to_notify = counter ? _s_decrement_counter (thread_pool, counter) : REI_FALSE;
+
+  if (!__atomic_sub_fetch (&thread_pool->pending_task_count, 1, __ATOMIC_SEQ_CST)) has_to_notify = REI_TRUE;
+  if (has_to_notify) _s_notify_waiters (thread_pool);
+}
+
+static void _s_fiber_routine (void) {
+  for (;;) {
+    rei_thread_fiber_t* fiber = _s_get_thread_state ()->fiber;
+    _s_run_task (fiber->pool, fiber->task);
+
+    // The task may have been suspended and finished on another thread than the one it started on.
+    _s_thread_state_t* thread_state = _s_get_thread_state ();
+    thread_state->finished_fiber = fiber;
+    swapcontext (&fiber->context, &thread_state->scheduler_context);
+  }
+}
+
+static rei_thread_fiber_t* _s_acquire_fiber (rei_thread_pool_t* thread_pool) {
+  _s_spin_lock (&thread_pool->free_fibers.lock);
+  rei_thread_fiber_t* fiber = thread_pool->free_fibers.head;
+  if (fiber) thread_pool->free_fibers.head = fiber->next;
+  _s_spin_unlock (&thread_pool->free_fibers.lock);
+
+  if (!fiber) {
+    const u64 page_size = (u64) sysconf (_SC_PAGESIZE);
+
+    fiber = malloc (sizeof *fiber);
+    fiber->pool = thread_pool;
+    fiber->stack_size = REI_THREAD_FIBER_STACK_SIZE + page_size;
+    fiber->stack = mmap (NULL, fiber->stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    REI_ASSERT (fiber->stack != MAP_FAILED);
+
+    // Stacks grow down, the lowest page is left inaccessible so that overflows crash instead of corrupting memory.
+    mprotect (fiber->stack, page_size, PROT_NONE);
+
+    getcontext (&fiber->context);
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = fiber->stack_size;
+    fiber->context.uc_link = NULL;
+    makecontext (&fiber->context, _s_fiber_routine, 0);
+
+    _s_spin_lock (&thread_pool->free_fibers.lock);
+    fiber->next_allocated = thread_pool->free_fibers.allocated;
+    thread_pool->free_fibers.allocated = fiber;
+    _s_spin_unlock (&thread_pool->free_fibers.lock);
+  }
+
+  return fiber;
+}
+
+static void _s_release_fiber (rei_thread_pool_t* thread_pool, rei_thread_fiber_t* fiber) {
+  _s_spin_lock (&thread_pool->free_fibers.lock);
+  fiber->next = thread_pool->free_fibers.head;
+  thread_pool->free_fibers.head = fiber;
+  _s_spin_unlock (&thread_pool->free_fibers.lock);
+}
+
+// Run a task the calling thread picked up. Fiber tasks get a fiber of their own, suspended fibers continue on the current thread.
+// Only ever called from a thread's own stack, fibers never run other tasks.
+static void _s_dispatch_task (rei_thread_pool_t* thread_pool, rei_thread_task_t* task) {
+  if (!task->runs_on_fiber) {
+    _s_run_task (thread_pool, task);
+    return;
+  }
+
+  rei_thread_fiber_t* fiber = task->fiber;
+
+  if (fiber) {
+    // Resume entries only get the fiber picked up, the task it's running stays pending until it finishes.
+    _s_release_task (thread_pool, task);
+    if (!__atomic_sub_fetch (&thread_pool->pending_task_count, 1, __ATOMIC_SEQ_CST)) _s_notify_waiters (thread_pool);
+  } else {
+    fiber = _s_acquire_fiber (thread_pool);
+    fiber->task = task;
+    fiber->priority = task->priority;
+  }
+
+  _s_thread_state_t* thread_state = _s_get_thread_state ();
+  const rei_thread_priority_e previous_priority = thread_state->priority;
+
+  thread_state->priority = fiber->priority;
+  thread_state->fiber = fiber;
+  swapcontext (&thread_state->scheduler_context, &fiber->context);
+
+  // Back on the thread's own stack, the fiber has either finished its task or got suspended.
+  thread_state->fiber = NULL;
+  thread_state->priority = previous_priority;
+
+  if (thread_state->finished_fiber) {
+    _s_release_fiber (thread_pool, thread_state->finished_fiber);
+    thread_state->finished_fiber = NULL;
+  }
+
+  // Lock of the counter the fiber waits on can be released now that its context has been saved.
+  if (thread_state->suspend_lock) {
+    _s_spin_unlock (thread_state->suspend_lock);
+    thread_state->suspend_lock = NULL;
+  }
+}
+
+// Queue count tasks linked through their next field without touching their counters (they have been accounted for already).
+static void _s_push_tasks (rei_thread_pool_t* thread_pool, rei_thread_task_t* first, u32 count, rei_thread_priority_e priority) {
+  // Tasks spawned by a worker stay on its own deque, everything else gets spread across workers.
+  rei_thread_worker_t* worker = _s_get_thread_state ()->worker;
+
+  if (!worker || worker->pool != thread_pool) {
+    const u32 index = __atomic_fetch_add (&thread_pool->next_worker_index, 1, __ATOMIC_RELAXED);
+    worker = &thread_pool->workers[index % thread_pool->thread_count];
+  }
+
+  // Counters go up before the task becomes visible, so that they never underflow.
+  __atomic_add_fetch (&thread_pool->pending_task_count, count, __ATOMIC_SEQ_CST);
+  const u32 queued_task_count = __atomic_fetch_add (&thread_pool->queued_task_count, count, __ATOMIC_SEQ_CST);
+  _s_deque_push (&worker->deques[priority], first, count);
+
+  // Wake one sleeper per new task instead of the whole pool, minus the ones that were woken
+  // for already queued tasks. Every woken worker keeps going until it runs out of work.
+  // Spinning workers are not counted as sleepers, so bursts of work cost no system calls while they're around.
+  const u32 sleeping_thread_count = __atomic_load_n (&thread_pool->sleeping_thread_count, __ATOMIC_SEQ_CST);
+
+  if (sleeping_thread_count > queued_task_count) {
+    u32 wake_count = sleeping_thread_count - queued_task_count;
+    if (wake_count > count) wake_count = count;
+
+    __atomic_add_fetch (&thread_pool->work_epoch, 1, __ATOMIC_SEQ_CST);
+    _s_futex_wake (&thread_pool->work_epoch, wake_count);
+  }
+
+  // Threads waiting on a counter help with whatever gets queued, see rei_thread_pool_wait_counter.
+  if (__atomic_load_n (&thread_pool->waiting_thread_count, __ATOMIC_SEQ_CST)) _s_notify_waiters (thread_pool);
+}
+
+static void _s_push_task (
+  rei_thread_pool_t* thread_pool,
+  rei_thread_task_action_f action,
+  void* arg,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority,
+  b32 runs_on_fiber) {
+
+  rei_thread_task_t* new_task = _s_acquire_task (thread_pool);
+  new_task->action = action;
+  new_task->arg = arg;
+  new_task->counter = counter;
+  new_task->priority = priority;
+  new_task->runs_on_fiber = runs_on_fiber;
+  new_task->fiber = NULL;
+
+  _s_push_tasks (thread_pool, new_task, 1, priority);
+}
+
+// Poll for new work for a while, true if there may be some (or the pool is shutting down).
+static b8 _s_spin_for_work (const rei_thread_pool_t* thread_pool) {
+  const u64 start = __rdtsc ();
 
-    ++thread_pool->work_thread_count;
-    pthread_mutex_unlock (thread_pool->task_queue.mutex);
+  while (__rdtsc () - start < thread_pool->spin_cycles) {
+    if (__atomic_load_n (&thread_pool->queued_task_count, __ATOMIC_RELAXED)) return REI_TRUE;
+    if (__atomic_load_n (&thread_pool->has_to_quit, __ATOMIC_RELAXED)) return REI_TRUE;
+
+    _mm_pause ();
+  }
+
+  return REI_FALSE;
+}
+
+static void* _s_thread_routine (void* arg) {
+  rei_thread_worker_t* worker = (rei_thread_worker_t*) arg;
+  rei_thread_pool_t* thread_pool = worker->pool;
+
+  _s_get_thread_state ()->worker = worker;
+
+  // Time the worker went idle at, zero while it's busy.
+  u64 idle_start = 0;
+
+  while (!__atomic_load_n (&thread_pool->has_to_quit, __ATOMIC_ACQUIRE)) {
+    rei_thread_task_t* current_task = _s_find_task (thread_pool, worker);
 
     if (current_task) {
-      current_task->action (current_task->arg);
-      free (current_task);
+      const u64 busy_start = _s_get_time_ns ();
+
+      if (idle_start) {
+        _s_add_stat (&worker->stats.idle_ns, busy_start - idle_start);
+        idle_start = 0;
+      }
+
+      _s_dispatch_task (thread_pool, current_task);
+
+      _s_add_stat (&worker->stats.busy_ns, _s_get_time_ns () - busy_start);
+      continue;
+    }
+
+    if (!idle_start) idle_start = _s_get_time_ns ();
+
+    // Nothing to run or steal. Per-frame work tends to come in bursts, so poll for a bit
+    // before paying for a round trip through the kernel.
+    if (_s_spin_for_work (thread_pool)) continue;
+
+    // Go to sleep on the event count. Epoch is read before the sleeper count is published, and the sleeper count
+    // is published before queued count is checked (the other way around in _s_push_tasks). Either the new task is seen
+    // here, or the producer sees this sleeper and bumps the epoch, which makes the futex wait return right away.
+    const u32 epoch = __atomic_load_n (&thread_pool->work_epoch, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch (&thread_pool->sleeping_thread_count, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n (&thread_pool->queued_task_count, __ATOMIC_SEQ_CST) && !__atomic_load_n (&thread_pool->has_to_quit, __ATOMIC_SEQ_CST)) {
+      // Only count sleeps that were ended by new work, not ones the epoch moved on before or spurious wake ups.
+      const b8 has_slept = _s_futex_wait (&thread_pool->work_epoch, epoch);
+      if (has_slept && __atomic_load_n (&thread_pool->work_epoch, __ATOMIC_SEQ_CST) != epoch) _s_add_stat (&worker->stats.wake_up_count, 1);
     }
 
-    pthread_mutex_lock (thread_pool->task_queue.mutex);
-    --thread_pool->work_thread_count;
-    if (!thread_pool->work_thread_count || !thread_pool->task_queue.head) pthread_cond_signal (thread_pool->no_work_cond);
-    pthread_mutex_unlock (thread_pool->task_queue.mutex);
+    __atomic_sub_fetch (&thread_pool->sleeping_thread_count, 1, __ATOMIC_SEQ_CST);
   }
 
-  pthread_cond_signal (thread_pool->has_work_cond);
-  pthread_mutex_unlock (thread_pool->task_queue.mutex);
+  // Time spent waiting for work that never came before the pool was destroyed.
+  if (idle_start) _s_add_stat (&worker->stats.idle_ns, _s_get_time_ns () - idle_start);
 
   return NULL;
 }
 
-void rei_thread_pool_create (rei_thread_pool_t* out) {
-  out->task_queue.head = NULL;
-  out->task_queue.tail = NULL;
-  out->task_queue.mutex = malloc (sizeof *out->task_queue.mutex);
-  out->has_work_cond = malloc (sizeof *out->has_work_cond);
+// Parse a CPU list in the format used by sysfs and taskset (e.g. "0-3,8,10-11").
+static b8 _s_parse_cpu_list (const char* list, cpu_set_t* out) {
+  CPU_ZERO (out);
+
+  while (*list >= '0' && *list <= '9') {
+    char* next;
+    const u64 first = strtoul (list, &next, 10);
+    u64 last = first;
+
+    if (*next == '-') last = strtoul (next + 1, &next, 10);
+    for (u64 cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) CPU_SET (cpu, out);
+
+    list = next;
+    if (*list == ',') ++list;
+  }
+
+  return CPU_COUNT (out) > 0;
+}
+
+// Read a CPU list of the given cpu from /sys/devices/system/cpu/cpuN/<file>.
+static b8 _s_read_cpu_list (u32 cpu, const char* file, cpu_set_t* out) {
+  char path[128];
+  snprintf (path, sizeof path, "/sys/devices/system/cpu/cpu%u/%s", cpu, file);
+
+  const s32 fd = open (path, O_RDONLY);
+  if (fd == -1) return REI_FALSE;
+
+  char list[1024];
+  const s64 size = read (fd, list, sizeof list - 1);
+  close (fd);
+
+  if (size <= 0) return REI_FALSE;
+  list[size] = '\0';
+
+  return _s_parse_cpu_list (list, out);
+}
+
+// Partition allowed CPUs into groups sharing a resource, as described by the first of the given sysfs files that exists.
+// CPUs without topology information end up in groups of their own. Returns the group count.
+static u32 _s_find_cpu_groups (const cpu_set_t* allowed, const char* const* files, u32 file_count, cpu_set_t* out) {
+  u32 group_count = 0;
+  cpu_set_t covered;
+  CPU_ZERO (&covered);
+
+  for (u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET (cpu, allowed) || CPU_ISSET (cpu, &covered)) continue;
+
+    cpu_set_t* group = &out[group_count++];
+    b8 is_found = REI_FALSE;
+
+    for (u32 i = 0; i < file_count && !is_found; ++i) is_found = _s_read_cpu_list (cpu, files[i], group);
+
+    if (is_found) {
+      CPU_AND (group, group, allowed);
+    } else {
+      CPU_ZERO (group);
+    }
+
+    CPU_SET (cpu, group);
+    CPU_OR (&covered, &covered, group);
+  }
+
+  return group_count;
+}
+
+void rei_thread_pool_create (const rei_thread_pool_ci_t* create_info, rei_thread_pool_t* out) {
+  out->sleep_mutex = malloc (sizeof *out->sleep_mutex);
   out->no_work_cond = malloc (sizeof *out->no_work_cond);
 
-  pthread_mutex_init (out->task_queue.mutex, NULL);
-  pthread_cond_init (out->has_work_cond, NULL);
+  pthread_mutex_init (out->sleep_mutex, NULL);
   pthread_cond_init (out->no_work_cond, NULL);
 
-  out->work_thread_count = 0;
+  out->queued_task_count = 0;
+  out->pending_task_count = 0;
+  out->sleeping_thread_count = 0;
+  out->waiting_thread_count = 0;
+  out->work_epoch = 0;
+  out->next_worker_index = 0;
   out->has_to_quit = REI_FALSE;
-  const s64 thread_count = sysconf (_SC_NPROCESSORS_ONLN) * 2;
-  REI_ASSERT (thread_count);
 
-  out->thread_count = (u64) thread_count;
+  out->free_tasks.lock = 0;
+  out->free_tasks.head = NULL;
+  out->free_tasks.blocks = NULL;
+
+  out->free_fibers.lock = 0;
+  out->free_fibers.head = NULL;
+  out->free_fibers.allocated = NULL;
+
+  // Only CPUs the process is allowed to run on are considered (they may be limited by taskset or cgroups).
+  cpu_set_t allowed;
+  if (sched_getaffinity (0, sizeof allowed, &allowed)) {
+    CPU_ZERO (&allowed);
+    for (s64 i = 0; i < sysconf (_SC_NPROCESSORS_ONLN) && i < CPU_SETSIZE; ++i) CPU_SET ((u64) i, &allowed);
+  }
+
+  const u32 allowed_count = (u32) CPU_COUNT (&allowed);
+  cpu_set_t* groups = malloc (sizeof *groups * allowed_count);
+
+  // SMT siblings share caches and execution units, so a second worker per core mostly adds contention.
+  const char* const core_files[] = {"topology/thread_siblings_list"};
+  const u32 core_count = _s_find_cpu_groups (&allowed, core_files, 1, groups);
+
+  u32 group_count = 0;
+
+  switch (create_info->pinning) {
+    case REI_THREAD_PINNING_NONE: break;
+    case REI_THREAD_PINNING_PHYSICAL_CORE: group_count = core_count; break;
+
+    case REI_THREAD_PINNING_L3_CLUSTER: {
+      // Fall back to the whole package if the kernel doesn't expose cache topology.
+      const char* const l3_files[] = {"cache/index3/shared_cpu_list", "topology/core_siblings_list"};
+      group_count = _s_find_cpu_groups (&allowed, l3_files, 2, groups);
+    } break;
+
+    case REI_THREAD_PINNING_CPU_LIST: {
+      cpu_set_t cpu_list;
+      REI_ASSERT (create_info->cpu_list && _s_parse_cpu_list (create_info->cpu_list, &cpu_list));
 
-  pthread_t thread;
+      // Every listed CPU makes a group of its own.
+      for (u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET (cpu, &cpu_list) && CPU_ISSET (cpu, &allowed)) {
+          CPU_ZERO (&groups[group_count]);
+          CPU_SET (cpu, &groups[group_count++]);
+        }
+      }
 
-  for (s64 i = 0; i < thread_count; ++i) {
-    pthread_create (&thread, NULL, _s_thread_routine, out);
-    pthread_detach (thread);
+      REI_ASSERT (group_count);
+    } break;
   }
+
+  u32 thread_count = create_info->thread_count;
+
+  if (!thread_count) {
+    thread_count = create_info->pinning == REI_THREAD_PINNING_CPU_LIST ? group_count : core_count;
+  }
+
+  out->thread_count = thread_count;
+  // With a single CPU to run on, spinning would only keep the thread that is about to queue work off of it.
+  out->spin_cycles = allowed_count > 1 ? REI_THREAD_SPIN_CYCLES : 0;
+  posix_memalign ((void**) &out->workers, __alignof__ (rei_thread_worker_t), sizeof *out->workers * out->thread_count);
+
+  // Every deque has to exist before the first worker starts looking for victims.
+  for (u32 i = 0; i < out->thread_count; ++i) {
+    rei_thread_worker_t* worker = &out->workers[i];
+
+    for (u32 j = 0; j < REI_THREAD_PRIORITY_COUNT; ++j) _s_deque_create (&worker->deques[j]);
+    worker->pool = out;
+    worker->index = i;
+    // Any odd seed will do for xorshift.
+    worker->random_state = (i << 1) | 1;
+    worker->free_tasks = NULL;
+    worker->free_task_count = 0;
+    worker->frame_streak = 0;
+    memset (&worker->stats, 0, sizeof worker->stats);
+  }
+
+  const char* name = create_info->name ? create_info->name : "rei-worker";
+
+  for (u32 i = 0; i < out->thread_count; ++i) {
+    rei_thread_worker_t* worker = &out->workers[i];
+
+    // Workers are spread round robin over groups and start out already placed, so no migration happens after the fact.
+    pthread_attr_t attributes;
+    pthread_attr_init (&attributes);
+    if (group_count) pthread_attr_setaffinity_np (&attributes, sizeof *groups, &groups[i % group_count]);
+
+    pthread_create (&worker->handle, &attributes, _s_thread_routine, worker);
+    pthread_attr_destroy (&attributes);
+
+    // Thread names are limited to 15 characters, cut the prefix rather than the index.
+    char index[12];
+    const s32 index_length = snprintf (index, sizeof index, "-%u", i);
+
+    char thread_name[16];
+    snprintf (thread_name, sizeof thread_name, "%.*s%s", 15 - index_length, name, index);
+    pthread_setname_np (worker->handle, thread_name);
+  }
+
+  free (groups);
 }
 
 void rei_thread_pool_destroy (rei_thread_pool_t* thread_pool) {
-  pthread_mutex_lock (thread_pool->task_queue.mutex);
+  __atomic_store_n (&thread_pool->has_to_quit, REI_TRUE, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&thread_pool->work_epoch, 1, __ATOMIC_SEQ_CST);
+  _s_futex_wake (&thread_pool->work_epoch, (u32) thread_pool->thread_count);
 
-  thread_pool->has_to_quit = REI_TRUE;
+  for (u32 i = 0; i < thread_pool->thread_count; ++i) pthread_join (thread_pool->workers[i].handle, NULL);
 
-  rei_thread_task_t* current = thread_pool->task_queue.head;
+  // Tasks that nobody got to are dropped along with their blocks.
+  for (u32 i = 0; i < thread_pool->thread_count; ++i) {
+    for (u32 j = 0; j < REI_THREAD_PRIORITY_COUNT; ++j) free (thread_pool->workers[i].deques[j].tasks);
+  }
+  free (thread_pool->workers);
+
+  rei_thread_task_block_t* current_block = thread_pool->free_tasks.blocks;
 
-  while (current) {
-    rei_thread_task_t* tmp = current;
-    current = current->next;
+  while (current_block) {
+    rei_thread_task_block_t* tmp = current_block;
+    current_block = current_block->next;
 
     free (tmp);
   }
 
-  pthread_cond_broadcast (thread_pool->has_work_cond);
-  pthread_mutex_unlock (thread_pool->task_queue.mutex);
+  rei_thread_fiber_t* current_fiber = thread_pool->free_fibers.allocated;
 
-  rei_thread_pool_wait_all (thread_pool);
+  while (current_fiber) {
+    rei_thread_fiber_t* tmp = current_fiber;
+    current_fiber = current_fiber->next_allocated;
+
+    munmap (tmp->stack, tmp->stack_size);
+    free (tmp);
+  }
 
   pthread_cond_destroy (thread_pool->no_work_cond);
-  pthread_cond_destroy (thread_pool->has_work_cond);
-  pthread_mutex_destroy (thread_pool->task_queue.mutex);
+  pthread_mutex_destroy (thread_pool->sleep_mutex);
 
   free (thread_pool->no_work_cond);
-  free (thread_pool->has_work_cond);
-  free (thread_pool->task_queue.mutex);
+  free (thread_pool->sleep_mutex);
 }
 
-void rei_thread_pool_add_task (rei_thread_pool_t* thread_pool, rei_thread_task_action_f action, void* restrict arg) {
-  rei_thread_task_t* new_task = malloc (sizeof *new_task);
-  new_task->action = action;
-  new_task->arg = arg;
-  new_task->next = NULL;
+void rei_thread_pool_get_stats (const rei_thread_pool_t* thread_pool, rei_thread_pool_stats_t* out) {
+  out->worker_count = (u32) thread_pool->thread_count;
+  out->queued_task_count = __atomic_load_n (&thread_pool->queued_task_count, __ATOMIC_RELAXED);
+  out->pending_task_count = __atomic_load_n (&thread_pool->pending_task_count, __ATOMIC_RELAXED);
+  out->sleeping_thread_count = __atomic_load_n (&thread_pool->sleeping_thread_count, __ATOMIC_RELAXED);
 
-  pthread_mutex_lock (thread_pool->task_queue.mutex);
+  for (u32 i = 0; i < out->worker_count; ++i) {
+    const rei_thread_worker_t* worker = &thread_pool->workers[i];
+    rei_thread_worker_stats_t* current = &out->workers[i];
 
-  if (thread_pool->task_queue.head) {
-    thread_pool->task_queue.tail->next = new_task;
-  } else {
-    thread_pool->task_queue.head = new_task;
+    current->task_count = __atomic_load_n (&worker->stats.task_count, __ATOMIC_RELAXED);
+    current->busy_ns = __atomic_load_n (&worker->stats.busy_ns, __ATOMIC_RELAXED);
+    current->idle_ns = __atomic_load_n (&worker->stats.idle_ns, __ATOMIC_RELAXED);
+    current->wake_up_count = __atomic_load_n (&worker->stats.wake_up_count, __ATOMIC_RELAXED);
+    current->lock_wait_ns = __atomic_load_n (&worker->stats.lock_wait_ns, __ATOMIC_RELAXED);
+    current->steal_count = __atomic_load_n (&worker->stats.steal_count, __ATOMIC_RELAXED);
+    current->max_queue_depth = 0;
+
+    for (u32 j = 0; j < REI_THREAD_PRIORITY_COUNT; ++j) {
+      const u32 max_depth = __atomic_load_n (&worker->deques[j].max_depth, __ATOMIC_RELAXED);
+      if (max_depth > current->max_queue_depth) current->max_queue_depth = max_depth;
+    }
   }
+}
+
+void rei_thread_pool_add_task (
+  rei_thread_pool_t* thread_pool,
+  rei_thread_task_action_f action,
+  void* restrict arg,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority) {
+
+  if (counter) __atomic_add_fetch (&counter->value, 1, __ATOMIC_SEQ_CST);
+  _s_push_task (thread_pool, action, arg, counter, priority, REI_FALSE);
+}
 
-  thread_pool->task_queue.tail = new_task;
+void rei_thread_pool_add_fiber_task (
+  rei_thread_pool_t* thread_pool,
+  rei_thread_task_action_f action,
+  void* restrict arg,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority) {
 
-  pthread_cond_broadcast (thread_pool->has_work_cond);
-  pthread_mutex_unlock (thread_pool->task_queue.mutex);
+  if (counter) __atomic_add_fetch (&counter->value, 1, __ATOMIC_SEQ_CST);
+  _s_push_task (thread_pool, action, arg, counter, priority, REI_TRUE);
+}
+
+void rei_thread_counter_increment (rei_thread_counter_t* counter, u32 amount) {
+  __atomic_add_fetch (&counter->value, amount, __ATOMIC_SEQ_CST);
+}
+
+void rei_thread_pool_decrement_counter (rei_thread_pool_t* thread_pool, rei_thread_counter_t* counter) {
+  if (_s_decrement_counter (thread_pool, counter)) _s_notify_waiters (thread_pool);
 }
 
 void rei_thread_pool_wait_all (rei_thread_pool_t* thread_pool) {
-  pthread_mutex_lock (thread_pool->task_queue.mutex);
+  pthread_mutex_lock (thread_pool->sleep_mutex);
 
-  for (;;) {
-    if (thread_pool->work_thread_count || thread_pool->task_queue.head) {
-      pthread_cond_wait (thread_pool->no_work_cond, thread_pool->task_queue.mutex);
-    } else {
-      break;
+  while (__atomic_load_n (&thread_pool->pending_task_count, __ATOMIC_SEQ_CST)) {
+    pthread_cond_wait (thread_pool->no_work_cond, thread_pool->sleep_mutex);
+  }
+
+  pthread_mutex_unlock (thread_pool->sleep_mutex);
+}
+
+void rei_thread_pool_wait_counter (rei_thread_pool_t* thread_pool, rei_thread_counter_t* counter) {
+  _s_thread_state_t* thread_state = _s_get_thread_state ();
+  rei_thread_fiber_t* fiber = thread_state->fiber;
+
+  if (fiber) {
+    _s_spin_lock (&counter->lock);
+
+    if (!__atomic_load_n (&counter->value, __ATOMIC_SEQ_CST)) {
+      _s_spin_unlock (&counter->lock);
+      return;
+    }
+
+    // Park the fiber on the counter and let the thread go on with other work. The lock is released by the scheduler
+    // once the fiber's context has been saved, lest it gets resumed somewhere else before that.
+    fiber->next = counter->waiters;
+    counter->waiters = fiber;
+
+    thread_state->suspend_lock = &counter->lock;
+    swapcontext (&fiber->context, &thread_state->scheduler_context);
+
+    // Resumed by whoever brought the counter to zero, possibly on another thread.
+    return;
+  }
+
+  rei_thread_worker_t* worker = thread_state->worker;
+  if (worker && worker->pool != thread_pool) worker = NULL;
+
+  while (__atomic_load_n (&counter->value, __ATOMIC_SEQ_CST)) {
+    // Help out instead of blocking, whatever gets run brings the counter closer to zero or unblocks someone else.
+    rei_thread_task_t* task = _s_find_task (thread_pool, worker);
+
+    if (task) {
+      _s_dispatch_task (thread_pool, task);
+      continue;
     }
+
+    // Remaining tasks are running on other threads, sleep until some counter hits zero or there's work to steal.
+    // The waiter count is published before queued count is checked (the other way around in _s_push_tasks), and
+    // producers broadcast under sleep_mutex, so a task added meanwhile either is seen here or wakes this thread.
+    pthread_mutex_lock (thread_pool->sleep_mutex);
+    __atomic_add_fetch (&thread_pool->waiting_thread_count, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n (&counter->value, __ATOMIC_SEQ_CST) && !__atomic_load_n (&thread_pool->queued_task_count, __ATOMIC_SEQ_CST)) {
+      pthread_cond_wait (thread_pool->no_work_cond, thread_pool->sleep_mutex);
+    }
+
+    __atomic_sub_fetch (&thread_pool->waiting_thread_count, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (thread_pool->sleep_mutex);
   }
 
-  pthread_mutex_unlock (thread_pool->task_queue.mutex);
+  // Whoever brought the counter to zero may still hold its lock, the counter is only free to go once it's released.
+  _s_spin_lock (&counter->lock);
+  _s_spin_unlock (&counter->lock);
+}
+
+static void _s_run_job (void* arg) {
+  rei_thread_job_t* job = (rei_thread_job_t*) arg;
+  job->action (job->arg);
+
+  // Seal the job first, so that no continuation can be attached behind our back while notifying.
+  _s_spin_lock (&job->lock);
+  job->is_sealed = REI_TRUE;
+  _s_spin_unlock (&job->lock);
+
+  for (u32 i = 0; i < job->continuation_count; ++i) {
+    rei_thread_job_t* continuation = job->continuations[i];
+    if (!__atomic_sub_fetch (&continuation->dependency_count, 1, __ATOMIC_ACQ_REL)) {
+      _s_push_task (
+        continuation->pool,
+        _s_run_job,
+        continuation,
+        continuation->counter,
+        continuation->priority,
+        continuation->runs_on_fiber
+      );
+    }
+  }
+
+  // Nothing may touch the job past this point, the owner is free to reuse it.
+  __atomic_store_n (&job->is_done, REI_TRUE, __ATOMIC_RELEASE);
+}
+
+void rei_thread_job_create (rei_thread_task_action_f action, void* arg, rei_thread_job_t* out) {
+  out->action = action;
+  out->arg = arg;
+  out->pool = NULL;
+  out->counter = NULL;
+  out->priority = REI_THREAD_PRIORITY_FRAME;
+  out->dependency_count = 1;
+  out->continuation_count = 0;
+  out->lock = 0;
+  out->is_sealed = REI_FALSE;
+  out->is_done = REI_FALSE;
+  out->runs_on_fiber = REI_FALSE;
+}
+
+void rei_thread_job_depend_on (rei_thread_job_t* job, rei_thread_job_t* parent) {
+  _s_spin_lock (&parent->lock);
+
+  // Finished parents have nothing to wait for.
+  if (!parent->is_sealed) {
+    REI_ASSERT (parent->continuation_count < REI_THREAD_JOB_MAX_CONTINUATIONS);
+
+    __atomic_add_fetch (&job->dependency_count, 1, __ATOMIC_RELAXED);
+    parent->continuations[parent->continuation_count++] = job;
+  }
+
+  _s_spin_unlock (&parent->lock);
+}
+
+void rei_thread_job_continue_with (rei_thread_job_t* job, rei_thread_job_t* continuation) {
+  rei_thread_job_depend_on (continuation, job);
+}
+
+void rei_thread_pool_submit_job (
+  rei_thread_pool_t* thread_pool,
+  rei_thread_job_t* job,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority) {
+
+  job->pool = thread_pool;
+  job->counter = counter;
+  job->priority = priority;
+
+  // The counter covers the job from submission on, not only once it gets scheduled.
+  if (counter) __atomic_add_fetch (&counter->value, 1, __ATOMIC_SEQ_CST);
+
+  // Drop the submission hold, whoever brings the count to zero schedules the job.
+  if (!__atomic_sub_fetch (&job->dependency_count, 1, __ATOMIC_ACQ_REL)) _s_push_task (thread_pool, _s_run_job, job, counter, priority, job->runs_on_fiber);
+}
+
+b32 rei_thread_job_is_done (const rei_thread_job_t* job) {
+  return __atomic_load_n (&job->is_done, __ATOMIC_ACQUIRE);
+}
+
+// Shared state of a single rei_parallel_for call, lives on the caller's stack.
+typedef struct _s_parallel_for_t {
+  rei_thread_range_action_f action;
+  void* ctx;
+  u64 begin;
+  u64 end;
+  u64 chunk_size;
+  u64 chunk_count;
+  u64 next_chunk;
+} _s_parallel_for_t;
+
+// Claim chunks until there are none left, so that fast threads pick up the slack of slow ones.
+static void _s_run_chunks (void* arg) {
+  _s_parallel_for_t* parallel_for = (_s_parallel_for_t*) arg;
+
+  for (;;) {
+    const u64 chunk = __atomic_fetch_add (&parallel_for->next_chunk, 1, __ATOMIC_RELAXED);
+    if (chunk >= parallel_for->chunk_count) break;
+
+    const u64 begin = parallel_for->begin + chunk * parallel_for->chunk_size;
+    const u64 end = parallel_for->end - begin > parallel_for->chunk_size ? begin + parallel_for->chunk_size : parallel_for->end;
+
+    parallel_for->action (begin, end, parallel_for->ctx);
+  }
+}
+
+void rei_parallel_for (rei_thread_pool_t* thread_pool, u64 begin, u64 end, u64 grain, rei_thread_range_action_f action, void* ctx) {
+  if (begin >= end) return;
+
+  // A few chunks per thread even out uneven iterations, grain keeps them from getting too small to be worth it.
+  const u64 count = end - begin;
+  u64 chunk_size = count / (thread_pool->thread_count * REI_THREAD_CHUNKS_PER_THREAD);
+  if (chunk_size < grain) chunk_size = grain;
+  if (!chunk_size) chunk_size = 1;
+
+  const u64 chunk_count = (count + chunk_size - 1) / chunk_size;
+
+  if (chunk_count == 1) {
+    action (begin, end, ctx);
+    return;
+  }
+
+  _s_parallel_for_t parallel_for = {
+    .action = action,
+    .ctx = ctx,
+    .begin = begin,
+    .end = end,
+    .chunk_size = chunk_size,
+    .chunk_count = chunk_count,
+    .next_chunk = 0
+  };
+
+  // Calling thread takes part too, so one runner less is needed.
+  const u32 runner_count = (u32) (chunk_count - 1 < thread_pool->thread_count ? chunk_count - 1 : thread_pool->thread_count);
+  rei_thread_counter_t counter = {.value = runner_count};
+
+  // Chunks inherit the priority of whatever is calling, so that a frame job going wide stays frame critical.
+  const rei_thread_priority_e priority = _s_get_thread_state ()->priority;
+  rei_thread_task_t* first = NULL;
+
+  for (u32 i = 0; i < runner_count; ++i) {
+    rei_thread_task_t* new_task = _s_acquire_task (thread_pool);
+    new_task->action = _s_run_chunks;
+    new_task->arg = &parallel_for;
+    new_task->counter = &counter;
+    new_task->priority = priority;
+    new_task->runs_on_fiber = REI_FALSE;
+    new_task->fiber = NULL;
+    new_task->next = first;
+    first = new_task;
+  }
+
+  _s_push_tasks (thread_pool, first, runner_count, priority);
+
+  _s_run_chunks (&parallel_for);
+  rei_thread_pool_wait_counter (thread_pool, &counter);
 }
@@ -1,34 +1,263 @@
 #ifndef REI_THREAD_H
 #define REI_THREAD_H
 
+#include <pthread.h>
+
 #include "rei_types.h"
 
+// Initial capacity of every worker's task deque (has to be a power of two), deques grow on demand.
+#define REI_THREAD_DEQUE_CAPACITY 256u
+// Number of tasks allocated at once whenever the pool runs out of free ones.
+#define REI_THREAD_TASK_BLOCK_SIZE 256u
+// Number of free tasks moved between a worker's local cache and the shared free list at once.
+#define REI_THREAD_TASK_BATCH_SIZE 32u
+// Maximum number of jobs that can wait for a single job.
+#define REI_THREAD_JOB_MAX_CONTINUATIONS 16u
+// Number of chunks rei_parallel_for aims to split its range into per thread.
+#define REI_THREAD_CHUNKS_PER_THREAD 4u
+// Number of frame tasks in a row after which a worker checks the streaming lane first.
+#define REI_THREAD_STARVATION_LIMIT 32u
+// Number of cycles (as counted by rdtsc) an idle worker polls for new work before going to sleep.
+#define REI_THREAD_SPIN_CYCLES 100000u
+// Stack size of fibers running fiber tasks, fibers are allocated on demand and recycled.
+#define REI_THREAD_FIBER_STACK_SIZE (256u * 1024u)
+
+// Lanes tasks are queued into, lower values are always drained first.
+typedef enum rei_thread_priority_e {
+  // Work the current frame is waiting for.
+  REI_THREAD_PRIORITY_FRAME,
+  // Background work (asset streaming, cooking) that may take several frames.
+  REI_THREAD_PRIORITY_STREAMING,
+  REI_THREAD_PRIORITY_COUNT,
+} rei_thread_priority_e;
+
+typedef enum rei_thread_pinning_e {
+  // Let the scheduler place workers wherever it wants.
+  REI_THREAD_PINNING_NONE,
+  // Every worker is bound to a physical core (and its SMT siblings).
+  REI_THREAD_PINNING_PHYSICAL_CORE,
+  // Every worker is bound to the CPUs sharing an L3 cache, workers are spread evenly across clusters.
+  REI_THREAD_PINNING_L3_CLUSTER,
+  // Every worker is bound to a single CPU out of rei_thread_pool_ci_t::cpu_list.
+  REI_THREAD_PINNING_CPU_LIST,
+} rei_thread_pinning_e;
+
+typedef struct rei_thread_pool_ci_t {
+  // Number of workers, zero means one per physical core (or per listed CPU with REI_THREAD_PINNING_CPU_LIST).
+  u32 thread_count;
+  rei_thread_pinning_e pinning;
+  // CPUs in the format of /sys/devices/system/cpu lists (e.g. "0-3,8-11"), only used with REI_THREAD_PINNING_CPU_LIST.
+  const char* cpu_list;
+  // Prefix of worker thread names (shown by top, perf, gdb), followed by the worker index. Defaults to "rei-worker".
+  const char* name;
+} rei_thread_pool_ci_t;
+
 typedef void (* rei_thread_task_action_f) (void* arg);
+// Processes [begin, end) part of a rei_parallel_for range.
+typedef void (* rei_thread_range_action_f) (u64 begin, u64 end, void* ctx);
+
+typedef struct rei_thread_fiber_t rei_thread_fiber_t;
+
+// Completion handle shared by any number of tasks or jobs, it reaches zero once all of them have finished.
+// Has to be zero initialized, waited on with rei_thread_pool_wait_counter (which also tells when it may be reused).
+typedef struct rei_thread_counter_t {
+  u32 value;
+  u32 lock;
+  // Fibers suspended until the value reaches zero.
+  rei_thread_fiber_t* waiters;
+} rei_thread_counter_t;
 
 typedef struct rei_thread_task_t {
   rei_thread_task_action_f action;
   void* arg;
+  rei_thread_counter_t* counter;
+  rei_thread_priority_e priority;
+  b32 runs_on_fiber;
+  // Suspended fiber to continue, NULL for tasks that haven't started yet.
+  rei_thread_fiber_t* fiber;
+  // Link in a free list, unused while the task is queued.
   struct rei_thread_task_t* next;
 } rei_thread_task_t;
 
+// Task memory is never returned to the system until the pool is destroyed, finished tasks are recycled instead.
+typedef struct rei_thread_task_block_t {
+  struct rei_thread_task_block_t* next;
+  rei_thread_task_t tasks[REI_THREAD_TASK_BLOCK_SIZE];
+} rei_thread_task_block_t;
+
+// Growable ring buffer of tasks owned by a single worker. The owner pushes and pops at the bottom (LIFO, so that
+// recently spawned work is still hot in cache), while idle workers steal from the top (FIFO, the oldest and usually biggest work).
+typedef struct rei_thread_deque_t {
+  u32 lock;
+  u32 mask;
+  // Highest number of tasks ever queued at once.
+  u32 max_depth;
+  u32 __padding;
+  u64 top;
+  u64 bottom;
+  rei_thread_task_t** tasks;
+} rei_thread_deque_t;
+
+// Counters are cumulative since the pool was created.
+typedef struct rei_thread_worker_stats_t {
+  u64 task_count;
+  // Time spent running tasks, and looking for / waiting on new ones.
+  u64 busy_ns;
+  u64 idle_ns;
+  // Number of times the worker was woken up after going to sleep.
+  u64 wake_up_count;
+  // Time spent waiting on contended deque, free list and counter locks.
+  u64 lock_wait_ns;
+  // Tasks taken from other workers' deques.
+  u64 steal_count;
+  // Highest number of tasks ever queued on the worker at once (filled in by rei_thread_pool_get_stats).
+  u32 max_queue_depth;
+  u32 __padding;
+} rei_thread_worker_stats_t;
+
+REI_IGNORE_WARN_START (-Wpadded)
+
+// Aligned to a cache line, lest workers false share each other's deque heads.
+typedef struct REI_ALIGN_AS (64) rei_thread_worker_t {
+  rei_thread_deque_t deques[REI_THREAD_PRIORITY_COUNT];
+  struct rei_thread_pool_t* pool;
+  pthread_t handle;
+  u32 index;
+  u32 random_state;
+
+  // Thread local cache of free tasks, only ever touched by the worker itself.
+  rei_thread_task_t* free_tasks;
+  u32 free_task_count;
+  // Frame tasks run in a row, see REI_THREAD_STARVATION_LIMIT.
+  u32 frame_streak;
+
+  rei_thread_worker_stats_t stats;
+} rei_thread_worker_t;
+
+REI_IGNORE_WARN_STOP
+
+// Node of a job graph. Job memory is owned by the caller and has to outlive the job (see rei_thread_job_is_done).
+// A job is run once all of its parents have finished and it has been submitted.
+typedef struct rei_thread_job_t {
+  rei_thread_task_action_f action;
+  void* arg;
+  struct rei_thread_pool_t* pool;
+  rei_thread_counter_t* counter;
+  rei_thread_priority_e priority;
+
+  // Parents that have not finished yet, plus one held until the job is submitted.
+  u32 dependency_count;
+  u32 continuation_count;
+  u32 lock;
+  // Set once the job has finished running and no new continuations can be attached to it.
+  b32 is_sealed;
+  b32 is_done;
+  // Set before submitting to run the job on a fiber (see rei_thread_pool_add_fiber_task).
+  b32 runs_on_fiber;
+  u32 __padding;
+
+  struct rei_thread_job_t* continuations[REI_THREAD_JOB_MAX_CONTINUATIONS];
+} rei_thread_job_t;
+
 typedef struct rei_thread_pool_t {
+  rei_thread_worker_t* workers;
+
+  // Free tasks shared between workers and outside threads.
   struct {
+    u32 lock;
+    u32 __padding;
     rei_thread_task_t* head;
-    rei_thread_task_t* tail;
-    pthread_mutex_t* mutex;
-  } task_queue;
+    rei_thread_task_block_t* blocks;
+  } free_tasks;
 
-  pthread_cond_t* has_work_cond;
+  // Fibers are shared by all workers and never freed until the pool is destroyed.
+  struct {
+    u32 lock;
+    u32 __padding;
+    rei_thread_fiber_t* head;
+    rei_thread_fiber_t* allocated;
+  } free_fibers;
+
+  // Only used by threads waiting for tasks to finish, workers sleep on work_epoch.
+  pthread_mutex_t* sleep_mutex;
   pthread_cond_t* no_work_cond;
   u64 thread_count;
-  u32 work_thread_count;
+
+  // Tasks that were added, but not yet picked up by any worker.
+  u32 queued_task_count;
+  // Tasks that were added, but not yet finished.
+  u32 pending_task_count;
+  u32 sleeping_thread_count;
+  // Threads asleep in rei_thread_pool_wait_counter, woken through no_work_cond whenever tasks are added.
+  u32 waiting_thread_count;
+  // Event count (futex word) bumped whenever sleeping workers have to be woken up.
+  u32 work_epoch;
+  // Round robin cursor for tasks added from outside of the pool.
+  u32 next_worker_index;
+  u32 spin_cycles;
   b32 has_to_quit;
 } rei_thread_pool_t;
 
-void rei_thread_pool_create (rei_thread_pool_t* out);
+typedef struct rei_thread_pool_stats_t {
+  u32 worker_count;
+  u32 queued_task_count;
+  u32 pending_task_count;
+  u32 sleeping_thread_count;
+  // Provided by the caller, has to hold rei_thread_pool_t::thread_count entries.
+  rei_thread_worker_stats_t* workers;
+} rei_thread_pool_stats_t;
+
+void rei_thread_pool_create (const rei_thread_pool_ci_t* create_info, rei_thread_pool_t* out);
 void rei_thread_pool_destroy (rei_thread_pool_t* thread_pool);
 
-void rei_thread_pool_add_task (rei_thread_pool_t* thread_pool, rei_thread_task_action_f action, void* restrict arg);
+// Take a snapshot of the pool's telemetry, safe to call from any thread at any time.
+void rei_thread_pool_get_stats (const rei_thread_pool_t* thread_pool, rei_thread_pool_stats_t* out);
+
+// Counter is optional, pass NULL for fire and forget tasks.
+void rei_thread_pool_add_task (
+  rei_thread_pool_t* thread_pool,
+  rei_thread_task_action_f action,
+  void* restrict arg,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority
+);
+
+// Same as above, but the task runs on a fiber of its own. Waiting on a counter inside of it suspends the fiber
+// and lets the worker go on with other tasks, so it may be written as straight line code waiting for its sub tasks.
+void rei_thread_pool_add_fiber_task (
+  rei_thread_pool_t* thread_pool,
+  rei_thread_task_action_f action,
+  void* restrict arg,
+  rei_thread_counter_t* counter,
+  rei_thread_priority_e priority
+);
+
+// Account for work the pool doesn't know about (e.g. I/O requests in flight), every increment has to be matched
+// by a rei_thread_pool_decrement_counter call. Decrementing is safe from any thread, including ones outside of the pool.
+void rei_thread_counter_increment (rei_thread_counter_t* counter, u32 amount);
+void rei_thread_pool_decrement_counter (rei_thread_pool_t* thread_pool, rei_thread_counter_t* counter);
+
+// Wait until the whole pool goes idle. Blocks the whole thread, even on a fiber.
 void rei_thread_pool_wait_all (rei_thread_pool_t* thread_pool);
+// Wait only for the tasks tied to counter. On a fiber, the fiber is suspended until the counter reaches zero.
+// Anywhere else, the calling thread runs queued tasks in the meantime instead of sleeping.
+void rei_thread_pool_wait_counter (rei_thread_pool_t* thread_pool, rei_thread_counter_t* counter);
+
+// Split [begin, end) into chunks of at least grain iterations and run them across the pool, returns once all are done.
+// All chunk tasks are queued at once with the priority of the calling task, the calling thread processes chunks as well.
+void rei_parallel_for (rei_thread_pool_t* thread_pool, u64 begin, u64 end, u64 grain, rei_thread_range_action_f action, void* ctx);
+
+void rei_thread_job_create (rei_thread_task_action_f action, void* arg, rei_thread_job_t* out);
+
+// Make job wait for parent to finish. Job must not be submitted yet, parent may be in any state.
+void rei_thread_job_depend_on (rei_thread_job_t* job, rei_thread_job_t* parent);
+// Same as above, but from the parent's point of view (e.g. for a running job to attach work that has to run after it).
+void rei_thread_job_continue_with (rei_thread_job_t* job, rei_thread_job_t* continuation);
+
+// Hand job over to the pool, it will be run as soon as all of its parents are done. Counter is optional.
+void rei_thread_pool_submit_job (rei_thread_pool_t* thread_pool, rei_thread_job_t* job, rei_thread_counter_t* counter, rei_thread_priority_e priority);
+
+// True once the job has run and notified its continuations, after which its memory may be reused.
+b32 rei_thread_job_is_done (const rei_thread_job_t* job);
 
 #endif /* REI_THREAD_H */
@@ -35,7 +35,9 @@ typedef enum rei_result_e {
   REI_RESULT_INVALID_JSON,
   REI_RESULT_INVALID_FILE_PATH,
   REI_RESULT_FILE_DOES_NOT_EXIST,
-  REI_RESULT_UNSUPPORTED_FILE_TYPE
+  REI_RESULT_UNSUPPORTED_FILE_TYPE,
+  REI_RESULT_IO_ERROR,
+  REI_RESULT_INVALID_IMAGE
 } rei_result_e;
 
 typedef struct rei_vec2_t {f32 x, y;} rei_vec2_t;
@@ -0,0 +1,263 @@
+#include <memory.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "rei_vfs.h"
+#include "rei_hash.h"
+#include "rei_debug.h"
+
+#include <lz4/lib/lz4.h>
+
+#define _S_ALIGN_UP(__value) (((__value) + REI_VFS_ALIGNMENT - 1u) & ~((u64) REI_VFS_ALIGNMENT - 1u))
+
+static u32 _s_hash_path (const char* const relative_path) {
+  return rei_murmur_hash ((const u8*) relative_path, strlen (relative_path), REI_VFS_HASH_SEED);
+}
+
+static s32 _s_compare_entries (const void* a, const void* b) {
+  const u32 a_hash = ((const rei_vfs_entry_t*) a)->path_hash;
+  const u32 b_hash = ((const rei_vfs_entry_t*) b)->path_hash;
+
+  return (a_hash > b_hash) - (a_hash < b_hash);
+}
+
+// Entries are handed out as pointers into the mapping, make sure none of them points past its end. Lookups rely on the
+// table being sorted.
+static b8 _s_is_valid_pack (const rei_vfs_t* vfs) {
+  const u64 file_size = vfs->mapped_file.size;
+  b8 is_valid = sizeof (rei_vfs_header_t) + sizeof *vfs->entries * (u64) vfs->entry_count <= file_size;
+
+  for (u32 i = 0; is_valid && i < vfs->entry_count; ++i) {
+    const rei_vfs_entry_t* entry = &vfs->entries[i];
+    const b8 is_compressed = (entry->flags & REI_VFS_ENTRY_FLAG_LZ4) != 0;
+
+    is_valid = (u64) entry->path_offset + entry->path_length <= file_size &&
+      entry->offset <= file_size && entry->stored_size <= file_size - entry->offset &&
+      (is_compressed ? entry->size <= LZ4_MAX_INPUT_SIZE : entry->stored_size == entry->size) &&
+      (!i || vfs->entries[i - 1].path_hash < entry->path_hash);
+  }
+
+  return is_valid;
+}
+
+rei_result_e rei_vfs_create (const char* const relative_path, rei_vfs_t* out) {
+  const rei_result_e result = rei_read_file (relative_path, REI_FILE_HINT_NONE, &out->mapped_file);
+  if (result) return result;
+
+  const rei_vfs_header_t* header = out->mapped_file.data;
+
+  if (out->mapped_file.size < sizeof *header || header->magic != REI_VFS_MAGIC || header->version != REI_VFS_VERSION) {
+    rei_free_file (&out->mapped_file);
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
+
+  out->entry_count = header->entry_count;
+  out->entries = (const rei_vfs_entry_t*) (header + 1);
+
+  if (!_s_is_valid_pack (out)) {
+    rei_free_file (&out->mapped_file);
+    return REI_RESULT_UNSUPPORTED_FILE_TYPE;
+  }
+
+  return REI_RESULT_SUCCESS;
+}
+
+void rei_vfs_destroy (rei_vfs_t* vfs) {
+  rei_free_file (&vfs->mapped_file);
+}
+
+rei_result_e rei_vfs_open (const rei_vfs_t* vfs, const char* const relative_path, rei_vfs_file_t* out) {
+  const u32 path_hash = _s_hash_path (relative_path);
+
+  u32 low = 0;
+  u32 high = vfs->entry_count;
+
+  while (low < high) {
+    const u32 middle = low + ((high - low) >> 1u);
+    const rei_vfs_entry_t* entry = &vfs->entries[middle];
+
+    if (entry->path_hash < path_hash) {
+      low = middle + 1;
+    } else if (entry->path_hash > path_hash) {
+      high = middle;
+    } else {
+      // Paths outside the pack may share a hash with one inside, packed paths never share one among themselves.
+      const char* packed_path = (const char*) vfs->mapped_file.data + entry->path_offset;
+      if (entry->path_length != strlen (relative_path) || memcmp (packed_path, relative_path, entry->path_length)) break;
+
+      out->data = (const u8*) vfs->mapped_file.data + entry->offset;
+      out->size = entry->size;
+      out->stored_size = entry->stored_size;
+      out->is_compressed = (entry->flags & REI_VFS_ENTRY_FLAG_LZ4) != 0;
+
+      return REI_RESULT_SUCCESS;
+    }
+  }
+
+  return REI_RESULT_FILE_DOES_NOT_EXIST;
+}
+
+rei_result_e rei_vfs_read (const rei_vfs_file_t* file, void* dst) {
+  if (!file->is_compressed) {
+    memcpy (dst, file->data, file->size);
+    return REI_RESULT_SUCCESS;
+  }
+
+  const s32 decompressed_size = LZ4_decompress_safe (file->data, dst, (s32) file->stored_size, (s32) file->size);
+  return decompressed_size == (s32) file->size ? REI_RESULT_SUCCESS : REI_RESULT_IO_ERROR;
+}
+
+rei_result_e rei_vfs_load (const rei_vfs_t* vfs, const char* const relative_path, u32 hints, rei_file_t* out) {
+  rei_vfs_file_t file;
+  if (!vfs || rei_vfs_open (vfs, relative_path, &file)) return rei_read_file (relative_path, hints, out);
+
+  out->size = file.size;
+
+  if (!file.is_compressed) {
+    out->fd = REI_FILE_VIEW_FD;
+    out->data = (void*) file.data;
+
+    // Entries are page aligned, hints don't spill over to their neighbours.
+    rei_advise_file (out, 0, out->size, hints);
+    return REI_RESULT_SUCCESS;
+  }
+
+  out->fd = REI_FILE_HEAP_FD;
+  out->data = malloc (file.size);
+
+  const rei_result_e result = rei_vfs_read (&file, out->data);
+  if (result) free (out->data);
+
+  return result;
+}
+
+// Read a file to be packed, compressing it into scratch (grown as needed) if asked to and if that makes it smaller.
+// On success, contents points to what should be stored and the file has to be freed by the caller.
+static rei_result_e _s_load_pack_entry (
+  const rei_vfs_pack_entry_t* pack_entry,
+  rei_file_t* file,
+  char** scratch,
+  u64* scratch_size,
+  rei_vfs_entry_t* out,
+  const void** contents) {
+
+  const rei_result_e result = rei_read_file (pack_entry->relative_path, REI_FILE_HINT_SEQUENTIAL, file);
+  if (result) return result;
+
+  out->flags = 0;
+  out->size = out->stored_size = file->size;
+  *contents = file->data;
+
+  // LZ4 works on blocks of at most LZ4_MAX_INPUT_SIZE bytes, bigger files are always stored as is.
+  if (!pack_entry->compress || !file->size || file->size > LZ4_MAX_INPUT_SIZE) return REI_RESULT_SUCCESS;
+
+  const s32 compressed_bound = LZ4_compressBound ((s32) file->size);
+  if ((u64) compressed_bound > *scratch_size) {
+    *scratch_size = (u64) compressed_bound;
+    *scratch = realloc (*scratch, *scratch_size);
+  }
+
+  const s32 compressed_size = LZ4_compress_default (file->data, *scratch, (s32) file->size, compressed_bound);
+  if (compressed_size > 0 && (u64) compressed_size < file->size) {
+    out->flags |= REI_VFS_ENTRY_FLAG_LZ4;
+    out->stored_size = (u64) compressed_size;
+    *contents = *scratch;
+  }
+
+  return REI_RESULT_SUCCESS;
+}
+
+rei_result_e rei_vfs_pack (const rei_vfs_pack_entry_t* entries, u32 entry_count, const char* const out_path) {
+  static const u8 zeros[REI_VFS_ALIGNMENT];
+
+  rei_result_e result = REI_RESULT_SUCCESS;
+
+  // Table of contents in the order of entries, and as it's written (sorted by path hash).
+  rei_vfs_entry_t* toc = malloc (sizeof *toc * entry_count);
+  rei_vfs_entry_t* sorted = malloc (sizeof *sorted * entry_count);
+
+  // Compressed contents of the entry at hand, files are only ever held one at a time.
+  char* scratch = NULL;
+  u64 scratch_size = 0;
+
+  const u64 toc_size = sizeof (rei_vfs_header_t) + sizeof *toc * entry_count;
+  u64 path_offset = toc_size;
+
+  for (u32 i = 0; i < entry_count; ++i) {
+    toc[i].path_hash = _s_hash_path (entries[i].relative_path);
+    toc[i].path_offset = (u32) path_offset;
+    toc[i].path_length = (u32) strlen (entries[i].relative_path);
+    path_offset += toc[i].path_length;
+  }
+
+  // The table comes first, so stored sizes are worked out in a first pass over the files. The second one compresses
+  // them again while streaming them out, instead of holding on to every file until the end.
+  u64 pack_size = _S_ALIGN_UP (path_offset);
+
+  for (u32 i = 0; !result && i < entry_count; ++i) {
+    rei_file_t file;
+    const void* contents;
+
+    result = _s_load_pack_entry (&entries[i], &file, &scratch, &scratch_size, &toc[i], &contents);
+    if (result) break;
+
+    rei_free_file (&file);
+
+    toc[i].offset = pack_size;
+    pack_size = _S_ALIGN_UP (pack_size + toc[i].stored_size);
+  }
+
+  // Entries keep their offsets, only the table gets sorted for lookups.
+  memcpy (sorted, toc, sizeof *toc * entry_count);
+  qsort (sorted, entry_count, sizeof *sorted, _s_compare_entries);
+
+  for (u32 i = 1; !result && i < entry_count; ++i) {
+    if (sorted[i].path_hash == sorted[i - 1].path_hash) {
+      REI_LOG_ERROR ("Path hash collision (0x%08x) while packing " REI_ANSI_YELLOW "\"%s\"", sorted[i].path_hash, out_path);
+      result = REI_RESULT_INVALID_FILE_PATH;
+    }
+  }
+
+  rei_file_writer_t writer;
+  if (!result) result = rei_open_file_writer (out_path, &writer);
+
+  if (!result) {
+    const rei_vfs_header_t header = {.magic = REI_VFS_MAGIC, .version = REI_VFS_VERSION, .entry_count = entry_count};
+    rei_append_file (&writer, &header, sizeof header);
+
+    rei_append_file (&writer, sorted, sizeof *sorted * entry_count);
+    for (u32 i = 0; i < entry_count; ++i) rei_append_file (&writer, entries[i].relative_path, toc[i].path_length);
+
+    for (u32 i = 0; !writer.result && i < entry_count; ++i) {
+      rei_append_file (&writer, zeros, toc[i].offset - writer.offset - writer.buffered_size);
+
+      rei_file_t file;
+      rei_vfs_entry_t entry;
+      const void* contents;
+
+      const rei_result_e load_result = _s_load_pack_entry (&entries[i], &file, &scratch, &scratch_size, &entry, &contents);
+      if (load_result) {
+        writer.result = load_result;
+        break;
+      }
+
+      // Files changing in between the passes would no longer fit their slots.
+      if (entry.stored_size == toc[i].stored_size && entry.flags == toc[i].flags) {
+        rei_append_file (&writer, contents, entry.stored_size);
+      } else {
+        writer.result = REI_RESULT_IO_ERROR;
+      }
+
+      rei_free_file (&file);
+    }
+
+    rei_append_file (&writer, zeros, pack_size - writer.offset - writer.buffered_size);
+    result = rei_close_file_writer (&writer, NULL);
+  }
+
+  free (scratch);
+  free (sorted);
+  free (toc);
+
+  return result;
+}
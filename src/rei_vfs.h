@@ -0,0 +1,82 @@
+#ifndef REI_VFS_H
+#define REI_VFS_H
+
+#include "rei_file.h"
+
+// "RPAK" read as a little endian u32.
+#define REI_VFS_MAGIC 0x4b415052u
+#define REI_VFS_VERSION 2u
+// Entries start on page boundaries, so that their contents can be advised, prefetched or mapped on their own.
+#define REI_VFS_ALIGNMENT 4096u
+#define REI_VFS_HASH_SEED 0u
+
+typedef enum rei_vfs_entry_flags_e {
+  REI_VFS_ENTRY_FLAG_LZ4 = 1u << 0u,
+} rei_vfs_entry_flags_e;
+
+// Pack layout: header, table of contents sorted by path hash, the paths entries were packed under, then entry contents.
+typedef struct rei_vfs_header_t {
+  u32 magic;
+  u32 version;
+  u32 entry_count;
+  u32 __padding;
+} rei_vfs_header_t;
+
+typedef struct rei_vfs_entry_t {
+  // rei_murmur_hash of the path the entry was packed under, with REI_VFS_HASH_SEED.
+  u32 path_hash;
+  u32 flags;
+  // The path itself (without a terminating zero) for telling apart paths with the same hash, relative to the start of
+  // the pack.
+  u32 path_offset;
+  u32 path_length;
+  // Relative to the start of the pack.
+  u64 offset;
+  // Size of the original file and size of what's stored in the pack (smaller if compressed).
+  u64 size;
+  u64 stored_size;
+} rei_vfs_entry_t;
+
+typedef struct rei_vfs_t {
+  rei_file_t mapped_file;
+  u32 entry_count;
+  u32 __padding;
+  const rei_vfs_entry_t* entries;
+} rei_vfs_t;
+
+// Contents of a single packed file, only valid as long as the pack stays mapped.
+typedef struct rei_vfs_file_t {
+  const void* data;
+  u64 size;
+  u64 stored_size;
+  b32 is_compressed;
+  u32 __padding;
+} rei_vfs_file_t;
+
+typedef struct rei_vfs_pack_entry_t {
+  const char* relative_path;
+  // Try to LZ4 the file, it's stored as is if that doesn't make it smaller (e.g. for rtex files).
+  b32 compress;
+  u32 __padding;
+} rei_vfs_pack_entry_t;
+
+// Map a pack created by rei_vfs_pack, lookups don't touch the file system afterwards. Packs with a table of contents
+// pointing outside of the file are reported as REI_RESULT_UNSUPPORTED_FILE_TYPE.
+rei_result_e rei_vfs_create (const char* const relative_path, rei_vfs_t* out);
+void rei_vfs_destroy (rei_vfs_t* vfs);
+
+// Find a packed file by the path it was packed under (binary search over the table of contents, then a comparison
+// with the packed path).
+rei_result_e rei_vfs_open (const rei_vfs_t* vfs, const char* const relative_path, rei_vfs_file_t* out);
+// Copy or decompress file contents into dst, which has to hold file->size bytes.
+rei_result_e rei_vfs_read (const rei_vfs_file_t* file, void* dst);
+
+// Get file contents as a rei_file_t: a view into the pack if stored as is, decompressed into heap memory otherwise.
+// Falls back to reading from disk if vfs is NULL or the file isn't packed. Release with rei_free_file either way.
+// hints (rei_file_hint_e flags) apply to views and files read from disk alike.
+rei_result_e rei_vfs_load (const rei_vfs_t* vfs, const char* const relative_path, u32 hints, rei_file_t* out);
+
+// Pack files into a single archive at out_path.
+rei_result_e rei_vfs_pack (const rei_vfs_pack_entry_t* entries, u32 entry_count, const char* const out_path);
+
+#endif /* REI_VFS_H */
@@ -8,7 +8,6 @@
 #include "rei_defines.h"
 
 #include <pthread.h>
-#include <lz4/lib/lz4.h>
 #include <ktx/include/ktx.h>
 #include <VulkanMemoryAllocator/include/vk_mem_alloc.h>
 
@@ -122,11 +121,15 @@ void _s_choose_gpu (rei_vk_instance_t* out) {
     REI_VK_CHECK (vkGetPhysicalDeviceSurfaceFormatsKHR (current, out->surface, &format_count, NULL));
     REI_VK_CHECK (vkGetPhysicalDeviceSurfacePresentModesKHR (current, out->surface, &present_mode_count, NULL));
 
+    // Cooked textures are block compressed.
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures (current, &features);
+
     struct _s_queue_indices_t indices;
     const b8 supports_swapchain = format_count && present_mode_count;
     const b8 has_queue_families = _s_find_queue_indices (current, out->surface, &indices);
 
-    if (has_queue_families && supports_swapchain && (matched_ext_count == required_ext_count)) {
+    if (has_queue_families && supports_swapchain && features.textureCompressionBC && (matched_ext_count == required_ext_count)) {
       out->gpu = current;
       break;
     }
@@ -195,6 +198,7 @@ void _s_set_image_layout_cmd (
     (old_layout == VK_IMAGE_LAYOUT_UNDEFINED
     || old_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
     || old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+    || old_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
     )
     &&
     (new_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
@@ -232,6 +236,43 @@ void _s_set_image_layout_cmd (
 }
 
 
+static VkFormat _s_get_texture_format (const rei_texture_header_t* header) {
+  const b32 is_srgb = header->flags & REI_TEXTURE_FLAG_SRGB;
+
+  switch (header->format) {
+    case REI_TEXTURE_FORMAT_RGBA8: return is_srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+    // BC1 blocks are always written in the 4 color mode, there's no alpha to speak of.
+    case REI_TEXTURE_FORMAT_BC1: return is_srgb ? VK_FORMAT_BC1_RGB_SRGB_BLOCK : VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+    case REI_TEXTURE_FORMAT_BC3: return is_srgb ? VK_FORMAT_BC3_SRGB_BLOCK : VK_FORMAT_BC3_UNORM_BLOCK;
+    case REI_TEXTURE_FORMAT_BC7: return is_srgb ? VK_FORMAT_BC7_SRGB_BLOCK : VK_FORMAT_BC7_UNORM_BLOCK;
+    // No sRGB variants, see rei_vk_is_srgb_in_shader.
+    case REI_TEXTURE_FORMAT_BC4: return VK_FORMAT_BC4_UNORM_BLOCK;
+    case REI_TEXTURE_FORMAT_BC5: return VK_FORMAT_BC5_UNORM_BLOCK;
+    case REI_TEXTURE_FORMAT_R8: return VK_FORMAT_R8_UNORM;
+    case REI_TEXTURE_FORMAT_RG8: return VK_FORMAT_R8G8_UNORM;
+    default: REI_ASSERT (!"Unknown texture format"); return VK_FORMAT_UNDEFINED;
+  }
+}
+
+static VkComponentMapping _s_get_texture_swizzle (const rei_texture_header_t* header) {
+  static const VkComponentSwizzle swizzles[] = {
+    [REI_TEXTURE_SWIZZLE_R] = VK_COMPONENT_SWIZZLE_R,
+    [REI_TEXTURE_SWIZZLE_G] = VK_COMPONENT_SWIZZLE_G,
+    [REI_TEXTURE_SWIZZLE_B] = VK_COMPONENT_SWIZZLE_B,
+    [REI_TEXTURE_SWIZZLE_A] = VK_COMPONENT_SWIZZLE_A,
+    [REI_TEXTURE_SWIZZLE_ZERO] = VK_COMPONENT_SWIZZLE_ZERO,
+    [REI_TEXTURE_SWIZZLE_ONE] = VK_COMPONENT_SWIZZLE_ONE,
+  };
+
+  VkComponentSwizzle components[4];
+  for (u32 i = 0; i < 4u; ++i) {
+    REI_ASSERT (header->swizzle[i] < REI_ARRAY_SIZE (swizzles));
+    components[i] = swizzles[header->swizzle[i]];
+  }
+
+  return (VkComponentMapping) {.r = components[0], .g = components[1], .b = components[2], .a = components[3]};
+}
+
 static void _s_copy_buffer_to_image_cmd (
   VkCommandBuffer cmd_buffer,
   const rei_vk_buffer_t* src,
@@ -255,8 +296,8 @@ static void _s_copy_buffer_to_image_cmd (
     current->imageOffset.x = 0;
     current->imageOffset.y = 0;
     current->imageOffset.z = 0;
-    current->imageExtent.width = width >> i;
-    current->imageExtent.height = height >> i;
+    current->imageExtent.width = REI_MAX (width >> i, 1u);
+    current->imageExtent.height = REI_MAX (height >> i, 1u);
     current->imageExtent.depth = 1;
   }
 
@@ -421,7 +462,7 @@ void rei_vk_create_device (const rei_vk_instance_t* instance, rei_vk_device_t* o
     .ppEnabledLayerNames = NULL,
     .enabledExtensionCount = enabled_ext_count,
     .ppEnabledExtensionNames = enabled_ext,
-    .pEnabledFeatures = &(VkPhysicalDeviceFeatures) {0},
+    .pEnabledFeatures = &(VkPhysicalDeviceFeatures) {.textureCompressionBC = VK_TRUE},
   };
 
   REI_VK_CHECK (vkCreateDevice (instance->gpu, &create_info, NULL, &out->handle));
@@ -522,13 +563,8 @@ void rei_vk_create_image (
     .format = create_info->format,
     .viewType = VK_IMAGE_VIEW_TYPE_2D,
     .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-
-    .components.r = VK_COMPONENT_SWIZZLE_R,
-    .components.g = VK_COMPONENT_SWIZZLE_G,
-    .components.b = VK_COMPONENT_SWIZZLE_B,
-    .components.a = VK_COMPONENT_SWIZZLE_A,
-
-    .subresourceRange.levelCount = 1,
+    .components = create_info->swizzle,
+    .subresourceRange.levelCount = create_info->mip_levels,
     .subresourceRange.layerCount = 1,
     .subresourceRange.baseMipLevel = 0,
     .subresourceRange.baseArrayLayer = 0,
@@ -950,7 +986,7 @@ void rei_vk_destroy_frame_data (const rei_vk_device_t* device, rei_vk_frame_data
 
 void rei_vk_create_shader_module (const rei_vk_device_t* device, const char* relative_path, VkShaderModule* out) {
   rei_file_t shader_code;
-  REI_CHECK (rei_read_file (relative_path, &shader_code));
+  REI_CHECK (rei_read_file (relative_path, REI_FILE_HINT_NONE, &shader_code));
 
   VkShaderModuleCreateInfo create_info = {
     .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
@@ -990,7 +1026,7 @@ void rei_vk_create_pipeline_cache (const rei_vk_device_t* device, const char* re
   void* cache_data = NULL;
 
   rei_file_t cache_file;
-  switch (rei_read_file (relative_path, &cache_file)) {
+  switch (rei_read_file (relative_path, REI_FILE_HINT_NONE, &cache_file)) {
     case REI_RESULT_SUCCESS:
       REI_LOG_INFO ("Reusing pipeline cache from %s...", relative_path);
       cache_size = cache_file.size;
@@ -1024,7 +1060,7 @@ void rei_vk_destroy_pipeline_cache (const rei_vk_device_t* device, VkPipelineCac
   void* cache_data = alloca (cache_size);
   REI_VK_CHECK (vkGetPipelineCacheData (device->handle, cache, &cache_size, cache_data));
 
-  rei_write_file (out_relative_path, cache_data, cache_size);
+  if (rei_write_file (out_relative_path, cache_data, cache_size)) REI_LOG_WARN ("Failed to save pipeline cache to %s.", out_relative_path);
   vkDestroyPipelineCache (device->handle, cache, NULL);
 }
 
@@ -1309,37 +1345,81 @@ void rei_vk_copy_buffer_cmd (
   vkCmdCopyBuffer (cmd_buffer, src->handle, dst->handle, 1, &copy_info);
 }
 
-void rei_vk_create_texture_cmd (
+rei_result_e rei_vk_create_texture (
   const rei_vk_device_t* device,
   rei_vk_allocator_t* allocator,
-  VkCommandBuffer cmd_buffer,
+  rei_thread_pool_t* thread_pool,
   rei_vk_buffer_t* staging_buffer,
   const rei_texture_t* src,
+  u32 first_mip,
+  u32 staged_mip_count,
+  rei_vk_texture_upload_t* upload,
   rei_vk_image_t* out) {
 
-  REI_ASSERT (src->component_count == 3 || src->component_count == 4);
+  const rei_texture_header_t* header = src->header;
+
+  upload->width = REI_MAX (header->width >> first_mip, 1u);
+  upload->height = REI_MAX (header->height >> first_mip, 1u);
+  upload->mip_count = header->mip_count - first_mip;
+  upload->staged_mip_count = staged_mip_count;
+
+  if (staged_mip_count) {
+    // Levels are packed back to back, each one starting on a texel boundary as vkCmdCopyBufferToImage requires.
+    u64 staging_size = 0;
+    for (u32 i = 0; i < staged_mip_count; ++i) {
+      upload->offsets[i] = staging_size;
+      staging_size = (staging_size + header->mips[first_mip + i].size + REI_TEXTURE_ALIGNMENT - 1u) & ~(u64) (REI_TEXTURE_ALIGNMENT - 1u);
+    }
+
+    rei_vk_create_buffer (allocator, staging_size, REI_VK_BUFFER_TYPE_STAGING, staging_buffer);
+    rei_vk_map_buffer (allocator, staging_buffer);
 
-  const u64 image_size = src->width * src->height * src->component_count;
-  rei_vk_create_buffer (allocator, image_size, REI_VK_BUFFER_TYPE_STAGING, staging_buffer);
+    const rei_result_e result = rei_texture_unpack (thread_pool, src, first_mip, staged_mip_count, upload->offsets, staging_buffer->mapped);
 
-  rei_vk_map_buffer (allocator, staging_buffer);
-  LZ4_decompress_safe (src->compressed_data, (char*) staging_buffer->mapped, (s32) src->compressed_size, (s32) image_size);
-  rei_vk_unmap_buffer (allocator, staging_buffer);
+    rei_vk_unmap_buffer (allocator, staging_buffer);
+
+    if (result) {
+      rei_vk_destroy_buffer (allocator, staging_buffer);
+      return result;
+    }
+  }
 
   rei_vk_create_image (
     device,
     allocator,
     &(const rei_vk_image_ci_t) {
-      .width = src->width,
-      .height = src->height,
-      .mip_levels = 1,
-      .format = src->component_count == 3 ? VK_FORMAT_R8G8B8_SRGB : VK_FORMAT_R8G8B8A8_SRGB,
-      .usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+      .width = upload->width,
+      .height = upload->height,
+      .mip_levels = upload->mip_count,
+      .format = _s_get_texture_format (header),
+      .swizzle = _s_get_texture_swizzle (header),
+      // Later images of the same texture may take levels over from this one.
+      .usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
       .aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT,
     },
     out
   );
 
+  return REI_RESULT_SUCCESS;
+}
+
+b32 rei_vk_is_srgb_in_shader (const rei_texture_header_t* header) {
+  const b32 has_srgb_format = header->format != REI_TEXTURE_FORMAT_BC4 &&
+    header->format != REI_TEXTURE_FORMAT_BC5 &&
+    header->format != REI_TEXTURE_FORMAT_R8 &&
+    header->format != REI_TEXTURE_FORMAT_RG8;
+
+  return (header->flags & REI_TEXTURE_FLAG_SRGB) && !has_srgb_format;
+}
+
+void rei_vk_upload_texture_cmd (
+  VkCommandBuffer cmd_buffer,
+  const rei_vk_buffer_t* staging_buffer,
+  const rei_vk_texture_upload_t* upload,
+  rei_vk_image_t* previous,
+  u32 previous_mip_count,
+  rei_vk_image_t* out) {
+
   _s_set_image_layout_cmd (
     cmd_buffer,
     out,
@@ -1347,11 +1427,75 @@ void rei_vk_create_texture_cmd (
     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
     VK_PIPELINE_STAGE_HOST_BIT,
     VK_PIPELINE_STAGE_TRANSFER_BIT,
-    1,
+    upload->mip_count,
     0
   );
 
-  _s_copy_buffer_to_image_cmd (cmd_buffer, staging_buffer, out, (const u64[]) {0}, src->width, src->height, 1);
+  // Every staged level in a single copy.
+  if (upload->staged_mip_count) {
+    _s_copy_buffer_to_image_cmd (cmd_buffer, staging_buffer, out, upload->offsets, upload->width, upload->height, upload->staged_mip_count);
+  }
+
+  if (upload->staged_mip_count < upload->mip_count) {
+    const u32 kept_mip_count = upload->mip_count - upload->staged_mip_count;
+    const u32 previous_first_mip = previous_mip_count - kept_mip_count;
+
+    REI_ASSERT (previous && previous_mip_count >= kept_mip_count);
+
+    // Frames submitted earlier may still sample previous, the barriers wait for them.
+    _s_set_image_layout_cmd (
+      cmd_buffer,
+      previous,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      kept_mip_count,
+      previous_first_mip
+    );
+
+    VkImageCopy* copy_infos = alloca (sizeof *copy_infos * kept_mip_count);
+
+    for (u32 i = 0; i < kept_mip_count; ++i) {
+      const u32 mip_level = upload->staged_mip_count + i;
+
+      VkImageCopy* current = &copy_infos[i];
+      current->srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      current->srcSubresource.mipLevel = previous_first_mip + i;
+      current->srcSubresource.baseArrayLayer = 0;
+      current->srcSubresource.layerCount = 1;
+      current->srcOffset.x = 0;
+      current->srcOffset.y = 0;
+      current->srcOffset.z = 0;
+      current->dstSubresource = current->srcSubresource;
+      current->dstSubresource.mipLevel = mip_level;
+      current->dstOffset = current->srcOffset;
+      current->extent.width = REI_MAX (upload->width >> mip_level, 1u);
+      current->extent.height = REI_MAX (upload->height >> mip_level, 1u);
+      current->extent.depth = 1;
+    }
+
+    vkCmdCopyImage (
+      cmd_buffer,
+      previous->handle,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      out->handle,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      kept_mip_count,
+      copy_infos
+    );
+
+    _s_set_image_layout_cmd (
+      cmd_buffer,
+      previous,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      kept_mip_count,
+      previous_first_mip
+    );
+  }
 
   _s_set_image_layout_cmd (
     cmd_buffer,
@@ -1360,11 +1504,27 @@ void rei_vk_create_texture_cmd (
     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
     VK_PIPELINE_STAGE_TRANSFER_BIT,
     VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-    1,
+    upload->mip_count,
     0
   );
 }
 
+rei_result_e rei_vk_create_texture_cmd (
+  const rei_vk_device_t* device,
+  rei_vk_allocator_t* allocator,
+  rei_thread_pool_t* thread_pool,
+  VkCommandBuffer cmd_buffer,
+  rei_vk_buffer_t* staging_buffer,
+  const rei_texture_t* src,
+  rei_vk_image_t* out) {
+
+  rei_vk_texture_upload_t upload;
+  const rei_result_e result = rei_vk_create_texture (device, allocator, thread_pool, staging_buffer, src, 0, src->header->mip_count, &upload, out);
+  if (!result) rei_vk_upload_texture_cmd (cmd_buffer, staging_buffer, &upload, NULL, 0, out);
+
+  return result;
+}
+
 void rei_vk_create_texture_raw (
   const rei_vk_device_t* device,
   rei_vk_allocator_t* allocator,
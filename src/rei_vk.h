@@ -166,6 +166,8 @@ typedef struct rei_vk_image_ci_t {
   VkFormat format;
   VkImageUsageFlags usage;
   VkImageAspectFlags aspect_mask;
+  // Of the view, all zero (VK_COMPONENT_SWIZZLE_IDENTITY) keeps the channels as they are.
+  VkComponentMapping swizzle;
 } rei_vk_image_ci_t;
 
 // Stringify VkResult for debugging purposes.
@@ -274,10 +276,57 @@ void rei_vk_copy_buffer_cmd (
   rei_vk_buffer_t* restrict dst
 );
 
-// Decompress and create a texture loaded from a rtex file.
-void rei_vk_create_texture_cmd (
+// Where the levels of a texture prepared by rei_vk_create_texture live in its staging buffer.
+typedef struct rei_vk_texture_upload_t {
+  // Size of the image's first level, which isn't necessarily the first level in the rtex.
+  u32 width;
+  u32 height;
+  // Levels of the image, the first staged_mip_count of them come from the staging buffer.
+  u32 mip_count;
+  u32 staged_mip_count;
+  u64 offsets[REI_TEXTURE_MAX_MIPS];
+} rei_vk_texture_upload_t;
+
+// Create an image for the levels of a texture loaded from a rtex file from first_mip on, and decompress the first
+// staged_mip_count of them into a new staging buffer (none is created if that's zero, see rei_vk_upload_texture_cmd
+// for where the other levels come from). Only the LZ4 layer is undone, block compressed formats get images of their
+// own format and stay compressed in VRAM. Chunks are decompressed across thread_pool if one is given
+// (see rei_texture_unpack). Does not record any commands, so textures can be prepared on multiple threads at once.
+// Fails without creating anything if the staged levels don't decompress.
+rei_result_e rei_vk_create_texture (
+  const rei_vk_device_t* device,
+  rei_vk_allocator_t* allocator,
+  rei_thread_pool_t* thread_pool,
+  rei_vk_buffer_t* staging_buffer,
+  const rei_texture_t* src,
+  u32 first_mip,
+  u32 staged_mip_count,
+  rei_vk_texture_upload_t* upload,
+  rei_vk_image_t* out
+);
+
+// Whether a texture holds sRGB encoded colors in a format Vulkan has no sRGB variant of (BC4, BC5, R8, RG8), which the
+// shader has to decode itself after sampling. Images of other textures decode to linear values on their own.
+b32 rei_vk_is_srgb_in_shader (const rei_texture_header_t* header);
+
+// Record the copy of a texture prepared by rei_vk_create_texture from its staging buffer into the image. Levels that
+// weren't staged are copied from previous, an image of the same texture with previous_mip_count levels that ends on
+// the same level (so it holds the unstaged ones as its smallest). previous is only read and may still be sampled by
+// commands submitted earlier, it's optional if every level was staged.
+void rei_vk_upload_texture_cmd (
+  VkCommandBuffer cmd_buffer,
+  const rei_vk_buffer_t* staging_buffer,
+  const rei_vk_texture_upload_t* upload,
+  rei_vk_image_t* previous,
+  u32 previous_mip_count,
+  rei_vk_image_t* out
+);
+
+// Decompress and create a texture loaded from a rtex file, with all of its levels. Fails like rei_vk_create_texture.
+rei_result_e rei_vk_create_texture_cmd (
   const rei_vk_device_t* device,
   rei_vk_allocator_t* allocator,
+  rei_thread_pool_t* thread_pool,
   VkCommandBuffer cmd_buffer,
   rei_vk_buffer_t* staging_buffer,
   const rei_texture_t* src,